@@ -38,6 +38,7 @@
 #include "type.h"
 #include "support.h"
 #include "fscache.h"
+#include "thumbpack.h"
 
 typedef struct _CellIcon CellIcon;
 typedef struct _CellIconClass CellIconClass;
@@ -203,7 +204,12 @@ static DisplayStyle get_style(GtkCellRenderer *cell)
 
 		if (filer_window->show_thumbs && item->base_type == TYPE_FILE)
 		{
-			if (!view_item->thumb) {
+			if (!view_item->thumb &&
+			    (filer_window->display_style_wanted == SMALL_ICONS ||
+			     filer_window->display_style_wanted == AUTO_SIZE_ICONS))
+				view_item->thumb = thumbpack_load(
+						filer_window->real_path, item);
+			else if (!view_item->thumb) {
 				gchar *path = pathdup(
 						make_path(filer_window->real_path, item->leafname));
 				view_item->thumb = pixmap_load_thumb(path);
@@ -2003,3 +2003,12 @@ int collection_rowcol_to_item(const Collection *collection, int row, int col)
 		return row + col * rows;
 	}
 }
+
+/* Return the first and last rows which are [partly] visible. Rows past the
+ * last item may be included.
+ */
+void collection_get_visible_limits(Collection *collection,
+				   int *first, int *last)
+{
+	get_visible_limits(collection, first, last);
+}
@@ -166,6 +166,8 @@ void    collection_item_to_rowcol       (const Collection *collection,
 					 int item, int *row, int *col);
 int     collection_rowcol_to_item       (const Collection *collection,
 					 int row, int col);
+void	collection_get_visible_limits	(Collection *collection,
+					 int *first, int *last);
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
@@ -41,6 +41,13 @@
  * so that the auto-sizer can make a good guess. It also prevents checking
  * hidden files if they're not going to be displayed.
  *
+ * The recheck list is processed by a pool of threads shared by all
+ * directories. Each job takes a chunk of items from the list and stats them
+ * without holding the directory lock, so a large directory is checked by
+ * several threads at once. Jobs are counted per device, and directories on
+ * network mounts only get a few slots so that one slow server doesn't
+ * starve everything else.
+ *
  * To get the Directory object, use dir_cache, which will automatically
  * trigger a rescan if needed.
  *
@@ -56,6 +63,11 @@
 #include <string.h>
 #include <stdbool.h>
 
+#ifdef HAVE_SYS_INOTIFY_H
+# include <sys/inotify.h>
+# include <poll.h>
+#endif
+
 #include "global.h"
 
 #include "dir.h"
@@ -69,6 +81,8 @@
 #include "type.h"
 #include "main.h"
 #include "options.h"
+#include "dirsnap.h"
+#include "dirtree.h"
 
 /* For debugging. Can't detach when this is non-zero. */
 static int in_callback = 0;
@@ -77,9 +91,92 @@ GFSCache *dir_cache = NULL;
 
 static Option o_purge_dir_cache;
 static Option o_close_dir_when_missing;
+static Option o_restat_remote_jobs;
+static Option o_dir_snapshots;
+static Option o_notify_delay;
+static Option o_stall_time;
+
+/* Items taken from the recheck/examine list at a time by a restat job */
+#define RESTAT_CHUNK 64
+
+typedef struct _MountSlots MountSlots;
+
+/* Restat jobs for one device */
+struct _MountSlots {
+	gint64	dev;
+	int	busy;		/* Jobs pushed to the pool */
+	int	cap;
+	GQueue	pending;	/* Directories waiting for a free slot */
+};
+
+static GThreadPool *restat_pool = NULL;
+static GHashTable *mount_slots = NULL;	/* dev -> MountSlots */
+static GMutex poolm;
+static GCond poolc;			/* Signalled when a job finishes */
+
+typedef struct _RestatJob RestatJob;
+
+/* One restat job's copies of the directory's pathname and an fd open on it,
+ * so that they don't change under a stuck job (see dir_update()).
+ */
+struct _RestatJob {
+	Directory	*dir;
+	gchar		*pathname;
+	int		fd;		/* Or -1 */
+	GString		*buf;
+};
+
+/* How long stop_scan_t() waits for running jobs, which may be stuck */
+#define STOP_WAIT_TIME (250 * 1000)	/* us */
+
+/* How long dir_scan() waits for the reader before going on without it */
+#define SCAN_WAIT_TIME (250 * 1000)	/* us */
+
+typedef struct _ScanRead ScanRead;
+
+/* dir_scan() reads the directory in a thread, which fills this in */
+struct _ScanRead {
+	Directory	*dir;		/* Ref'd until done */
+	gchar		*pathname;
+	gboolean	isupdate;	/* Rescan after a change */
+
+	struct stat	info;
+	int		stat_errno, open_errno;
+	gboolean	remote;
+	GString		*names;		/* d_type, leafname, nul; repeated */
+
+	gboolean	done;		/* (scanm) */
+	gboolean	async;		/* dir_scan() gave up waiting (scanm) */
+};
+
+static GMutex scanm;
+static GCond scanc;			/* Signalled when a reader finishes */
+
+/* dir_merge_new() is run from delayed_notify() no more than once a frame,
+ * and on a frame boundary, so that all directories changing at the same
+ * time update their windows together.
+ */
+#define MERGE_FRAME_TIME 16	/* ms */
+
+#ifdef HAVE_SYS_INOTIFY_H
+typedef struct _NotifyBatch NotifyBatch;
+
+/* Changes to one directory, collected by notify_thread */
+struct _NotifyBatch {
+	GHashTable	*leaves;	/* Children to restat (a set) */
+	gboolean	rescan;		/* Something else happened */
+	gboolean	lost;		/* The kernel dropped the watch */
+};
+
+static int inotify_fd = -1;
+static GMutex notifym;			/* For the two tables below */
+static GHashTable *wd_to_dir = NULL;	/* Watch descriptor -> Directory */
+static GHashTable *notify_pending = NULL;	/* Directory -> NotifyBatch */
+#endif
 
 /* Static prototypes */
 static void fsupdate(Directory *dir, gchar *pathname, gpointer data);
+static void queue_changed(Directory *dir, const gchar *leaf);
 static void call_scan_t(Directory *dir);
 static DirItem *_insert_item(Directory *dir, DirItem *item, const guchar *leafname, gboolean examine_now);
 static DirItem *insert_item(Directory *dir, const guchar *leafname, gboolean examine_now);
@@ -87,15 +184,53 @@ static GPtrArray *hash_to_array(GHashTable *hash);
 static void dir_force_update_item(Directory *dir,
 		const gchar *leaf, gboolean thumb);
 static void dir_scan(Directory *dir);
+static gpointer scan_read_thread(gpointer data);
+static gboolean stall_timeout(gpointer data);
+static gboolean scan_read_done(ScanRead *job);
+static void scan_names(Directory *dir, GString *names);
+static void restat_worker(gpointer data, gpointer user_data);
+static gboolean restat_job_done(gpointer data);
+static void to_front(GPtrArray *list, int start, GHashTable *wanted,
+		     DirItem **found, int n_found);
+static void watch_remove(Directory *dir);
+static void monitor_start(Directory *dir);
+#ifdef HAVE_SYS_INOTIFY_H
+static void batch_free(NotifyBatch *batch);
+static gpointer notify_thread(gpointer data);
+#endif
+static gboolean restat_done(Directory *dir, DirItem **item,
+		DirItem *old, gboolean do_compare);
+static void gone_free(DirItem *item);
+static gboolean in_gone(GHashTable *gone, DirItem *item);
+static gboolean claimed_changed(DirItem *item);
 
 
 void dir_init(void)
 {
 	option_add_int(&o_purge_dir_cache, "purge_dir_cache", FALSE);
 	option_add_int(&o_close_dir_when_missing, "close_dir_when_missing", FALSE);
+	option_add_int(&o_restat_remote_jobs, "dir_restat_remote_jobs", 2);
+	option_add_int(&o_dir_snapshots, "dir_snapshots", FALSE);
+	option_add_int(&o_notify_delay, "dir_notify_delay", 100);
+	option_add_int(&o_stall_time, "dir_stall_time", 3000);
+
+	restat_pool = g_thread_pool_new(restat_worker, NULL,
+			MAX(2, g_get_num_processors()), FALSE, NULL);
+	mount_slots = g_hash_table_new(g_int64_hash, g_int64_equal);
 
 	dir_cache = g_fscache_new((GFSLoadFunc) dir_new,
 				(GFSUpdateFunc) fsupdate, NULL);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (inotify_fd != -1)
+	{
+		wd_to_dir = g_hash_table_new(NULL, NULL);
+		notify_pending = g_hash_table_new_full(NULL, NULL,
+				NULL, (GDestroyNotify) batch_free);
+		g_thread_new("dir_notify", notify_thread, NULL);
+	}
+#endif
 }
 
 
@@ -118,12 +253,325 @@ static void rescan_soon(Directory *dir)
 	if (dir->rescan_timeout != -1) return;
 	dir->rescan_timeout = g_timeout_add(300, rescan_timeout_cb, dir);
 }
+
+/* 'leaf' in dir has changed. Have the restat jobs check it, adding it as
+ * a new item if we don't know it (if it doesn't exist, the restat removes
+ * it again). If a job already has it, it's done again after that job,
+ * since the job may have stat()ed it before the change.
+ * dir->mutex must be held.
+ */
+static void queue_changed(Directory *dir, const gchar *leaf)
+{
+	DirItem *item = g_hash_table_lookup(dir->known_items, leaf);
+
+	if (!item)
+	{
+		item = diritem_new_in(dir->arena, leaf);
+		g_hash_table_insert(dir->known_items, item->leafname, item);
+
+		g_mutex_lock(&dir->mergem);
+		g_ptr_array_add(dir->new_items, item);
+		g_mutex_unlock(&dir->mergem);
+	}
+	else if (claimed_changed(item))
+		return;
+
+	dir_queue_recheck(dir, item);
+}
+
+/* Queue just this child of dir for a restat, if 'file' is one.
+ * Returns FALSE if it isn't (eg, it's the directory itself).
+ */
+static gboolean child_changed(Directory *dir, GFile *file)
+{
+	GFile *parent = file ? g_file_get_parent(file) : NULL;
+	gchar *ppath = parent ? g_file_get_path(parent) : NULL;
+	gboolean child = ppath && strcmp(ppath, dir->pathname) == 0;
+
+	if (child)
+	{
+		gchar *leaf = g_file_get_basename(file);
+
+		time(&diritem_recent_time);
+		g_mutex_lock(&dir->mutex);
+		queue_changed(dir, leaf);
+		g_mutex_unlock(&dir->mutex);
+		g_free(leaf);
+
+		call_scan_t(dir);
+	}
+
+	g_free(ppath);
+	if (parent)
+		g_object_unref(parent);
+
+	return child;
+}
+
 static void monitorcb(GFileMonitor *m, GFile *f,
 		GFile *o, GFileMonitorEvent e, Directory *dir)
 {
-	//don't rescan untile G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT
-	if (e != G_FILE_MONITOR_EVENT_CHANGED)
-		rescan_soon(dir);
+	/* Events about a single item only queue that item for the restat
+	 * jobs (deleted ones go to gone_items). Anything else rescans the
+	 * whole directory.
+	 */
+	switch (e)
+	{
+		case G_FILE_MONITOR_EVENT_CHANGED:
+			//don't restat until G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT
+			return;
+		case G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT:
+		case G_FILE_MONITOR_EVENT_CREATED:
+		case G_FILE_MONITOR_EVENT_DELETED:
+		case G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED:
+			if (child_changed(dir, f))
+				return;
+			break;
+		case G_FILE_MONITOR_EVENT_MOVED:
+			if (child_changed(dir, f))
+			{
+				/* The other end may be elsewhere */
+				child_changed(dir, o);
+				return;
+			}
+			break;
+		default:
+			break;
+	}
+
+	rescan_soon(dir);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* The inotify backend.
+ *
+ * All watched directories share one inotify fd, read by notify_thread.
+ * Events are collected per directory (and per leaf, so a file written
+ * many times is only restatted once) for o_notify_delay ms, and then
+ * passed to the main thread in one go. The items go on the recheck list
+ * for the restat jobs (see queue_changed()).
+ */
+
+static void batch_free(NotifyBatch *batch)
+{
+	g_hash_table_destroy(batch->leaves);
+	g_free(batch);
+}
+
+/* notifym must be held */
+static NotifyBatch *get_batch(Directory *dir)
+{
+	NotifyBatch *batch = g_hash_table_lookup(notify_pending, dir);
+
+	if (!batch)
+	{
+		batch = g_new0(NotifyBatch, 1);
+		batch->leaves = g_hash_table_new_full(g_str_hash, g_str_equal,
+						      g_free, NULL);
+		g_hash_table_insert(notify_pending, dir, batch);
+	}
+
+	return batch;
+}
+
+static void rescan_all(gpointer key, gpointer value, gpointer data)
+{
+	get_batch((Directory *) value)->rescan = TRUE;
+}
+
+/* notifym must be held */
+static void handle_event(struct inotify_event *ev)
+{
+	Directory *dir;
+
+	if (ev->mask & IN_Q_OVERFLOW)
+	{
+		g_hash_table_foreach(wd_to_dir, rescan_all, NULL);
+		return;
+	}
+
+	dir = g_hash_table_lookup(wd_to_dir, GINT_TO_POINTER(ev->wd));
+	if (!dir)
+		return;
+
+	if (ev->mask & IN_IGNORED)
+		get_batch(dir)->lost = TRUE;
+
+	if (ev->len && ev->name[0])
+	{
+		NotifyBatch *batch = get_batch(dir);
+		if (!g_hash_table_contains(batch->leaves, ev->name))
+			g_hash_table_add(batch->leaves, g_strdup(ev->name));
+	}
+	else
+		get_batch(dir)->rescan = TRUE;	/* The directory itself */
+}
+
+/* Restat these items of dir. Main thread. */
+static void apply_batch(Directory *dir, GHashTable *leaves)
+{
+	GHashTableIter iter;
+	gpointer leaf;
+
+	time(&diritem_recent_time);
+
+	g_mutex_lock(&dir->mutex);
+	g_hash_table_iter_init(&iter, leaves);
+	while (g_hash_table_iter_next(&iter, &leaf, NULL))
+		queue_changed(dir, leaf);
+	g_mutex_unlock(&dir->mutex);
+
+	call_scan_t(dir);
+}
+
+static gboolean notify_flush(gpointer data)
+{
+	GHashTable *batches;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_mutex_lock(&notifym);
+	batches = notify_pending;
+	notify_pending = g_hash_table_new_full(NULL, NULL,
+			NULL, (GDestroyNotify) batch_free);
+	g_mutex_unlock(&notifym);
+
+	g_hash_table_iter_init(&iter, batches);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+	{
+		Directory *dir = (Directory *) key;
+		NotifyBatch *batch = (NotifyBatch *) value;
+
+		if (batch->lost)
+		{
+			/* Unmounted or deleted. Watch again if it's back */
+			watch_remove(dir);
+			if (dir->users)
+				monitor_start(dir);
+		}
+
+		if (batch->rescan)
+			rescan_soon(dir);
+		else if (g_hash_table_size(batch->leaves))
+			apply_batch(dir, batch->leaves);
+	}
+
+	g_hash_table_destroy(batches);
+
+	return FALSE;
+}
+
+static gpointer notify_thread(gpointer data)
+{
+	/* Aligned for struct inotify_event */
+	gint64 buf[4096 / sizeof(gint64)];
+	gint64 flush_at = 0;
+
+	for (;;)
+	{
+		struct pollfd pfd = {inotify_fd, POLLIN, 0};
+		int timeout = -1;
+
+		if (flush_at)
+			timeout = MAX(0, (flush_at - g_get_monotonic_time()) / 1000);
+
+		if (poll(&pfd, 1, timeout) > 0)
+		{
+			ssize_t len = read(inotify_fd, buf, sizeof(buf));
+			char *p = (char *) buf;
+
+			if (len < 0 && errno != EINTR && errno != EAGAIN)
+				break;
+
+			g_mutex_lock(&notifym);
+			while (p < (char *) buf + len)
+			{
+				struct inotify_event *ev = (void *) p;
+				handle_event(ev);
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+			if (!flush_at && g_hash_table_size(notify_pending))
+				flush_at = g_get_monotonic_time() +
+					o_notify_delay.int_value * 1000;
+			g_mutex_unlock(&notifym);
+		}
+
+		if (flush_at && g_get_monotonic_time() >= flush_at)
+		{
+			flush_at = 0;
+			g_idle_add(notify_flush, NULL);
+		}
+	}
+
+	return NULL;
+}
+#endif
+
+static gboolean watch_add(Directory *dir)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	int wd;
+
+	if (inotify_fd == -1)
+		return FALSE;
+
+	wd = inotify_add_watch(inotify_fd, dir->pathname,
+			IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE |
+			IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+			IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+	if (wd == -1)
+		return FALSE;	/* eg, out of watches */
+
+	g_mutex_lock(&notifym);
+	dir->notify_wd = wd;
+	g_hash_table_insert(wd_to_dir, GINT_TO_POINTER(wd), dir);
+	g_mutex_unlock(&notifym);
+
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+static void watch_remove(Directory *dir)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	if (dir->notify_wd == -1)
+		return;
+
+	g_mutex_lock(&notifym);
+	if (g_hash_table_lookup(wd_to_dir,
+				GINT_TO_POINTER(dir->notify_wd)) == dir)
+		g_hash_table_remove(wd_to_dir, GINT_TO_POINTER(dir->notify_wd));
+	g_hash_table_remove(notify_pending, dir);
+	g_mutex_unlock(&notifym);
+
+	inotify_rm_watch(inotify_fd, dir->notify_wd);
+	dir->notify_wd = -1;
+#endif
+}
+
+/* Start watching dir for changes, using inotify directly if possible */
+static void monitor_start(Directory *dir)
+{
+	if (watch_add(dir))
+		return;
+
+	GFile *gf = g_file_new_for_path(dir->pathname);
+	dir->monitor = g_file_monitor_directory(gf,
+			G_FILE_MONITOR_WATCH_MOUNTS, //doesn't work?
+			NULL, NULL);
+	g_object_unref(gf);
+
+	if (dir->monitor)
+		g_signal_connect(dir->monitor, "changed",
+				G_CALLBACK(monitorcb), dir);
+}
+
+static void monitor_stop(Directory *dir)
+{
+	watch_remove(dir);
+	g_clear_object(&dir->monitor);
 }
 
 /* Periodically calls callback to notify about changes to the contents
@@ -147,15 +595,7 @@ void dir_attach(Directory *dir, DirCallback callback, gpointer data)
 	user->data = data;
 
 	if (!dir->users)
-	{
-		GFile *gf = g_file_new_for_path(dir->pathname);
-		dir->monitor = g_file_monitor_directory(gf,
-				G_FILE_MONITOR_WATCH_MOUNTS, //doesn't work?
-				NULL, NULL);
-		g_object_unref(gf);
-
-		g_signal_connect(dir->monitor, "changed", G_CALLBACK(monitorcb), dir);
-	}
+		monitor_start(dir);
 	else
 		//clear new_items. note:new_items is only inserted in this thread
 		dir_merge_new(dir);
@@ -230,7 +670,7 @@ void dir_detach(Directory *dir, DirCallback callback, gpointer data)
 
 			if (!dir->users)
 			{
-				g_clear_object(&dir->monitor);
+				monitor_stop(dir);
 
 				if (o_purge_dir_cache.int_value)
 					//don't remove when detach and attach are called in a func
@@ -338,6 +778,98 @@ void dir_queue_recheck(Directory *dir, DirItem *item)
 	}
 }
 
+/* The leafnames of up to 'max' of the subdirectories we know about (the
+ * type may only be a guess from d_type), not counting symlinks and mount
+ * points. For dirtree_prefetch(), so it needn't read the directory again.
+ * g_strfreev() the result.
+ */
+gchar **dir_list_subdirs(Directory *dir, int max)
+{
+	GPtrArray *leaves = g_ptr_array_new();
+	GHashTableIter iter;
+	DirItem *item;
+
+	g_mutex_lock(&dir->mutex);
+	g_hash_table_iter_init(&iter, dir->known_items);
+	while (leaves->len < max &&
+	       g_hash_table_iter_next(&iter, NULL, (gpointer *) &item))
+	{
+		if (item->base_type == TYPE_DIRECTORY &&
+		    !(item->flags & (ITEM_FLAG_SYMLINK | ITEM_FLAG_MOUNT_POINT)))
+			g_ptr_array_add(leaves, g_strdup(item->leafname));
+	}
+	g_mutex_unlock(&dir->mutex);
+
+	g_ptr_array_add(leaves, NULL);
+
+	return (gchar **) g_ptr_array_free(leaves, FALSE);
+}
+
+/* Move any of these items (given in display order) which are still waiting
+ * to be restatted or examined to the front of their queues, so that what
+ * the user can see is done first. The other items keep their order and
+ * follow afterwards.
+ */
+void dir_prioritise(Directory *dir, GPtrArray *items)
+{
+	GHashTable *wanted;
+	DirItem **found;
+	int i;
+
+	wanted = g_hash_table_new(NULL, NULL);
+	found = g_new(DirItem *, items->len);
+
+	g_mutex_lock(&dir->mutex);
+	for (i = 0; i < items->len; i++)
+	{
+		DirItem *item = items->pdata[i];
+
+		if (item->flags & (ITEM_FLAG_IN_RESCAN_QUEUE |
+				   ITEM_FLAG_IN_EXAMINE))
+			g_hash_table_insert(wanted, item, GINT_TO_POINTER(i + 1));
+	}
+
+	if (g_hash_table_size(wanted))
+	{
+		to_front(dir->recheck_list, dir->rechecki,
+				wanted, found, items->len);
+		to_front(dir->examine_list, dir->examinei,
+				wanted, found, items->len);
+	}
+	g_mutex_unlock(&dir->mutex);
+
+	g_free(found);
+	g_hash_table_destroy(wanted);
+}
+
+/* Reorder list[start...] so that the items in 'wanted' come first, in the
+ * order given by their values. 'found' is scratch space for n_found items.
+ * dir->mutex must be held.
+ */
+static void to_front(GPtrArray *list, int start, GHashTable *wanted,
+		     DirItem **found, int n_found)
+{
+	int i, w = list->len;
+
+	memset(found, 0, n_found * sizeof(DirItem *));
+
+	/* Slide the others to the end, keeping their order */
+	for (i = list->len - 1; i >= start; i--)
+	{
+		DirItem *item = list->pdata[i];
+		int pos = GPOINTER_TO_INT(g_hash_table_lookup(wanted, item));
+
+		if (pos)
+			found[pos - 1] = item;
+		else
+			list->pdata[--w] = item;
+	}
+
+	for (i = 0; i < n_found && start < w; i++)
+		if (found[i])
+			list->pdata[start++] = found[i];
+}
+
 static void tousers(Directory *dir, DirAction action, GPtrArray *items)
 {
 	in_callback++;
@@ -358,6 +890,9 @@ static void dir_set_scanning(Directory *dir, gboolean scanning)
 	dir->scanning = scanning;
 	tousers(dir, scanning ? DIR_START_SCAN : DIR_END_SCAN, NULL);
 
+	if (!scanning && dir->snap_dirty && o_dir_snapshots.int_value)
+		dirsnap_save_soon(dir);
+
 #if 0
 	/* Useful for profiling */
 	if (!scanning)
@@ -374,20 +909,95 @@ static void dir_error_changed(Directory *dir)
 	tousers(dir, DIR_ERROR_CHANGED, NULL);
 }
 
+/* poolm must be held */
+static MountSlots *get_slots(Directory *dir)
+{
+	gint64 dev = dir->stat_info.st_dev;
+	MountSlots *slots = g_hash_table_lookup(mount_slots, &dev);
+
+	if (!slots)
+	{
+		slots = g_new0(MountSlots, 1);
+		slots->dev = dev;
+		g_queue_init(&slots->pending);
+		g_hash_table_insert(mount_slots, &slots->dev, slots);
+	}
+
+	slots->cap = dir->remote ?
+		MAX(1, o_restat_remote_jobs.int_value) :
+		g_thread_pool_get_max_threads(restat_pool);
+
+	return slots;
+}
+
+/* Queue enough jobs to get through the lists in parallel.
+ * Each job holds a ref on dir.
+ */
+static void start_restat_jobs(Directory *dir)
+{
+	int todo = dir->recheck_list->len - dir->rechecki +
+		   dir->examine_list->len - dir->examinei;
+	int n = todo / RESTAT_CHUNK + 1;
+
+	g_mutex_lock(&poolm);
+
+	MountSlots *slots = get_slots(dir);
+	n = MIN(n, slots->cap);
+
+	while (n--)
+	{
+		g_object_ref(dir);
+		dir->restat_jobs++;
+		if (slots->busy < slots->cap)
+		{
+			slots->busy++;
+			g_thread_pool_push(restat_pool, dir, NULL);
+		}
+		else
+			g_queue_push_tail(&slots->pending, dir);
+	}
+
+	g_mutex_unlock(&poolm);
+}
+
+/* Stop the restat jobs. Any which are stuck (eg, on a dead network mount)
+ * are left to finish by themselves; they don't do any more work once the
+ * current item is done, and keep dir alive until then.
+ */
 static void stop_scan_t(Directory *dir)
 {
-	if (dir->t_scan)
+	gint64 end = g_get_monotonic_time() + STOP_WAIT_TIME;
+	gboolean waiting = TRUE;
+	int dropped = 0;
+
+	dir->in_scan_thread = FALSE;
+
+	g_mutex_lock(&poolm);
+	if (dir->restat_jobs)
 	{
-		dir->in_scan_thread = FALSE;
-		g_thread_join(dir->t_scan);
-		dir->t_scan = NULL;
+		MountSlots *slots = get_slots(dir);
+
+		while (g_queue_remove(&slots->pending, dir))
+		{
+			dir->restat_jobs--;
+			dropped++;
+		}
+
+		while (dir->restat_jobs && waiting)
+			waiting = g_cond_wait_until(&poolc, &poolm, end);
 	}
+	g_mutex_unlock(&poolm);
+
+	dir->restat_active = FALSE;
+
+	/* The jobs which never started. Our caller has a ref too. */
+	while (dropped--)
+		g_object_unref(dir);
 }
 
-static void stop_scan(gpointer key, gpointer data, gpointer user_data)
+static void stop_scan(gpointer data, gpointer user_data)
 {
-	GFSCacheData *fsdata = (GFSCacheData *) data;
-	Directory *dir = (Directory *) fsdata->data;
+	Directory *dir = (Directory *) data;
 
 	stop_scan_t(dir);
 	dir_set_scanning(dir, FALSE);
@@ -395,7 +1005,7 @@ static void stop_scan(gpointer key, gpointer data, gpointer user_data)
 
 void dir_stop(void)
 {
-	g_hash_table_foreach(dir_cache->inode_to_stats, stop_scan, NULL);
+	g_fscache_foreach(dir_cache, stop_scan, NULL);
 }
 
 static const guchar *make_path_to_buf(GString *buffer, const char *dir, const char *leaf)
@@ -414,109 +1024,266 @@ static gint notify_timeout(gpointer data)
 {
 	Directory	*dir = (Directory *) data;
 
-	dir_merge_new(dir);
+	dir_merge_new(dir);
+
+	dir->notify_active = 0;
+	g_object_unref(dir);
+
+	return FALSE;
+}
+
+/* Call dir_merge_new() after a while. */
+static void delayed_notify(Directory *dir, gboolean mainthread)
+{
+	gint64 now, due;
+
+	if (!mainthread)
+	{
+		dir->req_notify = TRUE;
+		return;
+	}
+
+	if (dir->notify_active)
+		return;
+
+	g_object_ref(dir);
+
+	if (dir->notify_time < DIR_NOTIFY_TIME)
+		dir->notify_time += DIR_NOTIFY_TIME / 4;
+
+	/* Not within a frame of the last merge, and rounded up to the next
+	 * frame boundary.
+	 */
+	now = g_get_monotonic_time() / 1000;
+	due = MAX(now + dir->notify_time, dir->last_merge + MERGE_FRAME_TIME);
+	due += MERGE_FRAME_TIME - 1 - (due + MERGE_FRAME_TIME - 1) % MERGE_FRAME_TIME;
+
+	dir->notify_active = g_timeout_add(due - now, notify_timeout, dir);
+}
+
+/* FALSE if item has been removed from the directory.
+ * dir->mutex must be held.
+ */
+static gboolean item_alive(Directory *dir, DirItem *item)
+{
+	/* GONE may have been lost if gone_free() ran during a restat */
+	return !(item->flags & ITEM_FLAG_GONE) &&
+		g_hash_table_lookup(dir->known_items, item->leafname) == item;
+}
+
+/* If a restat job may have item (or it's waiting for one), mark it to be
+ * done again afterwards and return TRUE. The job's result may be from before
+ * the change, and we mustn't touch the item while it's working on it.
+ * dir->mutex must be held.
+ */
+static gboolean claimed_changed(DirItem *item)
+{
+	if (!(item->flags & (ITEM_FLAG_IN_RESCAN_QUEUE | ITEM_FLAG_IN_EXAMINE)))
+		return FALSE;
+
+	item->flags |= ITEM_FLAG_RESCAN_AGAIN;
+	return TRUE;
+}
+
+/* Drop a list's claim on item (flag is ITEM_FLAG_IN_RESCAN_QUEUE or
+ * ITEM_FLAG_IN_EXAMINE). If the item has been removed from the directory
+ * meanwhile, free it unless something else still refers to it. If it
+ * changed meanwhile, queue it again.
+ * Returns FALSE if the item has gone. dir->mutex must be held.
+ */
+static gboolean release_item(Directory *dir, DirItem *item, int flag)
+{
+	item->flags &= ~flag;
+
+	if (item_alive(dir, item))
+	{
+		/* Changed since it was claimed; see claimed_changed() */
+		if (item->flags & ITEM_FLAG_RESCAN_AGAIN &&
+		    !(item->flags & (ITEM_FLAG_IN_EXAMINE |
+				     ITEM_FLAG_IN_RESCAN_QUEUE)))
+		{
+			item->flags &= ~ITEM_FLAG_RESCAN_AGAIN;
+			dir_queue_recheck(dir, item);
+		}
+		return TRUE;
+	}
+
+	item->flags |= ITEM_FLAG_GONE;
+	if (!(item->flags & (ITEM_FLAG_IN_EXAMINE | ITEM_FLAG_IN_RESCAN_QUEUE)))
+	{
+		/* Still waiting in gone_items, or in a table dir_merge_new() is
+		 * passing to the users? Then gone_free() will do it.
+		 */
+		g_mutex_lock(&dir->mergem);
+		if (!in_gone(dir->gone_items, item))
+		{
+			GSList *next;
+
+			for (next = dir->merging_gone; next; next = next->next)
+				if (in_gone(next->data, item))
+					break;
+			if (!next)
+				diritem_free(item);
+		}
+		g_mutex_unlock(&dir->mergem);
+	}
+
+	return FALSE;
+}
+
+static gboolean in_gone(GHashTable *gone, DirItem *item)
+{
+	return g_hash_table_lookup(gone, item->leafname) == item;
+}
+
+static void recheck_item(RestatJob *job, DirItem *item)
+{
+	Directory *dir = job->dir;
+	DirItem  old = {};
+	gboolean do_compare = FALSE;
+
+	g_mutex_lock(&dir->mutex);
+	if (item_alive(dir, item))
+	{
+		if (item->base_type != TYPE_UNKNOWN)
+		{
+			old = *item;
+			do_compare = TRUE;
+		}
+	}
+	else
+	{
+		release_item(dir, item, ITEM_FLAG_IN_RESCAN_QUEUE);
+		item = NULL;
+	}
+	g_mutex_unlock(&dir->mutex);
+
+	if (!item) return;
+
+	/* IN_RESCAN_QUEUE stays set, so the item can't be freed under us */
+	diritem_restat_at(job->fd,
+			make_path_to_buf(job->buf, job->pathname,
+					 item->leafname),
+			item, &dir->stat_info, FALSE, &dir->mutex);
+
+	g_mutex_lock(&dir->mutex);
+	if (release_item(dir, item, ITEM_FLAG_IN_RESCAN_QUEUE) &&
+			restat_done(dir, &item, &old, do_compare))
+	{
+		if (item && item->flags & ITEM_FLAG_NEED_EXAMINE
+				&& !(item->flags & ITEM_FLAG_IN_EXAMINE))
+		{
+			g_ptr_array_add(dir->examine_list, item);
+			item->flags |= ITEM_FLAG_IN_EXAMINE;
+		}
+		delayed_notify(dir, FALSE);
+	}
+	g_mutex_unlock(&dir->mutex);
+}
+
+static void examine_item(RestatJob *job, DirItem *item)
+{
+	Directory *dir = job->dir;
+	gboolean examine;
+
+	g_mutex_lock(&dir->mutex);
+	examine = item->flags & ITEM_FLAG_NEED_EXAMINE && item_alive(dir, item);
+	g_mutex_unlock(&dir->mutex);
 
-	dir->notify_active = 0;
-	g_object_unref(dir);
+	gboolean changed = examine && diritem_examine_dir(
+			make_path_to_buf(job->buf, job->pathname,
+					 item->leafname), item);
 
-	return FALSE;
+	g_mutex_lock(&dir->mutex);
+	if (release_item(dir, item, ITEM_FLAG_IN_EXAMINE) && changed)
+	{
+		g_mutex_lock(&dir->mergem);
+		g_ptr_array_add(dir->exa_items, item);
+		g_mutex_unlock(&dir->mergem);
+		delayed_notify(dir, FALSE);
+	}
+	g_mutex_unlock(&dir->mutex);
 }
 
-/* Call dir_merge_new() after a while. */
-static void delayed_notify(Directory *dir, gboolean mainthread)
+/* Claim up to RESTAT_CHUNK items from list, starting at *i.
+ * dir->mutex must be held.
+ */
+static int claim_items(GPtrArray *list, int *i, DirItem **chunk)
 {
-	if (!mainthread)
+	int n = 0;
+
+	while (n < RESTAT_CHUNK && list->len > *i)
 	{
-		dir->req_notify = TRUE;
-		return;
+		chunk[n++] = list->pdata[*i];
+		list->pdata[(*i)++] = NULL;
 	}
 
-	if (dir->notify_active)
-		return;
-
-	g_object_ref(dir);
-
-	if (dir->notify_time < DIR_NOTIFY_TIME)
-		dir->notify_time += DIR_NOTIFY_TIME / 4;
+	if (n && list->len == *i)
+	{
+		*i = 0;
+		g_ptr_array_set_size(list, 0);
+	}
 
-	dir->notify_active = g_timeout_add(dir->notify_time, notify_timeout, dir);
+	return n;
 }
 
-/* This is called in the background when there are items on the
- * dir->recheck_list to process.
+/* This is called by a restat job while there are items on the
+ * dir->recheck_list or dir->examine_list to process.
+ * Returns FALSE when there is nothing left to take.
  */
-static gboolean do_recheck(gpointer data)
+static gboolean do_recheck(RestatJob *job)
 {
-	Directory *dir = (Directory *) data;
+	Directory *dir = job->dir;
+	DirItem *chunk[RESTAT_CHUNK];
+	int n;
 
-	g_return_val_if_fail(dir != NULL, FALSE);
+	g_mutex_lock(&dir->mutex);
+	n = claim_items(dir->recheck_list, &dir->rechecki, chunk);
+	if (n)
+		dir->restat_inflight++;
+	g_mutex_unlock(&dir->mutex);
 
-	if (dir->recheck_list->len > dir->rechecki)
+	if (n)
 	{
-		g_mutex_lock(&dir->mutex);
-		DirItem *item = dir->recheck_list->pdata[dir->rechecki];
-		                dir->recheck_list->pdata[dir->rechecki++] = NULL;
-
-		if (item->flags & ITEM_FLAG_GONE)
-			diritem_free(item);
-		else
+		for (int i = 0; i < n; i++)
 		{
-			item->flags &= ~ITEM_FLAG_IN_RESCAN_QUEUE;
-			item = _insert_item(dir, item, item->leafname, FALSE);
-			if (item && item->flags & ITEM_FLAG_NEED_EXAMINE
-					&& !(item->flags & ITEM_FLAG_IN_EXAMINE))
+			if (dir->in_scan_thread)
+				recheck_item(job, chunk[i]);
+			else
 			{
-				g_ptr_array_add(dir->examine_list, item);
-				item->flags |= ITEM_FLAG_IN_EXAMINE;
+				g_mutex_lock(&dir->mutex);
+				release_item(dir, chunk[i], ITEM_FLAG_IN_RESCAN_QUEUE);
+				g_mutex_unlock(&dir->mutex);
 			}
 		}
-		if (dir->recheck_list->len == dir->rechecki)
-		{
-			dir->rechecki = 0;
-			g_ptr_array_free(dir->recheck_list, TRUE);
-			dir->recheck_list = g_ptr_array_new();
-			dir->req_scan_off = TRUE;
-		}
 
+		g_mutex_lock(&dir->mutex);
+		if (--dir->restat_inflight == 0 &&
+				dir->recheck_list->len == dir->rechecki)
+			dir->req_scan_off = TRUE;
 		g_mutex_unlock(&dir->mutex);
 		g_thread_yield();
 
 		return TRUE;
 	}
 
-	if (dir->examine_list->len > dir->examinei)
-	{
-		g_mutex_lock(&dir->mutex);
-		DirItem *item = dir->examine_list->pdata[dir->examinei];
-		                dir->examine_list->pdata[dir->examinei++] = NULL;
-		item->flags &= ~ITEM_FLAG_IN_EXAMINE;
-
-		if (item->flags & ITEM_FLAG_GONE)
-			diritem_free(item);
-		else if (item->flags & ITEM_FLAG_NEED_EXAMINE)
-		{
-			if (diritem_examine_dir(
-						make_path_to_buf(dir->strbuf, dir->pathname, item->leafname), item))
-			{
-				g_mutex_lock(&dir->mergem);
-				g_ptr_array_add(dir->exa_items, item);
-				g_mutex_unlock(&dir->mergem);
-				delayed_notify(dir, FALSE);
-			}
-		}
+	g_mutex_lock(&dir->mutex);
+	n = claim_items(dir->examine_list, &dir->examinei, chunk);
+	g_mutex_unlock(&dir->mutex);
 
-		g_mutex_unlock(&dir->mutex);
-		if (dir->examine_list->len == dir->examinei)
+	for (int i = 0; i < n; i++)
+	{
+		if (dir->in_scan_thread)
+			examine_item(job, chunk[i]);
+		else
 		{
-			dir->examinei = 0;
-			g_ptr_array_free(dir->examine_list, TRUE);
-			dir->examine_list = g_ptr_array_new();
+			g_mutex_lock(&dir->mutex);
+			release_item(dir, chunk[i], ITEM_FLAG_IN_EXAMINE);
+			g_mutex_unlock(&dir->mutex);
 		}
-		else
-			return TRUE;
 	}
 
-	return FALSE;
+	return n > 0;
 }
 
 static GMutex callbackm;
@@ -531,10 +1298,10 @@ static gboolean recheck_callback(gpointer data)
 	dir->idle_callback = 0;
 	g_mutex_unlock(&callbackm);
 
-	GThread *t = dir->t_scan;
+	gboolean active = dir->restat_active;
 	g_object_unref(dir);
 
-	if (!t) return FALSE; //cancelled
+	if (!active) return FALSE; //cancelled
 
 	if (dir->req_scan_off)
 	{
@@ -557,14 +1324,14 @@ static gboolean recheck_callback(gpointer data)
 
 	if (!dir->in_scan_thread)
 	{
-		g_thread_join(dir->t_scan);
-		dir->t_scan = NULL;
-
-		//added by this thread
-		if (dir->recheck_list->len || dir->examine_list->len)
-			while (do_recheck(dir));
+		dir->restat_active = FALSE;
 
-		dir_set_scanning(dir, FALSE);
+		//added by the last jobs
+		if (dir->recheck_list->len > dir->rechecki ||
+				dir->examine_list->len > dir->examinei)
+			call_scan_t(dir);
+		else
+			dir_set_scanning(dir, FALSE);
 	}
 
 	if (dir->req_notify)
@@ -594,30 +1361,76 @@ static void attach_callback(Directory *dir)
 	g_thread_yield();
 }
 
-static gpointer scan_thread(gpointer data)
+static void restat_worker(gpointer data, gpointer user_data)
 {
 	Directory *dir = (Directory *) data;
+	RestatJob job = {dir, NULL, -1, NULL};
+	gboolean last;
+
+	g_mutex_lock(&poolm);
+	job.pathname = g_strdup(dir->pathname);
+	g_mutex_unlock(&poolm);
+	job.buf = g_string_new(NULL);
+
+#ifdef USE_FSTATAT
+	/* Not in call_scan_t(), because this may block */
+	if (dir->in_scan_thread)
+		job.fd = open(job.pathname,
+			      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+
+	while (dir->in_scan_thread && do_recheck(&job))
+	{
+		if (dir->req_notify || dir->req_scan_off)
+			attach_callback(dir);
+	}
+
+	if (job.fd != -1)
+		close(job.fd);
+	g_string_free(job.buf, TRUE);
+	g_free(job.pathname);
 
-	gboolean ret = TRUE;
+	g_mutex_lock(&poolm);
 
-	if (!dir->recheck_list->len)
-		dir->req_scan_off = TRUE;
+	MountSlots *slots = get_slots(dir);
+	Directory *next = g_queue_pop_head(&slots->pending);
+	if (next)
+		g_thread_pool_push(restat_pool, next, NULL);
+	else
+		slots->busy--;
 
-	while (ret)
+	last = dir->restat_jobs == 1;
+	if (last)
 	{
-		if (!dir->in_scan_thread) break;
+		dir->notify_time = 0;
+		dir->in_scan_thread = FALSE;
+	}
+	else
+		dir->restat_jobs--;
 
-		ret = do_recheck(data);
+	g_mutex_unlock(&poolm);
 
-		if (dir->req_notify || dir->req_scan_off)
-			attach_callback(dir);
+	if (last)
+	{
+		/* Still counted, so stop_scan_t() waits for this */
+		attach_callback(dir);
+
+		g_mutex_lock(&poolm);
+		dir->restat_jobs--;
+		g_cond_broadcast(&poolc);
+		g_mutex_unlock(&poolm);
 	}
 
-	dir->notify_time = 0;
-	dir->in_scan_thread = FALSE;
-	attach_callback(dir);
+	/* The last ref may go, and that must happen in the main thread */
+	g_idle_add(restat_job_done, dir);
+}
 
-	return NULL;
+/* Drop the ref a restat job had on its directory */
+static gboolean restat_job_done(gpointer data)
+{
+	g_object_unref((Directory *) data);
+
+	return FALSE;
 }
 
 static void gone_free(DirItem *item)
@@ -630,6 +1443,10 @@ static void gone_free(DirItem *item)
 
 /* Add all the new items to the items array.
  * Notify everyone who is watching us.
+ *
+ * The changes are collected in two sets of arrays, which are swapped here.
+ * The emptied set is kept as the spare for next time, so a long scan
+ * doesn't allocate new ones for every batch.
  */
 void dir_merge_new(Directory *dir)
 {
@@ -640,15 +1457,40 @@ void dir_merge_new(Directory *dir)
 	GPtrArray *exa = dir->exa_items;
 	GHashTable *gone = dir->gone_items;
 
-	dir->new_items = g_ptr_array_new();
-	dir->up_items = g_ptr_array_new();
-	dir->exa_items = g_ptr_array_new();
-	dir->gone_items = g_hash_table_new_full(
-			g_str_hash, g_str_equal, NULL, (GDestroyNotify)gone_free);
+	if (!new->len && !up->len && !exa->len && !g_hash_table_size(gone))
+	{
+		g_mutex_unlock(&dir->mergem);
+		return;
+	}
+
+	dir->snap_dirty = TRUE;
+
+	if (dir->new_spare)
+	{
+		dir->new_items = dir->new_spare;
+		dir->up_items = dir->up_spare;
+		dir->exa_items = dir->exa_spare;
+		dir->gone_items = dir->gone_spare;
+		dir->new_spare = NULL;
+	}
+	else
+	{
+		/* A user's callback is merging from inside another merge */
+		dir->new_items = g_ptr_array_new();
+		dir->up_items = g_ptr_array_new();
+		dir->exa_items = g_ptr_array_new();
+		dir->gone_items = g_hash_table_new_full(g_str_hash,
+				g_str_equal, NULL, (GDestroyNotify) gone_free);
+	}
+
+	/* A restat job may release one of these before we're done */
+	if (g_hash_table_size(gone))
+		dir->merging_gone = g_slist_prepend(dir->merging_gone, gone);
 
 	g_mutex_unlock(&dir->mergem);
 	g_thread_yield();
 
+	dir->last_merge = g_get_monotonic_time() / 1000;
 
 	in_callback++;
 
@@ -661,6 +1503,24 @@ void dir_merge_new(Directory *dir)
 				i--;
 			}
 
+	/* Renamed away, or replaced by a rename; see thumb_md5() */
+	if (g_hash_table_size(gone))
+	{
+		GHashTableIter iter;
+		gpointer key;
+
+		g_hash_table_iter_init(&iter, gone);
+		while (g_hash_table_iter_next(&iter, &key, NULL))
+			pixmap_forget_thumb_name(dir->pathname, key);
+	}
+	for (int i = 0; i < up->len; i++)
+	{
+		DirItem *item = (DirItem *) up->pdata[i];
+
+		if (item->flags & ITEM_FLAG_SYMLINK)
+			pixmap_forget_thumb_name(dir->pathname, item->leafname);
+	}
+
 	for (GList *list = dir->users; list; list = list->next)
 	{
 		DirUser *user = (DirUser *) list->data;
@@ -677,19 +1537,37 @@ void dir_merge_new(Directory *dir)
 
 	in_callback--;
 
-	g_ptr_array_free(new, TRUE);
-	g_ptr_array_free(up, TRUE);
-	g_ptr_array_free(exa, TRUE);
+	g_ptr_array_set_size(new, 0);
+	g_ptr_array_set_size(up, 0);
+	g_ptr_array_set_size(exa, 0);
 
 	if (g_hash_table_size(gone))
 	{
 		g_mutex_lock(&dir->mutex);
-		g_hash_table_destroy(gone);
+		g_hash_table_remove_all(gone);
+		g_mutex_lock(&dir->mergem);
+		dir->merging_gone = g_slist_remove(dir->merging_gone, gone);
+		g_mutex_unlock(&dir->mergem);
 		g_mutex_unlock(&dir->mutex);
 		g_thread_yield();
 	}
-	else
+
+	g_mutex_lock(&dir->mergem);
+	if (dir->new_spare)
+	{
+		g_ptr_array_free(new, TRUE);
+		g_ptr_array_free(up, TRUE);
+		g_ptr_array_free(exa, TRUE);
 		g_hash_table_destroy(gone);
+	}
+	else
+	{
+		dir->new_spare = new;
+		dir->up_spare = up;
+		dir->exa_spare = exa;
+		dir->gone_spare = gone;
+	}
+	g_mutex_unlock(&dir->mergem);
 }
 
 
@@ -700,6 +1578,7 @@ static gboolean compare_items(DirItem  *item, DirItem  *old)
 	 && item->flags == old->flags
 	 && item->size == old->size
 	 && item->mode == old->mode
+	 && item->ino == old->ino
 	 && item->atime == old->atime
 	 && item->ctime == old->ctime
 	 && item->mtime == old->mtime
@@ -715,6 +1594,42 @@ static gboolean compare_items(DirItem  *item, DirItem  *old)
 	return FALSE;
 }
 
+/* Record the result of restatting a known item. 'old' holds its previous
+ * details if do_compare is set. *item is set to NULL if it has been deleted.
+ * Returns TRUE if users need to be told. dir->mutex must be held.
+ */
+static gboolean restat_done(Directory *dir, DirItem **item,
+		DirItem *old, gboolean do_compare)
+{
+	DirItem *it = *item;
+
+	if (it->base_type == TYPE_ERROR && it->lstat_errno == ENOENT)
+	{
+		/* Item has been deleted */
+		if (g_hash_table_remove(dir->known_items, it->leafname))
+		{
+			g_mutex_lock(&dir->mergem);
+			g_hash_table_insert(dir->gone_items, it->leafname, it);
+			g_mutex_unlock(&dir->mergem);
+		}
+
+		*item = NULL;
+		return TRUE;
+	}
+
+	if (it->flags & ITEM_FLAG_NEED_EXAMINE)
+		old->flags |= ITEM_FLAG_NEED_EXAMINE;
+
+	if (do_compare && compare_items(it, old))
+		return FALSE;
+
+	g_mutex_lock(&dir->mergem);
+	g_ptr_array_add(dir->up_items, it);
+	g_mutex_unlock(&dir->mergem);
+
+	return TRUE;
+}
+
 /* Stat this item and add, update or remove it.
  * Returns the new/updated item, if any.
  * (leafname may be from the current DirItem item)
@@ -724,6 +1639,9 @@ static DirItem *_insert_item(Directory *dir, DirItem *item, const guchar *leafna
 {
 	const gchar *full_path = make_path_to_buf(dir->strbuf, dir->pathname, leafname);
 
+	if (item && claimed_changed(item))
+		return item;	/* A restat job will do it */
+
 	if (item)
 	{
 		DirItem  old = {};
@@ -737,34 +1655,12 @@ static DirItem *_insert_item(Directory *dir, DirItem *item, const guchar *leafna
 		}
 		diritem_restat(full_path, item, &dir->stat_info, examine_now);
 
-		if (item->base_type == TYPE_ERROR && item->lstat_errno == ENOENT)
-		{
-			/* Item has been deleted */
-			if (g_hash_table_remove(dir->known_items, item->leafname))
-			{
-				g_mutex_lock(&dir->mergem);
-				g_hash_table_insert(dir->gone_items, item->leafname, item);
-				g_mutex_unlock(&dir->mergem);
-			}
-
-			item = NULL;
-		}
-		else
-		{
-			if (item->flags & ITEM_FLAG_NEED_EXAMINE)
-				old.flags |= ITEM_FLAG_NEED_EXAMINE;
-
-			if (do_compare && compare_items(item, &old))
-				return item;
-
-			g_mutex_lock(&dir->mergem);
-			g_ptr_array_add(dir->up_items, item);
-			g_mutex_unlock(&dir->mergem);
-		}
+		if (!restat_done(dir, &item, &old, do_compare))
+			return item;
 	}
 	else
 	{
-		item = diritem_new(leafname);
+		item = diritem_new_in(dir->arena, leafname);
 		diritem_restat(full_path, item, &dir->stat_info, examine_now);
 
 		if (item->base_type == TYPE_ERROR && item->lstat_errno == ENOENT)
@@ -803,8 +1699,25 @@ static DirItem *insert_item(Directory *dir, const guchar *leafname, gboolean exa
 
 void dir_update(Directory *dir, gchar *pathname)
 {
-	g_free(dir->pathname);
-	dir->pathname = pathdup(pathname);
+	gchar *path = pathdup(pathname);
+
+	if (strcmp(path, dir->pathname) == 0)
+		g_free(path);
+	else
+	{
+		gchar *old = dir->pathname;
+
+		/* Any stuck jobs have their own copy of the pathname.
+		 * New ones copy it under poolm.
+		 */
+		stop_scan_t(dir);
+		dir_set_scanning(dir, FALSE);
+
+		g_mutex_lock(&poolm);
+		dir->pathname = path;
+		g_mutex_unlock(&poolm);
+		g_free(old);
+	}
 
 	if (dir->scanning)
 		dir->needs_update = TRUE;
@@ -822,26 +1735,30 @@ void refresh_dirs(const char *path)
 }
 
 
-/* If there is work to do, set the scan thread.
+/* If there is work to do, start restat jobs.
  * Otherwise, stop scanning.
  */
 static void call_scan_t(Directory *dir)
 {
+	/* Running jobs pick up anything added to the lists, and the lists
+	 * may be empty while they finish the last chunks.
+	 */
+	if (dir->users && dir->restat_active)
+		return;
+
 	if (dir->users &&
 			(dir->recheck_list->len || dir->examine_list->len))
 	{
 		/* Work to do, and someone's watching */
 
-		if (dir->t_scan)
-			return;
-
 		time(&diritem_recent_time);
 		dir_set_scanning(dir, TRUE);
 
-		dir->req_scan_off = FALSE;
+		dir->req_scan_off = dir->recheck_list->len == dir->rechecki;
 		dir->in_scan_thread = TRUE;
 		dir->req_notify = FALSE;
-		dir->t_scan = g_thread_new("rescan_t", scan_thread, dir);
+		dir->restat_active = TRUE;
+		start_restat_jobs(dir);
 	}
 	else
 	{
@@ -925,11 +1842,17 @@ static void dir_finialize(GObject *object)
 
 	g_hash_table_destroy(dir->gone_items);
 
+	g_ptr_array_free(dir->up_spare, TRUE);
+	g_ptr_array_free(dir->exa_spare, TRUE);
+	g_ptr_array_free(dir->new_spare, TRUE);
+	g_hash_table_destroy(dir->gone_spare);
+
 	inlist_clear(dir->recheck_list);
 	inlist_clear(dir->examine_list);
 
 	g_hash_table_foreach_remove(dir->known_items, free_items, NULL);
 	g_hash_table_destroy(dir->known_items);
+	diritem_arena_destroy(dir->arena);
 
 	g_string_free(dir->strbuf, TRUE);
 	g_mutex_clear(&dir->mutex);
@@ -958,18 +1881,27 @@ static void directory_init(GTypeInstance *object, gpointer gclass)
 	g_mutex_init(&dir->mergem);
 	dir->strbuf = g_string_new(NULL);
 
+	dir->arena = diritem_arena_new();
 	dir->known_items = g_hash_table_new(g_str_hash, g_str_equal);
 	dir->recheck_list = g_ptr_array_new();
 	dir->rechecki = 0;
 	dir->examine_list = g_ptr_array_new();
 	dir->examinei = 0;
 	dir->idle_callback = 0;
-	dir->t_scan = NULL;
+	dir->restat_active = FALSE;
+	dir->restat_jobs = 0;
+	dir->restat_inflight = 0;
+	dir->remote = FALSE;
+	dir->scan_read = NULL;
+	dir->stalled = FALSE;
+	dir->stall_timeout = 0;
 	dir->req_scan_off = FALSE;
 	dir->in_scan_thread = FALSE;
 	dir->req_notify = FALSE;
 	dir->scanning = FALSE;
 	dir->have_scanned = FALSE;
+	dir->snap_dirty = FALSE;
+	dir->snap_timeout = 0;
 
 	dir->users = NULL;
 	dir->needs_update = TRUE;
@@ -979,6 +1911,7 @@ static void directory_init(GTypeInstance *object, gpointer gclass)
 	dir->error = NULL;
 	dir->rescan_timeout = -1;
 	dir->monitor = NULL;
+	dir->notify_wd = -1;
 
 	dir->new_items = g_ptr_array_new();
 	dir->up_items = g_ptr_array_new();
@@ -986,6 +1919,13 @@ static void directory_init(GTypeInstance *object, gpointer gclass)
 	dir->gone_items = g_hash_table_new_full(
 			g_str_hash, g_str_equal, NULL, (GDestroyNotify)gone_free);
 
+	dir->new_spare = g_ptr_array_new();
+	dir->up_spare = g_ptr_array_new();
+	dir->exa_spare = g_ptr_array_new();
+	dir->gone_spare = g_hash_table_new_full(
+			g_str_hash, g_str_equal, NULL, (GDestroyNotify)gone_free);
+	dir->merging_gone = NULL;
+	dir->last_merge = 0;
 }
 
 static GType dir_get_type(void)
@@ -1039,6 +1979,33 @@ static gboolean check_delete(gpointer key, gpointer value, gpointer data)
 	return FALSE;
 }
 
+/* Use d_type (when the filesystem gives it) and the name to fill in a
+ * provisional type, so the first DIR_ADD gets the right icons and
+ * dirs-first order. The restat replaces it.
+ */
+static void guess_type(DirItem *item, unsigned char d_type)
+{
+#ifdef DT_DIR
+	switch (d_type)
+	{
+		case DT_DIR:  item->base_type = TYPE_DIRECTORY;    break;
+		case DT_REG:  item->base_type = TYPE_FILE;         break;
+		case DT_FIFO: item->base_type = TYPE_PIPE;         break;
+		case DT_SOCK: item->base_type = TYPE_SOCKET;       break;
+		case DT_CHR:  item->base_type = TYPE_CHAR_DEVICE;  break;
+		case DT_BLK:  item->base_type = TYPE_BLOCK_DEVICE; break;
+		default:      return;	/* Symlinks need the target */
+	}
+
+	item->flags |= ITEM_FLAG_GUESSED;
+
+	if (item->base_type == TYPE_FILE)
+		item->mime_type = type_guess_from_name(item->leafname);
+	if (!item->mime_type)
+		item->mime_type = mime_type_from_base_type(item->base_type);
+#endif
+}
+
 static gboolean checkthiscb(char *path)
 {
 	_dir_check_this(path, true);
@@ -1052,12 +2019,25 @@ static gboolean checkthiscb(char *path)
  */
 static void dir_scan(Directory *dir)
 {
+	ScanRead *job;
+	gint64 end;
+
 	g_return_if_fail(dir != NULL);
 
+	if (dir->scan_read)
+	{
+		/* Still waiting for the last one; go again after it */
+		rescan_soon(dir);
+		return;
+	}
+
 	stop_scan_t(dir);
 
-	const char *pathname = dir->pathname;
-	gboolean isupdate = dir->needs_update && !dir->error;
+	job = g_new0(ScanRead, 1);
+	job->dir = g_object_ref(dir);
+	job->pathname = g_strdup(dir->pathname);
+	job->isupdate = dir->needs_update && !dir->error;
+	job->names = g_string_new(NULL);
 	dir->needs_update = FALSE;
 	mount_update(FALSE);
 
@@ -1067,46 +2047,199 @@ static void dir_scan(Directory *dir)
 		dir_error_changed(dir);
 	}
 
+	dir->scan_read = job;
+	dir_set_scanning(dir, TRUE);
+	g_thread_unref(g_thread_new("dir_scan", scan_read_thread, job));
+
+	/* Normally the reading is done by now, and we carry on as if we had
+	 * done it ourselves. If not, don't hold up the whole filer for it.
+	 */
+	end = g_get_monotonic_time() + SCAN_WAIT_TIME;
+	g_mutex_lock(&scanm);
+	while (!job->done)
+		if (!g_cond_wait_until(&scanc, &scanm, end))
+			break;
+	job->async = !job->done;
+	g_mutex_unlock(&scanm);
+
+	if (job->async)
+		dir->stall_timeout = g_timeout_add(
+				MAX(o_stall_time.int_value, 1), stall_timeout, dir);
+	else
+		scan_read_done(job);
+}
+
+/* Runs in its own thread, as any of these calls may block forever on a
+ * dead network mount.
+ */
+static gpointer scan_read_thread(gpointer data)
+{
+	ScanRead *job = (ScanRead *) data;
+	struct dirent *ent;
+	DIR *d;
+
 	/* Saves statting the parent for each item... */
-	if (mc_stat(pathname, &dir->stat_info))
+	if (mc_stat(job->pathname, &job->info))
+		job->stat_errno = errno;
+	else
 	{
-		if (o_close_dir_when_missing.int_value && isupdate)
+		TreeNode *node;
+
+		job->remote = mount_is_remote(job->pathname);
+
+		/* Already read by a prefetch? */
+		node = dirtree_peek(job->pathname, &job->info);
+		if (node)
+		{
+			for (int i = 0; i < node->n_entries; i++)
+			{
+				TreeEntry *entry = &node->entries[i];
+
+				g_string_append_c(job->names, entry->d_type);
+				g_string_append_len(job->names, entry->leaf,
+						strlen(entry->leaf) + 1);
+			}
+			g_object_unref(node);
+		}
+		else if (!(d = mc_opendir(job->pathname)))
+			job->open_errno = errno;
+		else
+		{
+			while ((ent = mc_readdir(d)))
+			{
+#ifdef DT_DIR
+				g_string_append_c(job->names, ent->d_type);
+#else
+				g_string_append_c(job->names, 0);
+#endif
+				g_string_append_len(job->names, ent->d_name,
+						strlen(ent->d_name) + 1);
+			}
+			mc_closedir(d);
+		}
+	}
+
+	g_mutex_lock(&scanm);
+	job->done = TRUE;
+	if (job->async)
+		g_idle_add((GSourceFunc) scan_read_done, job);
+	else
+		g_cond_broadcast(&scanc);
+	g_mutex_unlock(&scanm);
+
+	return NULL;
+}
+
+static gboolean stall_timeout(gpointer data)
+{
+	Directory *dir = (Directory *) data;
+
+	dir->stall_timeout = 0;
+
+	if (dir->scan_read)
+	{
+		dir->stalled = TRUE;
+		g_free(dir->error);
+		dir->error = g_strdup(_("Not responding; still trying..."));
+		dir_error_changed(dir);
+	}
+
+	return FALSE;
+}
+
+/* The reader has finished (in the main thread). Make DirItems for the names
+ * it found and carry on with the scan.
+ */
+static gboolean scan_read_done(ScanRead *job)
+{
+	Directory *dir = job->dir;
+
+	dir->scan_read = NULL;
+	if (dir->stall_timeout)
+	{
+		g_source_remove(dir->stall_timeout);
+		dir->stall_timeout = 0;
+	}
+	if (dir->stalled)
+	{
+		/* It's back */
+		dir->stalled = FALSE;
+		null_g_free(&dir->error);
+		dir_error_changed(dir);
+	}
+
+	if (job->stat_errno)
+	{
+		dir_set_scanning(dir, FALSE);
+		if (o_close_dir_when_missing.int_value && job->isupdate)
 			g_idle_add((GSourceFunc)filer_close_recursive, g_strdup(dir->pathname));
 		else
 		{
 			dir->error = g_strdup_printf(_("Can't stat directory: %s"),
-					g_strerror(errno));
+					g_strerror(job->stat_errno));
 			dir_error_changed(dir);
 		}
-		return;		/* Report on attach */
+		goto out;	/* Report on attach */
 	}
 
-	DIR *d = mc_opendir(pathname);
-	if (!d)
+	dir->stat_info = job->info;
+	dir->remote = job->remote;
+
+	if (job->open_errno)
 	{
+		dir_set_scanning(dir, FALSE);
 		dir->error = g_strdup_printf(_("Can't open directory: %s"),
-				g_strerror(errno));
+				g_strerror(job->open_errno));
 		dir_error_changed(dir);
-		return;		/* Report on attach */
+		goto out;	/* Report on attach */
 	}
 
 	dir_set_scanning(dir, TRUE);
+	scan_names(dir, job->names);
+out:
+	g_string_free(job->names, TRUE);
+	g_free(job->pathname);
+	g_free(job);
+	g_object_unref(dir);
+
+	return FALSE;
+}
+
+/* Add or mark the items for these names, from scan_read_thread() */
+static void scan_names(Directory *dir, GString *names)
+{
+	gboolean rescan = dir->have_scanned;
+	if (!rescan && o_dir_snapshots.int_value && dirsnap_load(dir))
+	{
+		/* Show the saved items now; the scan below checks them */
+		dir->have_scanned = TRUE;
+		dir_merge_new(dir);
+		dir->snap_dirty = FALSE;
+	}
+
 	gdk_flush();
 
-	struct dirent *ent;
-	while ((ent = mc_readdir(d)))
+	/* Stuck restat jobs may still be releasing items */
+	g_mutex_lock(&dir->mutex);
+	g_mutex_lock(&dir->mergem);
+
+	const char *p, *end = names->str + names->len;
+	for (p = names->str; p < end; p += strlen(p) + 1)
 	{
-		if (ent->d_name[0] == '.')
+		unsigned char d_type = *p++;
+		const char *leaf = p;
+
+		if (leaf[0] == '.')
 		{
-			if (ent->d_name[1] == '\0')
+			if (leaf[1] == '\0')
 				continue;		/* Ignore '.' */
-			if (ent->d_name[1] == '.' && ent->d_name[2] == '\0')
+			if (leaf[1] == '.' && leaf[2] == '\0')
 				continue;		/* Ignore '..' */
 		}
 
 		DirItem *old;
 		if (dir->have_scanned &&
-				(old = g_hash_table_lookup(dir->known_items, ent->d_name)))
+				(old = g_hash_table_lookup(dir->known_items, leaf)))
 		{
 			/* ITEM_FLAG_NEED_RESCAN_QUEUE is cleared when the item is added
 			 * to the rescan list.
@@ -1118,8 +2251,9 @@ static void dir_scan(Directory *dir)
 		{
 			DirItem *new;
 
-			new = diritem_new(ent->d_name);
+			new = diritem_new_in(dir->arena, leaf);
 			new->flags |= ITEM_FLAG_NEED_RESCAN_QUEUE;
+			guess_type(new, d_type);
 
 			if (dir->have_scanned)
 				new->flags |= ITEM_FLAG_NOT_DELETE;
@@ -1128,19 +2262,21 @@ static void dir_scan(Directory *dir)
 			g_hash_table_insert(dir->known_items, new->leafname, new);
 		}
 	}
-	mc_closedir(d);
 
 	if (dir->have_scanned)
 	{
 		/* Remove all items and add to gone list */
 		g_hash_table_foreach_remove(dir->known_items, check_delete, dir);
 	}
+	g_mutex_unlock(&dir->mergem);
+
 	inlist_clear(dir->recheck_list);
 	inlist_clear(dir->examine_list);
 	dir->recheck_list = g_ptr_array_sized_new(dir->new_items->len);
 	dir->rechecki = 0;
 	dir->examine_list = g_ptr_array_new();
 	dir->examinei = 0;
+	g_mutex_unlock(&dir->mutex);
 
 	dir_merge_new(dir);
 
@@ -1152,7 +2288,7 @@ static void dir_scan(Directory *dir)
 
 	call_scan_t(dir);
 
-	if (dir->have_scanned)
+	if (rescan)
 		//this means files are changed by rox
 		//by other prog, still needs the scan btn because it is very heavy.
 		//and this func is called in the lock of fscache. so have to be idle
@@ -62,24 +62,39 @@ struct _Directory
 	int			notify_time;	/* Time of Notify timeout */
 	gint		idle_callback;	/* Idle callback ID */
 	gboolean	in_scan_thread, req_scan_off, req_notify;
-	GThread		*t_scan;
+	gboolean	restat_active;	/* Restat jobs started, not yet reaped */
+	int		restat_jobs;	/* Jobs queued or running (poolm) */
+	int		restat_inflight;/* Recheck chunks being restatted */
+	gboolean	remote;		/* On a network filesystem */
+	gpointer	scan_read;	/* dir_scan()'s reader, until it's done */
+	gboolean	stalled;	/* The reader is taking too long */
+	guint		stall_timeout;
 
 	GMutex		mutex;
 	GMutex		mergem;
 	GString		*strbuf;
 
+	DirArena	*arena;		/* Where our DirItems live */
 	GHashTable 	*known_items;	/* What our users know about */
 	GPtrArray	*new_items;	/* New items to add in */
 	GPtrArray	*up_items;	/* Items to redraw */
 	GPtrArray	*exa_items;	/* Items to redraw */
 	GHashTable 	*gone_items;	/* Items removed */
 
+	/* Empty, to be swapped with the above by dir_merge_new() */
+	GPtrArray	*new_spare, *up_spare, *exa_spare;
+	GHashTable	*gone_spare;
+	GSList		*merging_gone;	/* gone_items in dir_merge_new() */
+	gint64		last_merge;	/* When dir_merge_new() last ran (ms) */
+
 	GPtrArray	*recheck_list;	/* Items to check on callback */
 	int rechecki;
 	GPtrArray	*examine_list;	/* Items to examine on callback */
 	int examinei;
 
 	gboolean	have_scanned;	/* TRUE after first complete scan */
+	gboolean	snap_dirty;	/* Changed since the snapshot was saved */
+	guint		snap_timeout;	/* See dirsnap_save_soon() */
 	gboolean	scanning;	/* TRUE if we sent DIR_START_SCAN */
 
 	/* Indicates that the directory needs to be rescanned.
@@ -94,7 +109,8 @@ struct _Directory
 
 	gint		rescan_timeout;	/* See dir_rescan_soon() */
 
-	GFileMonitor *monitor;
+	GFileMonitor *monitor;	/* If notify_wd can't be used */
+	int		notify_wd;	/* inotify watch, or -1 */
 };
 
 void dir_init(void);
@@ -109,6 +125,8 @@ void dir_merge_new(Directory *dir);
 void dir_force_update_path(const gchar *path, gboolean icon);
 void dir_drop_all_notifies(void);
 void dir_queue_recheck(Directory *dir, DirItem *item);
+void dir_prioritise(Directory *dir, GPtrArray *items);
+gchar **dir_list_subdirs(Directory *dir, int max);
 void dir_stop(void); /* stop all scan thread */
 
 #endif /* _DIR_H */
@@ -28,6 +28,7 @@
 
 #include <gtk/gtk.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
@@ -42,6 +43,7 @@
 #include "usericons.h"
 #include "options.h"
 #include "fscache.h"
+#include "dirtree.h"
 #include "pixmaps.h"
 #include "xtypes.h"
 
@@ -56,6 +58,218 @@ static GSList *mfree = NULL; //free on main loop
 static GSList *munref = NULL; //unref on main loop
 static guint onmainidle = 0;
 
+/* Counting stops after this many entries (0 => count them all) */
+static Option o_dir_count_limit;
+
+/* Directory sizes (entry counts), so a directory is only read again once
+ * it has changed. Other threads may be reading a DirCount, so one in the
+ * cache is never changed; a new one replaces it (under the cache's lock).
+ */
+static GFSCache *count_cache = NULL;
+#define COUNT_PURGE_TIME (60 * 60)
+
+typedef struct _DirCount DirCount;
+
+struct _DirCount {
+	GObject		object;
+	int		count;
+	gboolean	approx;		/* Stopped at 'limit'; there are more */
+	int		limit;		/* o_dir_count_limit when counted */
+};
+
+/* Items (with their strings) are bump-allocated from 64K chunks. A chunk
+ * counts its live items and is freed when the last one goes, unless it's
+ * the one currently being filled.
+ */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+typedef struct _ArenaChunk ArenaChunk;
+
+struct _ArenaChunk {
+	DirArena	*arena;
+	ArenaChunk	*prev, *next;
+	int		live;		/* Items not yet freed */
+	gsize		used;
+	gint64		data[];		/* (for alignment) */
+};
+
+struct _DirArena {
+	GMutex		mutex;
+	ArenaChunk	*chunks;	/* Newest (being filled) first */
+};
+
+/* arena->mutex must be held */
+static void chunk_free(DirArena *arena, ArenaChunk *chunk)
+{
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		arena->chunks = chunk->next;
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+
+	g_free(chunk);
+}
+
+/* Space for an item of 'size' bytes, or NULL if it's too big to share a
+ * chunk. arena->mutex must be held.
+ */
+static gpointer arena_alloc(DirArena *arena, gsize size, ArenaChunk **ret)
+{
+	ArenaChunk *chunk = arena->chunks;
+	gpointer mem;
+
+	size = (size + 7) & ~(gsize) 7;
+	if (size > ARENA_CHUNK_SIZE / 8)
+		return NULL;
+
+	if (!chunk || chunk->used + size > ARENA_CHUNK_SIZE)
+	{
+		if (chunk && chunk->live == 0)
+			chunk_free(arena, chunk);
+
+		chunk = g_malloc(sizeof(ArenaChunk) + ARENA_CHUNK_SIZE);
+		chunk->arena = arena;
+		chunk->prev = NULL;
+		chunk->next = arena->chunks;
+		chunk->live = 0;
+		chunk->used = 0;
+		if (chunk->next)
+			chunk->next->prev = chunk;
+		arena->chunks = chunk;
+	}
+
+	mem = (char *) chunk->data + chunk->used;
+	chunk->used += size;
+	chunk->live++;
+	*ret = chunk;
+
+	return mem;
+}
+
+/* Allocate the item with its strings in one block.
+ * collatekey may be NULL, to make it later.
+ */
+static DirItem *new_item(DirArena *arena,
+		const guchar *leafname, const char *collatekey)
+{
+	gsize leaflen = strlen(leafname) + 1;
+	gsize keylen = collatekey ? strlen(collatekey) + 1 : 0;
+	gsize size = sizeof(DirItem) + leaflen + keylen;
+	ArenaChunk *chunk = NULL;
+	DirItem *item = NULL;
+
+	if (arena)
+	{
+		g_mutex_lock(&arena->mutex);
+		item = arena_alloc(arena, size, &chunk);
+		g_mutex_unlock(&arena->mutex);
+	}
+	if (!item)
+		item = g_malloc(size);
+
+	memset(item, 0, sizeof(DirItem));
+	item->_chunk = chunk;
+	item->leafname = (char *) (item + 1);
+	memcpy(item->leafname, leafname, leaflen);
+	if (collatekey)
+	{
+		item->collatekey = item->leafname + leaflen;
+		memcpy(item->collatekey, collatekey, keylen);
+	}
+	item->base_type = TYPE_UNKNOWN;
+
+	return item;
+}
+
+/* TRUE if the key is stored in the item's block, rather than made later */
+static gboolean key_inline(DirItem *item)
+{
+	return item->collatekey ==
+		item->leafname + strlen(item->leafname) + 1;
+}
+
+/* g_free() the result */
+static gchar *make_collatekey(const char *leafname)
+{
+	const char *p;
+	gchar buf[256];
+	gchar *key;
+
+	for (p = leafname; *p && !(*p & 0x80); p++)
+		;
+
+	if (!*p && p - leafname < sizeof(buf))
+	{
+		/* ASCII: no need to validate, convert or fold case with the
+		 * Unicode tables.
+		 */
+		int i;
+
+		for (i = 0; leafname[i]; i++)
+			buf[i] = g_ascii_tolower(leafname[i]);
+		buf[i] = '\0';
+
+		return g_utf8_collate_key_for_filename(buf, i);
+	}
+
+	gchar *to_free = NULL;
+	if (!g_utf8_validate(leafname, -1, NULL))
+		leafname = to_free = to_utf8(leafname);
+
+	gchar *tmp = g_utf8_strdown(leafname, -1);
+	key = g_utf8_collate_key_for_filename(tmp, -1);
+	g_free(tmp);
+
+	if (to_free)
+		g_free(to_free);	/* Only taken for invalid UTF-8 */
+
+	return key;
+}
+
+/* Keys are made in chunks of this many items */
+#define KEY_CHUNK 512
+
+typedef struct _KeyBatch KeyBatch;
+
+/* Keys being made by diritem_make_collatekeys() */
+struct _KeyBatch {
+	GPtrArray	*items;
+	gint		next;		/* Start of the next chunk (atomic) */
+	int		helpers;	/* key_pool jobs still running (keym) */
+};
+
+static GThreadPool *key_pool = NULL;	/* Shared by all windows */
+static GMutex keym;
+static GCond keyc;
+
+/* Make the keys for chunks of batch until there are none left */
+static void make_keys(KeyBatch *batch)
+{
+	int i;
+
+	while ((i = g_atomic_int_add(&batch->next, KEY_CHUNK)) <
+			batch->items->len)
+	{
+		int end = MIN(batch->items->len, i + KEY_CHUNK);
+
+		for (; i < end; i++)
+			diritem_get_collatekey(batch->items->pdata[i]);
+	}
+}
+
+static void key_worker(gpointer data, gpointer user_data)
+{
+	KeyBatch *batch = (KeyBatch *) data;
+
+	make_keys(batch);
+
+	g_mutex_lock(&keym);
+	if (--batch->helpers == 0)
+		g_cond_broadcast(&keyc);
+	g_mutex_unlock(&keym);
+}
+
 static gboolean onmaincb(void *notused)
 {
 	g_mutex_lock(&m_diritems);
@@ -73,12 +287,135 @@ static gboolean onmaincb(void *notused)
 	return FALSE;
 }
 
+static GType dir_count_get_type(void)
+{
+	static GType type = 0;
+
+	if (!type)
+	{
+		static const GTypeInfo info =
+		{
+			sizeof (GObjectClass),
+			NULL,			/* base_init */
+			NULL,			/* base_finalise */
+			NULL,			/* class_init */
+			NULL,			/* class_finalise */
+			NULL,			/* class_data */
+			sizeof(DirCount),
+			0,			/* n_preallocs */
+			NULL			/* instance_init */
+		};
+
+		type = g_type_register_static(G_TYPE_OBJECT, "DirCount",
+					      &info, 0);
+	}
+
+	return type;
+}
+
+/* Count the entries in a directory, stopping at 'limit' (if not 0) */
+static void count_entries(DirCount *dc, const char *path, int limit)
+{
+	struct stat info;
+	TreeNode *node;
+	DIR *d;
+	struct dirent *ent;
+
+	dc->count = 0;
+	dc->approx = FALSE;
+	dc->limit = limit;
+
+	if (mc_stat(path, &info))
+		return;
+
+	/* Prefetched? */
+	node = dirtree_peek(path, &info);
+	if (node)
+	{
+		dc->count = node->n_entries;
+		if (limit && dc->count > limit)
+		{
+			dc->count = limit;
+			dc->approx = TRUE;
+		}
+		g_object_unref(node);
+		return;
+	}
+
+	/* Where st_nlink is kept up to date it is 2 plus the number of
+	 * subdirectories (other filesystems use 1), which is a lower bound
+	 * on the number of entries. No need to read them if that's enough.
+	 */
+	if (limit && info.st_nlink > 2 && info.st_nlink - 2 >= limit)
+	{
+		dc->count = limit;
+		dc->approx = TRUE;
+		return;
+	}
+
+	d = mc_opendir(path);
+	if (!d)
+		return;
+
+	while ((ent = mc_readdir(d)))
+	{
+		const char *name = ent->d_name;
+
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+
+		if (limit && dc->count >= limit)
+		{
+			dc->approx = TRUE;
+			break;
+		}
+		dc->count++;
+	}
+	mc_closedir(d);
+}
+
+static GObject *load_count(const char *path, gpointer data)
+{
+	DirCount *dc = g_object_new(dir_count_get_type(), NULL);
+
+	count_entries(dc, path, o_dir_count_limit.int_value);
+
+	return (GObject *) dc;
+}
+
+static gboolean purge_counts(gpointer data)
+{
+	g_fscache_purge(count_cache, COUNT_PURGE_TIME);
+
+	return TRUE;
+}
+
+/* stat() or lstat() the item, relative to dirfd if it isn't -1 */
+static int restat_stat(int dirfd, const guchar *path, const char *leaf,
+		struct stat *info, gboolean follow)
+{
+#ifdef USE_FSTATAT
+	if (dirfd != -1)
+		return fstatat(dirfd, leaf, info,
+				follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#endif
+	return follow ? mc_stat(path, info) : mc_lstat(path, info);
+}
+
 /****************************************************************
  *			EXTERNAL INTERFACE			*
  ****************************************************************/
 
 void diritem_init(void)
 {
+	option_add_int(&o_dir_count_limit, "dir_count_limit", 1000);
+
+	count_cache = g_fscache_new(load_count, NULL, NULL);
+	key_pool = g_thread_pool_new(key_worker, NULL,
+			g_get_num_processors(), FALSE, NULL);
+	g_timeout_add_seconds(COUNT_PURGE_TIME / 2, purge_counts, NULL);
+
 	read_globicons();
 }
 
@@ -90,12 +427,31 @@ void diritem_restat(
 		DirItem *retitem,
 		struct stat *parent,
 		gboolean examine_now)
+{
+	diritem_restat_at(-1, path, retitem, parent, examine_now, NULL);
+}
+
+/* As diritem_restat(), but if 'dirfd' is an open descriptor for the parent
+ * directory, the item is stat()ed relative to it by its leafname.
+ * 'path' is still needed for the xattrs and the type checks.
+ * If other threads change the item's ITEM_QUEUE_FLAGS, they hold 'flagm'
+ * (if not NULL) while doing it, and we hold it while writing back.
+ */
+void diritem_restat_at(
+		int dirfd,
+		const guchar *path,
+		DirItem *retitem,
+		struct stat *parent,
+		gboolean examine_now,
+		GMutex *flagm)
 {
 	struct stat	info;
+	int		oldflags, keep;
 
 	g_mutex_lock(&m_diritems);
 	DirItem newitem = *retitem;
 	g_mutex_unlock(&m_diritems);
+	oldflags = newitem.flags;
 
 	DirItem *item = &newitem;
 
@@ -104,12 +460,13 @@ void diritem_restat(
 		(ITEM_FLAG_CAPS | ITEM_FLAG_IN_RESCAN_QUEUE | ITEM_FLAG_IN_EXAMINE);
 	item->mime_type = NULL;
 
-	if (mc_lstat(path, &info) == -1)
+	if (restat_stat(dirfd, path, item->leafname, &info, FALSE) == -1)
 	{
 		item->lstat_errno = errno;
 		item->base_type = TYPE_ERROR;
 		item->size = 0;
 		item->mode = 0;
+		item->ino = 0;
 		item->mtime = item->ctime = item->atime = 0;
 		item->uid = (uid_t) -1;
 		item->gid = (gid_t) -1;
@@ -121,6 +478,7 @@ void diritem_restat(
 		item->lstat_errno = 0;
 		item->size = info.st_size;
 		item->mode = info.st_mode;
+		item->ino = info.st_ino;
 		item->atime = info.st_atime;
 		item->ctime = info.st_ctime;
 		item->mtime = info.st_mtime;
@@ -140,11 +498,13 @@ void diritem_restat(
 			retitem->label = NULL;
 			g_mutex_unlock(&m_diritems);
 		}
-		item->label = xlabel_get(path);
+		/* No xattrs at all => no label; saves a getxattr() */
+		item->label = item->flags & ITEM_FLAG_HAS_XATTR ?
+				xlabel_get(path) : NULL;
 
 		if (S_ISLNK(info.st_mode))
 		{
-			if (mc_stat(path, &info))
+			if (restat_stat(dirfd, path, item->leafname, &info, TRUE))
 				item->base_type = TYPE_ERROR;
 			else
 				item->base_type =
@@ -257,44 +617,121 @@ void diritem_restat(
 	if (!item->mime_type)
 		item->mime_type = mime_type_from_base_type(item->base_type);
 
+	if (flagm)
+		g_mutex_lock(flagm);
 	g_mutex_lock(&m_diritems);
 	if (retitem->_image)
 		munref = g_slist_prepend(munref, retitem->_image);
+	/* May have been made since we took the copy */
+	newitem.collatekey = retitem->collatekey;
+	/* The queue flags may have changed meanwhile too. A NEED_RESCAN_QUEUE
+	 * set since then is a new request, so it isn't cleared.
+	 */
+	keep = ITEM_QUEUE_FLAGS | (ITEM_FLAG_NEED_RESCAN_QUEUE & ~oldflags);
+	newitem.flags = (newitem.flags & ~keep) | (retitem->flags & keep);
 	*retitem = newitem;
 	g_mutex_unlock(&m_diritems);
+	if (flagm)
+		g_mutex_unlock(flagm);
 
 	if (examine_now && item->flags & ITEM_FLAG_NEED_EXAMINE)
 		diritem_examine_dir(path, retitem);
 }
 
 DirItem *diritem_new(const guchar *leafname)
+{
+	return diritem_new_in(NULL, leafname);
+}
+
+/* As diritem_new(), but allocated from arena (if not NULL).
+ * The collatekey is made when first needed (see diritem_get_collatekey()).
+ */
+DirItem *diritem_new_in(DirArena *arena, const guchar *leafname)
 {
 	DirItem		*item;
 
-	item = g_new0(DirItem, 1);
-	item->leafname = g_strdup(leafname);
-	item->base_type = TYPE_UNKNOWN;
+	item = new_item(arena, leafname, NULL);
 
-	//collate key
-	gchar *to_free = NULL;
-	if (!g_utf8_validate(leafname, -1, NULL))
-		leafname = to_free = to_utf8(leafname);
+	if (!(leafname[0] & 0x80))
+	{
+		if (g_ascii_isupper(leafname[0]))
+			item->flags |= ITEM_FLAG_CAPS;
+	}
+	else
+	{
+		gchar *name = g_utf8_validate(leafname, -1, NULL) ?
+			NULL : to_utf8(leafname);
 
-	if (g_unichar_isupper(g_utf8_get_char(leafname)))
-		item->flags |= ITEM_FLAG_CAPS;
+		if (g_unichar_isupper(g_utf8_get_char(name ? name : leafname)))
+			item->flags |= ITEM_FLAG_CAPS;
+		g_free(name);
+	}
 
-	gchar *tmp = g_utf8_strdown(leafname, -1);
-	item->collatekey = g_utf8_collate_key_for_filename(tmp, -1);
-	g_free(tmp);
+	return item;
+}
 
-	if (to_free)
-		g_free(to_free);	/* Only taken for invalid UTF-8 */
+/* The key for sorting by name, making it if it's not there yet.
+ * May be called from any thread.
+ */
+const char *diritem_get_collatekey(DirItem *item)
+{
+	gchar *key = item->collatekey;
 
-	return item;
+	if (key)
+		return key;
+
+	key = make_collatekey(item->leafname);
+
+	g_mutex_lock(&m_diritems);
+	if (item->collatekey)
+	{
+		g_free(key);	/* Someone else got there first */
+		key = item->collatekey;
+	}
+	else
+		item->collatekey = key;
+	g_mutex_unlock(&m_diritems);
+
+	return key;
+}
+
+/* Make the collate keys of these DirItems (the callers only pass items
+ * without one), using all processors. Call before sorting a lot of items
+ * by name, so sort_by_name() finds them ready.
+ */
+void diritem_make_collatekeys(GPtrArray *items)
+{
+	KeyBatch batch = {items, 0, 0};
+	int helpers = MIN(g_get_num_processors(), items->len / KEY_CHUNK) - 1;
+
+	if (helpers > 0)
+	{
+		batch.helpers = helpers;
+		for (int i = 0; i < helpers; i++)
+			g_thread_pool_push(key_pool, &batch, NULL);
+	}
+
+	make_keys(&batch);	/* This thread does some too */
+
+	g_mutex_lock(&keym);
+	while (batch.helpers)
+		g_cond_wait(&keyc, &keym);
+	g_mutex_unlock(&keym);
+}
+
+/* As diritem_new_in(), but reusing a collatekey from an earlier item with
+ * this name (and without setting ITEM_FLAG_CAPS).
+ */
+DirItem *diritem_new_with_key(DirArena *arena,
+		const guchar *leafname, const char *collatekey)
+{
+	return new_item(arena, leafname, collatekey);
 }
 
 void diritem_free(DirItem *item)
 {
+	ArenaChunk *chunk;
+
 	g_return_if_fail(item != NULL);
 
 	if (item->_image)
@@ -302,9 +739,42 @@ void diritem_free(DirItem *item)
 	if (item->label)
 		g_free(item->label);
 
-	g_free(item->collatekey);
-	g_free(item->leafname);
-	g_free(item);
+	if (item->collatekey && !key_inline(item))
+		g_free(item->collatekey);
+
+	chunk = item->_chunk;
+	if (!chunk)
+	{
+		g_free(item);
+		return;
+	}
+
+	DirArena *arena = chunk->arena;
+
+	g_mutex_lock(&arena->mutex);
+	/* The first chunk is still being filled */
+	if (--chunk->live == 0 && chunk != arena->chunks)
+		chunk_free(arena, chunk);
+	g_mutex_unlock(&arena->mutex);
+}
+
+DirArena *diritem_arena_new(void)
+{
+	DirArena *arena = g_new0(DirArena, 1);
+
+	g_mutex_init(&arena->mutex);
+
+	return arena;
+}
+
+/* Frees the memory of all items still in the arena. */
+void diritem_arena_destroy(DirArena *arena)
+{
+	while (arena->chunks)
+		chunk_free(arena, arena->chunks);
+
+	g_mutex_clear(&arena->mutex);
+	g_free(arena);
 }
 
 /* For use by di_image() only. Sets item->_image. */
@@ -339,13 +809,26 @@ gboolean diritem_examine_dir(const guchar *path, DirItem *item)
 	guchar *rpath = pathdup(path); //realpath
 
 	int oldsize = item->size;
-	DIR *d = mc_opendir(rpath);
-	if (d)
+	int oldflags = item->flags;
+	DirCount *dc = g_fscache_lookup(count_cache, rpath);
+	if (dc)
 	{
-		int cnt = 0;
-		while ((mc_readdir(d))) cnt++;
-		item->size = cnt - 2; //. and ..
-		mc_closedir(d);
+		if (dc->limit != o_dir_count_limit.int_value)
+		{
+			g_object_unref(dc);
+			dc = (DirCount *) load_count(rpath, NULL);
+			g_fscache_insert(count_cache, rpath, dc, FALSE);
+		}
+
+		g_mutex_lock(&m_diritems);
+		item->size = dc->count;
+		if (dc->approx)
+			item->flags |= ITEM_FLAG_COUNT_APPROX;
+		else
+			item->flags &= ~ITEM_FLAG_COUNT_APPROX;
+		g_mutex_unlock(&m_diritems);
+
+		g_object_unref(dc);
 	}
 
 	gchar *pathbuf = NULL;
@@ -396,7 +879,8 @@ gboolean diritem_examine_dir(const guchar *path, DirItem *item)
 		goto no_diricon;	/* Too big, or non-regular file */
 
 	/* Try to load image; may still get NULL... */
-	newimage = g_fscache_lookup(pixmap_cache, pathbuf);
+	newimage = g_fscache_lookup_stat(pixmap_cache, pathbuf, &info,
+					 FSCACHE_LOOKUP_CREATE, NULL);
 
 no_diricon:
 
@@ -431,7 +915,8 @@ no_diricon:
 		goto out;	/* Too big, or non-regular file */
 
 	/* Try to load image; may still get NULL... */
-	newimage = g_fscache_lookup(pixmap_cache, pathbuf);
+	newimage = g_fscache_lookup_stat(pixmap_cache, pathbuf, &info,
+					 FSCACHE_LOOKUP_CREATE, NULL);
 
 out:
 	g_free(pathbuf);
@@ -459,5 +944,7 @@ out:
 		return TRUE;
 	}
 
-	return item->size != oldsize;
+	return item->size != oldsize ||
+		(item->flags & ITEM_FLAG_COUNT_APPROX) !=
+		(oldflags & ITEM_FLAG_COUNT_APPROX);
 }
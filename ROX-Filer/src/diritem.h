@@ -9,6 +9,11 @@
 
 #include <sys/types.h>
 
+/* Stat items relative to an open directory, saving a path lookup each */
+#if defined(HAVE_FSTATAT) && !defined(HAVE_LIBVFS)
+# define USE_FSTATAT
+#endif
+
 extern time_t diritem_recent_time;
 
 typedef enum
@@ -33,16 +38,42 @@ typedef enum
 
 	ITEM_FLAG_CAPS      = 0x400,
 	ITEM_FLAG_HAS_XATTR = 0x800, /* Has extended attributes set */
+
+	/* base_type and mime_type were guessed from readdir() and the name
+	 * only. Cleared by the first restat.
+	 */
+	ITEM_FLAG_GUESSED = 0x8000,
+
+	/* Directory with more entries than 'size'; see diritem_examine_dir() */
+	ITEM_FLAG_COUNT_APPROX = 0x10000,
+
+	/* Changed while a restat job had it; queue it again when released */
+	ITEM_FLAG_RESCAN_AGAIN = 0x20000,
 } ItemFlags;
 
+/* Flags the Directory keeps for its queues, rather than facts about the
+ * file. A restat doesn't change them.
+ */
+#define ITEM_QUEUE_FLAGS (ITEM_FLAG_IN_RESCAN_QUEUE | ITEM_FLAG_IN_EXAMINE | \
+			  ITEM_FLAG_GONE | ITEM_FLAG_NOT_DELETE | \
+			  ITEM_FLAG_RESCAN_AGAIN)
+
+/* TRUE if the item hasn't been stat()ed yet, so only its name (and maybe a
+ * guessed type and icon) can be used.
+ */
+#define ITEM_UNSCANNED(item) ((item)->base_type == TYPE_UNKNOWN || \
+				((item)->flags & ITEM_FLAG_GUESSED))
+
 struct _DirItem
 {
 	char		*leafname;
-	char		*collatekey; /* Preprocessed for sorting */
+	char		*collatekey; /* Preprocessed for sorting; NULL until
+				      * diritem_get_collatekey() is called */
 	int		base_type;
 	int		flags;
 	int		lstat_errno;	/* 0 if details are valid */
 	mode_t		mode;
+	ino_t		ino;		/* From lstat(), like the rest */
 	off_t		size;
 	time_t		atime, ctime, mtime;
 	MaskedPixmap	*_image;	/* NULL => leafname only so far */
@@ -50,14 +81,27 @@ struct _DirItem
 	GdkColor	*label;
 	uid_t		uid;
 	gid_t		gid;
+
+	/* Internal use. leafname and collatekey are stored after the
+	 * struct, in the same block, which is in this arena chunk.
+	 */
+	gpointer	_chunk;		/* NULL => from g_malloc() */
 };
 
 void diritem_init(void);
 DirItem *diritem_new(const guchar *leafname);
+DirItem *diritem_new_in(DirArena *arena, const guchar *leafname);
+DirItem *diritem_new_with_key(DirArena *arena,
+		const guchar *leafname, const char *collatekey);
+DirArena *diritem_arena_new(void);
+void diritem_arena_destroy(DirArena *arena);
 void diritem_restat(const guchar *path, DirItem *item, struct stat *parent, gboolean examine_now);
+void diritem_restat_at(int dirfd, const guchar *path, DirItem *item, struct stat *parent, gboolean examine_now, GMutex *flagm);
 MaskedPixmap *_diritem_get_image(DirItem *item, gboolean mainthread);
 void diritem_free(DirItem *item);
 gboolean diritem_examine_dir(const guchar *path, DirItem *item);
+const char *diritem_get_collatekey(DirItem *item);
+void diritem_make_collatekeys(GPtrArray *items);
 
 static inline MaskedPixmap *di_image(DirItem *item)
 {
@@ -0,0 +1,350 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* dirsnap.c - saved copies of large directories' contents
+ *
+ * When a big directory has been fully scanned, its DirItems are written to
+ * ~/.cache/rox.sourceforge.net/ROX-Filer/dirs, in a file named after the
+ * directory's device and inode. The next time the Directory is created
+ * (eg, after a restart) and the directory's mtime still matches, the items
+ * are loaded from it in one pass, so the window fills at once. The normal
+ * scan then runs as if the items had been there all along, removing,
+ * adding and restatting items as needed. Until then, the loaded details
+ * are only treated as guesses.
+ *
+ * Saving waits until the directory has been quiet for a few seconds, so a
+ * burst of rescans writes it once, and the file is written in a thread.
+ *
+ * The file is: a SnapHeader, an array of SnapEntry and a table of
+ * nul-terminated strings (offset 0 is the empty string). It's in native
+ * byte order and is used via g_mapped_file, without any copying except
+ * for the strings we keep.
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <string.h>
+
+#include "global.h"
+
+#include "dir.h"
+#include "diritem.h"
+#include "dirsnap.h"
+#include "type.h"
+
+#define SNAP_MAGIC "ROXDIR2"
+
+/* Don't bother for directories smaller than this */
+#define SNAP_MIN_ITEMS 100
+
+/* Save this long (in seconds) after the scan that changed it */
+#define SNAP_SAVE_DELAY 5
+
+/* Flags worth keeping; the rest are about the queues or are time-based */
+#define SNAP_FLAGS (ITEM_FLAG_SYMLINK | ITEM_FLAG_APPDIR | \
+		    ITEM_FLAG_MOUNT_POINT | ITEM_FLAG_MOUNTED | \
+		    ITEM_FLAG_EXEC_FILE | ITEM_FLAG_NEED_EXAMINE | \
+		    ITEM_FLAG_CAPS | ITEM_FLAG_HAS_XATTR | \
+		    ITEM_FLAG_COUNT_APPROX)
+
+typedef struct _SnapHeader SnapHeader;
+typedef struct _SnapEntry SnapEntry;
+typedef struct _SnapWrite SnapWrite;
+
+struct _SnapHeader {
+	char	magic[8];
+	gint64	dev, ino, mtime;	/* Of the directory */
+	guint32	n_items;
+	guint32	strings;		/* Offset of the string table */
+};
+
+struct _SnapEntry {
+	guint32	leaf, collate, mime;	/* String offsets (mime 0 => NULL) */
+	gint32	base_type, flags, lstat_errno;
+	guint32	mode, uid, gid;
+	guint32	pad;
+	gint64	ino, size, atime, ctime, mtime;
+};
+
+/* A snapshot for write_thread() to save */
+struct _SnapWrite {
+	gchar		*path;
+	GByteArray	*file;
+};
+
+/* Static prototypes */
+static gchar *snap_path(struct stat *info);
+static guint32 add_string(GString *strings, const char *str);
+static gboolean save_timeout(gpointer data);
+static void dirsnap_save(Directory *dir);
+static gpointer write_thread(gpointer data);
+
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+/* If there is an up-to-date snapshot of this directory, add its items to
+ * known_items and new_items, marked as guessed and needing a recheck.
+ * dir->stat_info must be filled in. Returns TRUE if items were loaded.
+ */
+gboolean dirsnap_load(Directory *dir)
+{
+	GMappedFile *map;
+	gchar *path;
+	const char *data, *strings;
+	const SnapHeader *head;
+	const SnapEntry *ent;
+	gsize len, slen;
+
+	path = snap_path(&dir->stat_info);
+	map = g_mapped_file_new(path, FALSE, NULL);
+	g_free(path);
+	if (!map)
+		return FALSE;
+
+	data = g_mapped_file_get_contents(map);
+	len = g_mapped_file_get_length(map);
+	head = (const SnapHeader *) data;
+
+	if (len < sizeof(SnapHeader) + 1 || data[len - 1] != '\0' ||
+	    memcmp(head->magic, SNAP_MAGIC, sizeof(head->magic)) != 0 ||
+	    head->dev != (gint64) dir->stat_info.st_dev ||
+	    head->ino != (gint64) dir->stat_info.st_ino ||
+	    head->mtime != (gint64) dir->stat_info.st_mtime ||
+	    head->strings < sizeof(SnapHeader) || head->strings >= len ||
+	    (head->strings - sizeof(SnapHeader)) % sizeof(SnapEntry) != 0 ||
+	    head->n_items != (head->strings - sizeof(SnapHeader)) /
+	    			sizeof(SnapEntry))
+	{
+		g_mapped_file_unref(map);
+		return FALSE;
+	}
+
+	ent = (const SnapEntry *) (head + 1);
+	strings = data + head->strings;
+	slen = len - head->strings;
+
+	g_mutex_lock(&dir->mutex);
+	for (guint32 i = 0; i < head->n_items; i++, ent++)
+	{
+		DirItem *item;
+
+		if (ent->leaf == 0 || ent->leaf >= slen ||
+		    ent->collate >= slen || ent->mime >= slen)
+			continue;
+		if (g_hash_table_lookup(dir->known_items, strings + ent->leaf))
+			continue;
+
+		if (ent->collate)
+			item = diritem_new_with_key(dir->arena,
+					strings + ent->leaf, strings + ent->collate);
+		else
+			item = diritem_new_in(dir->arena, strings + ent->leaf);
+		item->base_type = ent->base_type;
+		item->flags = (ent->flags & SNAP_FLAGS) |
+				ITEM_FLAG_NEED_RESCAN_QUEUE | ITEM_FLAG_GUESSED;
+		item->lstat_errno = ent->lstat_errno;
+		item->mode = ent->mode;
+		item->ino = ent->ino;
+		item->uid = ent->uid;
+		item->gid = ent->gid;
+		item->size = ent->size;
+		item->atime = ent->atime;
+		item->ctime = ent->ctime;
+		item->mtime = ent->mtime;
+		item->mime_type = ent->mime ?
+			mime_type_lookup(strings + ent->mime) : NULL;
+
+		g_hash_table_insert(dir->known_items, item->leafname, item);
+		g_ptr_array_add(dir->new_items, item);
+	}
+	g_mutex_unlock(&dir->mutex);
+
+	g_mapped_file_unref(map);
+
+	return dir->new_items->len > 0;
+}
+
+/* Save dir's snapshot once it has been left alone for SNAP_SAVE_DELAY.
+ * Call when a scan which changed it has finished.
+ */
+void dirsnap_save_soon(Directory *dir)
+{
+	if (dir->snap_timeout)
+		g_source_remove(dir->snap_timeout);
+	else
+		g_object_ref(dir);
+
+	dir->snap_timeout = g_timeout_add_seconds(SNAP_SAVE_DELAY,
+						   save_timeout, dir);
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+static gboolean save_timeout(gpointer data)
+{
+	Directory *dir = (Directory *) data;
+
+	dir->snap_timeout = 0;
+
+	/* If it's being scanned again, the end of that scan will do it */
+	if (dir->snap_dirty && !dir->scanning)
+	{
+		dir->snap_dirty = FALSE;
+		dirsnap_save(dir);
+	}
+
+	g_object_unref(dir);
+	return FALSE;
+}
+
+/* Write all the scanned items in dir to its snapshot file. The items are
+ * copied here; write_thread() does the rest.
+ */
+static void dirsnap_save(Directory *dir)
+{
+	SnapWrite *job;
+	GHashTableIter iter;
+	GHashTable *mimes;
+	GByteArray *file;
+	GString *strings;
+	SnapHeader head = {SNAP_MAGIC};
+	gpointer value;
+
+	if (g_hash_table_size(dir->known_items) < SNAP_MIN_ITEMS)
+		return;
+
+	file = g_byte_array_new();
+	strings = g_string_new_len("", 1);
+	mimes = g_hash_table_new(NULL, NULL);	/* MIME_type -> offset */
+
+	g_byte_array_append(file, (guint8 *) &head, sizeof(head));
+
+	g_mutex_lock(&dir->mutex);
+	g_hash_table_iter_init(&iter, dir->known_items);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		DirItem *item = (DirItem *) value;
+		SnapEntry ent = {0};
+
+		/* Items guessed from an earlier snapshot (rather than from
+		 * d_type) still have the details of a real restat.
+		 */
+		if (item->base_type == TYPE_UNKNOWN ||
+		    item->base_type == TYPE_ERROR ||
+		    (item->flags & ITEM_FLAG_GUESSED && item->mode == 0))
+			continue;
+
+		ent.leaf = add_string(strings, item->leafname);
+		ent.collate = item->collatekey ?
+			add_string(strings, item->collatekey) : 0;
+		if (item->mime_type)
+		{
+			ent.mime = GPOINTER_TO_UINT(
+				g_hash_table_lookup(mimes, item->mime_type));
+			if (!ent.mime)
+			{
+				gchar *name = g_strconcat(
+						item->mime_type->media_type, "/",
+						item->mime_type->subtype, NULL);
+				ent.mime = add_string(strings, name);
+				g_free(name);
+				g_hash_table_insert(mimes, item->mime_type,
+						GUINT_TO_POINTER(ent.mime));
+			}
+		}
+		ent.base_type = item->base_type;
+		ent.flags = item->flags & SNAP_FLAGS;
+		ent.lstat_errno = item->lstat_errno;
+		ent.mode = item->mode;
+		ent.ino = item->ino;
+		ent.uid = item->uid;
+		ent.gid = item->gid;
+		ent.size = item->size;
+		ent.atime = item->atime;
+		ent.ctime = item->ctime;
+		ent.mtime = item->mtime;
+
+		g_byte_array_append(file, (guint8 *) &ent, sizeof(ent));
+		head.n_items++;
+	}
+	g_mutex_unlock(&dir->mutex);
+
+	head.dev = dir->stat_info.st_dev;
+	head.ino = dir->stat_info.st_ino;
+	head.mtime = dir->stat_info.st_mtime;
+	head.strings = file->len;
+	memcpy(file->data, &head, sizeof(head));
+	g_byte_array_append(file, (guint8 *) strings->str, strings->len + 1);
+
+	g_hash_table_destroy(mimes);
+	g_string_free(strings, TRUE);
+
+	job = g_new(SnapWrite, 1);
+	job->path = snap_path(&dir->stat_info);
+	job->file = file;
+	g_thread_unref(g_thread_new("dirsnap", write_thread, job));
+}
+
+/* g_file_set_contents() may fsync(), which can take a long time */
+static gpointer write_thread(gpointer data)
+{
+	SnapWrite *job = (SnapWrite *) data;
+	gchar *snapdir;
+
+	snapdir = g_path_get_dirname(job->path);
+	if (g_mkdir_with_parents(snapdir, 0700) == 0)
+		g_file_set_contents(job->path, (gchar *) job->file->data,
+				    job->file->len, NULL);
+	g_free(snapdir);
+
+	g_byte_array_free(job->file, TRUE);
+	g_free(job->path);
+	g_free(job);
+
+	return NULL;
+}
+
+/* g_free() the result */
+static gchar *snap_path(struct stat *info)
+{
+	gchar *leaf, *path;
+
+	leaf = g_strdup_printf("%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x",
+			(gint64) info->st_dev, (gint64) info->st_ino);
+	path = g_build_filename(g_get_user_cache_dir(), SITE, PROJECT,
+				"dirs", leaf, NULL);
+	g_free(leaf);
+
+	return path;
+}
+
+/* Returns the offset of the copy */
+static guint32 add_string(GString *strings, const char *str)
+{
+	guint32 offset = strings->len;
+
+	g_string_append_len(strings, str, strlen(str) + 1);
+
+	return offset;
+}
@@ -0,0 +1,432 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* dirtree.c - shared listings of the directories below the open ones
+ *
+ * A TreeNode is the sorted list of names in a directory, with the lstat()
+ * details of each. Nodes are kept in a GFSCache, so a directory is only read
+ * again once it has changed, and the cache has a byte budget.
+ *
+ * When a window has finished its first scan, dirtree_prefetch() reads the
+ * directories below it (down to the 'dir_prefetch_depth' option) in a
+ * background thread. The window gives the first level itself, so its own
+ * (maybe huge) directory isn't read again. Anything which wants the contents
+ * of a directory without displaying it (counting entries, directory
+ * thumbnails) can then use the same listing, and opening one of the
+ * subdirectories doesn't have to wait for the disk.
+ *
+ * Only the names are checked against the directory; the details of each
+ * entry are as they were at read_time. Only directories are lstat()ed; the
+ * other entries just have their d_type.
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "global.h"
+
+#include "diritem.h"
+#include "dirtree.h"
+#include "fscache.h"
+#include "mount.h"
+#include "options.h"
+#include "support.h"
+
+/* How much memory the listings may use */
+#define TREE_BUDGET (8 * 1024 * 1024)
+
+/* Larger directories are read when asked for, but not kept */
+#define TREE_MAX_ENTRIES 5000
+
+#define TREE_PURGE_TIME (10 * 60)
+
+typedef struct _Prefetch Prefetch;
+
+struct _Prefetch {
+	gchar	*path;
+	gchar	**subdirs;	/* Leafnames in path */
+	int	gen;		/* prefetch_gen when queued */
+};
+
+/* Levels of subdirectories to read in advance (0 => don't) */
+static Option o_prefetch_depth;
+
+static GObjectClass *parent_class = NULL;
+
+static GFSCache *tree_cache = NULL;
+static GThreadPool *prefetch_pool = NULL;
+static gint prefetch_gen = 0;		/* Only the newest prefetch runs */
+
+/* Static prototypes */
+static GType tree_node_get_type(void);
+static void tree_node_class_init(gpointer gclass, gpointer data);
+static void tree_node_finialize(GObject *object);
+static GObject *load_node(const char *path, gpointer data);
+static gsize node_bytes(gpointer node, gpointer data);
+static gint cmp_names(gconstpointer a, gconstpointer b);
+static TreeNode *read_node(const char *path);
+static void prefetch_worker(gpointer data, gpointer user_data);
+static gboolean purge_nodes(gpointer data);
+
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+void dirtree_init(void)
+{
+	option_add_int(&o_prefetch_depth, "dir_prefetch_depth", 1);
+
+	/* Nodes are shared between threads, so out-of-date ones are
+	 * replaced rather than updated.
+	 */
+	tree_cache = g_fscache_new(load_node, NULL, NULL);
+	g_fscache_set_budget(tree_cache, node_bytes, TREE_BUDGET);
+	g_timeout_add_seconds(TREE_PURGE_TIME / 2, purge_nodes, NULL);
+
+	/* One thread, so prefetching never competes with itself */
+	prefetch_pool = g_thread_pool_new(prefetch_worker, NULL, 1, FALSE, NULL);
+}
+
+/* The listing of 'path', read now if there isn't an up-to-date one.
+ * May block; can be used from any thread. NULL if the directory can't be
+ * read. g_object_unref() the result.
+ */
+TreeNode *dirtree_get(const char *path)
+{
+	struct stat info;
+	TreeNode *node;
+
+	if (mc_stat(path, &info))
+		return NULL;
+
+	node = dirtree_peek(path, &info);
+	if (node)
+		return node;
+
+	node = read_node(path);
+	if (node && tree_cache && node->n_entries <= TREE_MAX_ENTRIES)
+		g_fscache_insert(tree_cache, path, node, TRUE);
+
+	return node;
+}
+
+/* As dirtree_get(), but never reads the directory. 'info' is the result
+ * of stat()ing 'path' just now. NULL if there's no up-to-date listing.
+ */
+TreeNode *dirtree_peek(const char *path, struct stat *info)
+{
+	TreeNode *node;
+
+	if (!tree_cache)
+		return NULL;
+
+	node = g_fscache_lookup_stat(tree_cache, path, info,
+			FSCACHE_LOOKUP_ONLY_NEW, NULL);
+
+	/* Changed while (or after) we read it, in the same second? */
+	if (node && node->read_time <= info->st_mtime)
+	{
+		g_object_unref(node);
+		return NULL;
+	}
+
+	return node;
+}
+
+/* Start reading 'subdirs' (leafnames in 'path', from dir_list_subdirs())
+ * and the directories below them in the background, stopping any earlier
+ * prefetch. Local directories only.
+ */
+void dirtree_prefetch(const char *path, gchar **subdirs)
+{
+	Prefetch *job;
+
+	if (!prefetch_pool || o_prefetch_depth.int_value < 1 || !subdirs[0])
+		return;
+
+	job = g_new(Prefetch, 1);
+	job->path = g_strdup(path);
+	job->subdirs = g_strdupv(subdirs);
+	job->gen = g_atomic_int_add(&prefetch_gen, 1) + 1;
+
+	g_thread_pool_push(prefetch_pool, job, NULL);
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+static GType tree_node_get_type(void)
+{
+	static GType type = 0;
+
+	if (!type)
+	{
+		static const GTypeInfo info =
+		{
+			sizeof (GObjectClass),
+			NULL,			/* base_init */
+			NULL,			/* base_finalise */
+			tree_node_class_init,
+			NULL,			/* class_finalise */
+			NULL,			/* class_data */
+			sizeof(TreeNode),
+			0,			/* n_preallocs */
+			NULL			/* instance_init */
+		};
+
+		type = g_type_register_static(G_TYPE_OBJECT, "TreeNode",
+					      &info, 0);
+	}
+
+	return type;
+}
+
+static void tree_node_class_init(gpointer gclass, gpointer data)
+{
+	GObjectClass *object = (GObjectClass *) gclass;
+
+	parent_class = g_type_class_peek_parent(gclass);
+
+	object->finalize = tree_node_finialize;
+}
+
+static void tree_node_finialize(GObject *object)
+{
+	TreeNode *node = (TreeNode *) object;
+
+	g_free(node->entries);
+	g_free(node->strings);
+
+	G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+/* dirtree_get() adds the nodes itself, so this isn't normally used */
+static GObject *load_node(const char *path, gpointer data)
+{
+	return (GObject *) read_node(path);
+}
+
+static gsize node_bytes(gpointer node, gpointer data)
+{
+	return ((TreeNode *) node)->bytes;
+}
+
+/* As strcmp2() (the order list_dir_all() uses), after the d_type byte */
+static gint cmp_names(gconstpointer a, gconstpointer b)
+{
+	const char *aa = *(char **) a;
+	const char *bb = *(char **) b;
+
+	return g_ascii_strcasecmp(aa + 1, bb + 1);
+}
+
+/* Read the directory and lstat() the subdirectories in it. NULL on error. */
+static TreeNode *read_node(const char *path)
+{
+	TreeNode *node;
+	GPtrArray *names;
+	GString *strings;
+	DIR *d;
+	struct dirent *ent;
+	int dirfd = -1;
+
+	d = mc_opendir(path);
+	if (!d)
+		return NULL;
+
+	names = g_ptr_array_new();
+	while ((ent = mc_readdir(d)))
+	{
+		const char *name = ent->d_name;
+		gchar *copy;
+
+		if (name[0] == '.' &&
+		    (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+
+		/* The d_type, then the name */
+		copy = g_malloc(strlen(name) + 2);
+#ifdef DT_DIR
+		copy[0] = ent->d_type;
+#else
+		copy[0] = 0;
+#endif
+		strcpy(copy + 1, name);
+		g_ptr_array_add(names, copy);
+	}
+	mc_closedir(d);
+
+	g_ptr_array_sort(names, cmp_names);
+
+	node = g_object_new(tree_node_get_type(), NULL);
+	node->read_time = time(NULL);
+	node->n_entries = names->len;
+	node->entries = g_new0(TreeEntry, names->len);
+
+#ifdef USE_FSTATAT
+	dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+
+	strings = g_string_new(NULL);
+	for (int i = 0; i < names->len; i++)
+	{
+		const char *name = (char *) names->pdata[i];
+		TreeEntry *entry = &node->entries[i];
+		struct stat info;
+		int ret;
+
+		/* Strings may move while we add them; see below */
+		entry->leaf = GSIZE_TO_POINTER(strings->len);
+		entry->d_type = name[0];
+		g_string_append_len(strings, name + 1, strlen(name + 1) + 1);
+
+#ifdef DT_DIR
+		/* prefetch_worker() only wants the directories */
+		if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN)
+			ret = -1;
+		else
+#endif
+#ifdef USE_FSTATAT
+		if (dirfd != -1)
+			ret = fstatat(dirfd, name + 1, &info, AT_SYMLINK_NOFOLLOW);
+		else
+#endif
+		{
+			gchar *child = g_build_filename(path, name + 1, NULL);
+			ret = mc_lstat(child, &info);
+			g_free(child);
+		}
+
+		if (ret == 0)
+		{
+			entry->mode = info.st_mode;
+			entry->dev = info.st_dev;
+		}
+
+		g_free(names->pdata[i]);
+	}
+	g_ptr_array_free(names, TRUE);
+
+	if (dirfd != -1)
+		close(dirfd);
+
+	node->bytes = sizeof(TreeNode) + strings->len +
+			node->n_entries * sizeof(TreeEntry);
+	node->strings = g_string_free(strings, FALSE);
+	for (int i = 0; i < node->n_entries; i++)
+		node->entries[i].leaf = node->strings +
+			GPOINTER_TO_SIZE(node->entries[i].leaf);
+
+	return node;
+}
+
+/* Read the subdirectories of job->path, a level at a time */
+static void prefetch_worker(gpointer data, gpointer user_data)
+{
+	Prefetch *job = (Prefetch *) data;
+	GPtrArray *level, *next;
+	int depth = o_prefetch_depth.int_value;
+	struct stat info;
+
+	/* Level 1 is the window's subdirectories, which it told us */
+	level = g_ptr_array_new();
+	if (mc_stat(job->path, &info) == 0 && !mount_is_remote(job->path))
+	{
+		for (int i = 0; job->subdirs[i]; i++)
+			g_ptr_array_add(level, g_build_filename(job->path,
+						job->subdirs[i], NULL));
+	}
+
+	for (int d = 1; d <= depth && level->len; d++)
+	{
+		next = g_ptr_array_new();
+
+		for (int i = 0; i < level->len; i++)
+		{
+			const char *path = (char *) level->pdata[i];
+			TreeNode *node;
+			gsize bytes;
+
+			if (g_atomic_int_get(&prefetch_gen) != job->gen)
+				break;		/* Someone wants something else */
+
+			g_fscache_get_stats(tree_cache, NULL, NULL, NULL,
+					    &bytes);
+			if (bytes >= TREE_BUDGET)
+				break;		/* We'd only be evicting */
+
+			/* The window's types may be guesses, and may not
+			 * have checked for other filesystems.
+			 */
+			if (d == 1)
+			{
+				struct stat sub;
+
+				if (mc_lstat(path, &sub) || !S_ISDIR(sub.st_mode)
+						|| sub.st_dev != info.st_dev)
+					continue;
+			}
+
+			node = dirtree_get(path);
+			if (!node)
+				continue;
+
+			for (int j = 0; d < depth && j < node->n_entries &&
+					next->len < PREFETCH_MAX_DIRS; j++)
+			{
+				TreeEntry *entry = &node->entries[j];
+
+				/* Don't wander onto other (maybe remote)
+				 * filesystems.
+				 */
+				if (S_ISDIR(entry->mode) &&
+				    entry->dev == info.st_dev)
+					g_ptr_array_add(next, g_build_filename(
+						path, entry->leaf, NULL));
+			}
+			g_object_unref(node);
+		}
+
+		for (int i = 0; i < level->len; i++)
+			g_free(level->pdata[i]);
+		g_ptr_array_free(level, TRUE);
+		level = next;
+	}
+
+	for (int i = 0; i < level->len; i++)
+		g_free(level->pdata[i]);
+	g_ptr_array_free(level, TRUE);
+
+	g_strfreev(job->subdirs);
+	g_free(job->path);
+	g_free(job);
+}
+
+static gboolean purge_nodes(gpointer data)
+{
+	g_fscache_purge(tree_cache, TREE_PURGE_TIME);
+
+	return TRUE;
+}
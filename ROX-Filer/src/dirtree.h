@@ -0,0 +1,43 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * By Thomas Leonard, <tal197@users.sourceforge.net>.
+ */
+
+#ifndef _DIRTREE_H
+#define _DIRTREE_H
+
+typedef struct _TreeNode TreeNode;
+typedef struct _TreeEntry TreeEntry;
+
+struct _TreeEntry {
+	const char	*leaf;
+	unsigned char	d_type;		/* From readdir(), maybe DT_UNKNOWN */
+
+	/* From lstat(), for directories and entries without a d_type only.
+	 * 0 if not done or it failed.
+	 */
+	mode_t		mode;
+	dev_t		dev;
+};
+
+/* The contents of one directory, read at 'read_time'. Never changed once
+ * loaded, so it can be used from any thread while ref'd.
+ */
+struct _TreeNode {
+	GObject		object;
+	time_t		read_time;
+	int		n_entries;
+	TreeEntry	*entries;	/* Sorted, without '.' and '..' */
+	gchar		*strings;
+	gsize		bytes;
+};
+
+/* A prefetch stops queuing subdirectories after this many */
+#define PREFETCH_MAX_DIRS 1000
+
+void dirtree_init(void);
+TreeNode *dirtree_get(const char *path);
+TreeNode *dirtree_peek(const char *path, struct stat *info);
+void dirtree_prefetch(const char *path, gchar **subdirs);
+
+#endif /* _DIRTREE_H */
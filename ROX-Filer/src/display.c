@@ -265,7 +265,11 @@ static void draw_mini_emblem_on_icon(cairo_t *cr,
 		dx = gdk_pixbuf_get_width(scaled);
 	}
 
-	gdk_cairo_set_source_pixbuf(cr, scaled, *x - 1, y + dy + 1);
+	/* Kept until the next emblem, unless coloured */
+	if (coloured)
+		gdk_cairo_set_source_pixbuf(cr, scaled, *x - 1, y + dy + 1);
+	else
+		pixmap_set_source(cr, scaled, *x - 1, y + dy + 1);
 	cairo_paint(cr);
 
 	*x += dx * 2 / 3;
@@ -365,8 +369,7 @@ void draw_huge_icon(
 	}
 
 	if (scale != 1.0 && width > 0 && height > 0)
-		scaled = gdk_pixbuf_scale_simple(image,
-					width, height, GDK_INTERP_BILINEAR);
+		scaled = pixmap_scaled(image, width, height, window);
 	else
 		scaled = image;
 
@@ -382,7 +385,11 @@ void draw_huge_icon(
 			? create_spotlight_pixbuf(scaled, colour)
 			: scaled;
 
-	gdk_cairo_set_source_pixbuf(cr, pixbuf, image_x, image_y);
+	/* A spotlit copy is only drawn once */
+	if (selected)
+		gdk_cairo_set_source_pixbuf(cr, pixbuf, image_x, image_y);
+	else
+		pixmap_set_source(cr, pixbuf, image_x, image_y);
 	cairo_paint(cr);
 
 	if (scale != 1.0 && width > 0 && height > 0)
@@ -497,7 +504,8 @@ int sort_by_name(const void *item1, const void *item2)
 			return 1;
 	}
 
-	retval = strcmp(i1->collatekey, i2->collatekey);
+	retval = strcmp(diritem_get_collatekey((DirItem *) i1),
+			diritem_get_collatekey((DirItem *) i2));
 
 	return retval ? retval : strcmp(i1->leafname, i2->leafname);
 }
@@ -948,7 +956,7 @@ static char *getdetails(FilerWindow *filer_window,
 {
 	mode_t	m = item->mode;
 	guchar 	*buf = NULL;
-	gboolean scanned = item->base_type != TYPE_UNKNOWN;
+	gboolean scanned = !ITEM_UNSCANNED(item);
 	gboolean vertical = filer_window->display_style == HUGE_ICONS;
 
 	int height = 1;
@@ -1051,10 +1059,14 @@ static char *getdetails(FilerWindow *filer_window,
 		} else
 //		if (item->base_type != TYPE_DIRECTORY)
 		{
+			gboolean approx = item->flags & ITEM_FLAG_COUNT_APPROX;
+
 			if (filer_window->display_style == SMALL_ICONS)
-				buf = g_strdup(format_size_aligned(item->size));
+				buf = g_strdup(format_count(item->size,
+							    approx, TRUE));
 			else
-				buf = g_strchomp(g_strdup(format_size(item->size)));
+				buf = g_strchomp(g_strdup(format_count(
+						item->size, approx, FALSE)));
 		}
 //		else
 //			buf = g_strdup("-");
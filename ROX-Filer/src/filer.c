@@ -48,6 +48,7 @@
 #include "menu.h"
 #include "dnd.h"
 #include "dir.h"
+#include "dirtree.h"
 #include "diritem.h"
 #include "run.h"
 #include "type.h"
@@ -67,6 +68,21 @@
 #include "bookmarks.h"
 #include "xtypes.h"
 #include "usericons.h"
+#include "thumbpack.h"
+
+/* Thumbnails more than this many screens from the visible ones wait until
+ * the user scrolls back towards them.
+ */
+#define THUMB_KEEP_SCREENS 3
+#define THUMB_KEEP_MIN 100
+
+typedef struct _ThumbJob ThumbJob;
+
+struct _ThumbJob {
+	gchar	*path;
+	int	dist;		/* Items from the visible ones; -1 => not shown */
+	int	index;		/* Position in the view */
+};
 
 static XMLwrapper *groups = NULL;
 
@@ -132,18 +148,6 @@ enum settings_flags{
 
 static GHashTable *unmount_prompt_actions = NULL;
 
-typedef struct {
-	FilerWindow *fw;
-	gchar *path;
-	gchar *thumb_path;
-	GPtrArray *items;
-	int tried;
-	gboolean cancel;
-} SubDirInfo;
-
-static SubDirInfo sdinfo = {NULL, NULL, NULL, NULL, 0, TRUE};
-static GMutex m_dirthumb;
-
 /* Static prototypes */
 static void attach(FilerWindow *filer_window);
 static void detach(FilerWindow *filer_window);
@@ -153,6 +157,8 @@ static void update_display(Directory *dir,
 		DirAction action, void *items, FilerWindow *filer_window);
 static void set_scanning_display(FilerWindow *filer_window, gboolean scanning);
 static gboolean may_rescan(FilerWindow *filer_window, gboolean warning);
+static void prioritise_visible(FilerWindow *fw);
+static void order_thumbs(FilerWindow *fw, GPtrArray *visible);
 static gboolean minibuffer_show_cb(FilerWindow *filer_window);
 static void filer_add_widgets(FilerWindow *filer_window, const gchar *wm_class);
 static void filer_add_signals(FilerWindow *filer_window);
@@ -181,8 +187,6 @@ static void save_settings(void);
 static gboolean check_settings(FilerWindow *filer_window, gboolean onlycheck);
 static char *tip_from_desktop_file(const char *full_path);
 
-static void free_subdir_info(void);
-
 GdkCursor *busy_cursor = NULL;
 static GdkCursor *crosshair = NULL;
 static GdkCursor *hand_cursor = NULL;
@@ -487,6 +491,38 @@ static void queue_interesting(FilerWindow *filer_window)
 		if (item->flags & ITEM_FLAG_NEED_RESCAN_QUEUE)
 			dir_queue_recheck(filer_window->directory, item);
 	}
+
+	prioritise_visible(filer_window);
+}
+
+static gboolean _prioritise_visible(void *vp)
+{
+	FilerWindow *fw = (FilerWindow *) vp;
+	GPtrArray *items;
+
+	fw->visible_idle = 0;
+	if (!g_list_find(all_filer_windows, fw)) return FALSE;//destroyed
+	if (!fw->directory) return FALSE;
+
+	items = g_ptr_array_new();
+	view_get_visible_items(fw->view, items);
+	if (items->len)
+	{
+		dir_prioritise(fw->directory, items);
+		order_thumbs(fw, items);
+	}
+	g_ptr_array_free(items, TRUE);
+
+	return FALSE;
+}
+
+/* Have the items on screen restatted and thumbnailed before the rest.
+ * Called when the view scrolls, so the queues follow the user.
+ */
+static void prioritise_visible(FilerWindow *fw)
+{
+	if (!fw->visible_idle)
+		fw->visible_idle = g_idle_add(_prioritise_visible, fw);
 }
 
 static gboolean _set_pointer(void *vp)
@@ -587,6 +623,18 @@ static void update_display(Directory *dir,
 		case DIR_END_SCAN:
 			//g_print("end time : %li\n", g_get_real_time() - start_time);
 
+			/* Not on rescans; it has been done */
+			if (filer_window->first_scan)
+			{
+				gchar **subdirs = dir_list_subdirs(
+					filer_window->directory,
+					PREFETCH_MAX_DIRS);
+
+				dirtree_prefetch(filer_window->real_path,
+						 subdirs);
+				g_strfreev(subdirs);
+			}
+
 			if (filer_window->req_sort)
 			{
 				filer_window->req_sort = FALSE;
@@ -993,12 +1041,8 @@ static void filer_window_destroyed(GtkWidget *widget, FilerWindow *filer_window)
 		filer_window->auto_scroll = -1;
 	}
 
-	g_mutex_lock(&m_dirthumb);
-	g_mutex_unlock(&m_dirthumb);
-	if (sdinfo.fw == filer_window)
-		free_subdir_info();
-
 	g_queue_free_full(filer_window->thumb_queue, g_free);
+	g_queue_free_full(filer_window->thumb_parked, g_free);
 
 	tooltip_show(NULL);
 
@@ -1190,7 +1234,7 @@ void filer_openitem(FilerWindow *filer_window, ViewIter *iter, OpenFlags flags)
 		return;
 	}
 
-	if (item->base_type == TYPE_UNKNOWN)
+	if (ITEM_UNSCANNED(item))
 		dir_update_item(filer_window->directory, item->leafname);
 
 	if (item->base_type == TYPE_DIRECTORY)
@@ -1950,6 +1994,7 @@ FilerWindow *filer_opendir(const char *path, FilerWindow *src_win,
 	filer_window->right_link_idle = 0;
 	filer_window->accept_timeout = 0;
 	filer_window->pointer_idle = 0;
+	filer_window->visible_idle = 0;
 	filer_window->resize_drag_width = 0;
 
 	tidy_sympath(filer_window->sym_path);
@@ -1964,6 +2009,7 @@ FilerWindow *filer_opendir(const char *path, FilerWindow *src_win,
 	filer_window->temp_item_selected = FALSE;
 	filer_window->flags = (FilerFlags) 0;
 	filer_window->thumb_queue = g_queue_new();
+	filer_window->thumb_parked = g_queue_new();
 	filer_window->thumb_bar_time = 0;
 	filer_window->max_thumbs = 0;
 	filer_window->trying_thumbs = 0;
@@ -2246,6 +2292,8 @@ static void filer_add_widgets(FilerWindow *filer_window, const gchar *wm_class)
 
 	/* Create this now to make the Adjustment before the View */
 	filer_window->scrollbar = gtk_vscrollbar_new(NULL);
+	g_signal_connect_swapped(filer_window->scrollbar, "value-changed",
+			G_CALLBACK(prioritise_visible), filer_window);
 
 	vbox = gtk_vbox_new(FALSE, 0);
 	gtk_container_add(GTK_CONTAINER(filer_window->window), vbox);
@@ -2823,83 +2871,6 @@ static void set_selection_state(FilerWindow *filer_window, gboolean normal)
 		gtk_widget_queue_draw(GTK_WIDGET(filer_window->view));
 }
 
-static void free_subdir_info(void)
-{
-	if (!sdinfo.path) return;
-	g_free(sdinfo.path);
-	g_free(sdinfo.thumb_path);
-
-	guint i = sdinfo.items->len;
-	while (i--) g_free(sdinfo.items->pdata[i]);
-	g_ptr_array_free(sdinfo.items, TRUE);
-
-	static const SubDirInfo clear = {NULL, NULL, NULL, NULL, 0, TRUE};
-	sdinfo = clear;
-}
-
-static gpointer scandir_thread(gpointer data)
-{
-	//alphasort is not equal to rox's sort. Even doesn't check current settings.
-	sdinfo.cancel = FALSE;
-	sdinfo.tried = 0;
-	sdinfo.items = list_dir_all(sdinfo.path);
-	g_mutex_unlock(&m_dirthumb);
-	return NULL;
-}
-
-static gboolean make_dir_thumb_link()
-{
-	gchar *path = sdinfo.path;
-	gchar *thumb_path = sdinfo.thumb_path;
-
-	int i = sdinfo.tried;
-	sdinfo.tried += 3;
-	int end = MIN(sdinfo.items->len, 99);
-	int currentend = MIN(sdinfo.tried, end);
-
-	for (; i < currentend; i++)
-	{
-		const gchar *subpath = make_path(path,
-				sdinfo.items->pdata[i]);
-
-		struct stat	info;
-		if (mc_lstat(subpath, &info) == -1 ||
-			mode_to_base_type(info.st_mode) != TYPE_FILE)
-			continue;
-
-		gchar *sp = g_strdup(subpath);
-		switch (pixmap_check_thumb(sp))
-		{
-		case 0:
-			sdinfo.fw->max_thumbs++;
-			g_queue_push_tail(sdinfo.fw->thumb_queue, sp/*eaten*/);
-			goto done;
-		case 1:
-			{
-			char *sub_thumb_path = pixmap_make_thumb_path(sp);
-			char *rel_path = get_relative_path(thumb_path, sub_thumb_path);
-			g_free(sub_thumb_path);
-
-			if (symlink(rel_path, thumb_path) == 0)
-				dir_force_update_path(path, TRUE);
-			//even the symlink fails this loop wills break.
-
-			g_free(rel_path);
-			g_free(sp);
-			goto done;
-			}
-		}
-		g_free(sp);
-	}
-
-	if (currentend < end)
-		return TRUE;
-
-done:
-	free_subdir_info();
-	return FALSE;
-}
-
 void filer_cancel_thumbnails(FilerWindow *filer_window)
 {
 	filer_window->thumb_bar_time = 0;
@@ -2911,11 +2882,10 @@ void filer_cancel_thumbnails(FilerWindow *filer_window)
 
 	g_queue_free_full(filer_window->thumb_queue, g_free);
 	filer_window->thumb_queue = g_queue_new();
+	g_queue_free_full(filer_window->thumb_parked, g_free);
+	filer_window->thumb_parked = g_queue_new();
 
 	filer_window->max_thumbs = 0;
-
-	if (sdinfo.fw == filer_window)
-		sdinfo.cancel = TRUE;
 }
 
 /* Generate the next thumb for this window. The window object is
@@ -2926,7 +2896,6 @@ static gboolean filer_next_thumb_real(GObject *window)
 {
 	FilerWindow *filer_window, *fw;
 	gchar	*path;
-	gboolean noorder = FALSE;
 
 	fw = filer_window = g_object_get_data(window, "filer_window");
 
@@ -2936,34 +2905,22 @@ static gboolean filer_next_thumb_real(GObject *window)
 		return FALSE;
 	}
 
-	if (g_mutex_trylock(&m_dirthumb))
-		g_mutex_unlock(&m_dirthumb);
-	else
-	{
-		filer_next_thumb(window, NULL);
-		return FALSE;
-	}
-
-	if (!sdinfo.cancel && sdinfo.items->len)
-	{
-		guint len = filer_window->thumb_queue->length;
-
-		if (make_dir_thumb_link())
-		{
-			filer_next_thumb(window, NULL);
-			return FALSE;
-		}
-		//this is first item and only one of subdir
-		noorder = len != filer_window->thumb_queue->length;
-	}
-	else
-		free_subdir_info();
-
 	if (g_queue_is_empty(filer_window->thumb_queue))
 	{
 		filer_window->trying_thumbs--;
-		if (filer_window->trying_thumbs == 0)
+		if (filer_window->trying_thumbs == 0 &&
+		    g_queue_is_empty(filer_window->thumb_parked))
 			filer_cancel_thumbnails(filer_window);
+		else if (filer_window->trying_thumbs == 0)
+		{
+			/* The rest are far away; order_thumbs() restarts us */
+			filer_window->thumb_bar_time = 0;
+			if (gtk_widget_get_visible(filer_window->thumb_bar))
+			{
+				gtk_widget_hide(filer_window->thumb_bar);
+				filer_autosize(filer_window);
+			}
+		}
 		g_object_unref(window);
 		return FALSE;
 	}
@@ -2979,22 +2936,6 @@ static gboolean filer_next_thumb_real(GObject *window)
 	switch (pixmap_check_thumb(path))
 	{
 	case -1:
-		if (o_display_show_dir_thumbs.int_value == 1)
-		{
-			struct stat info;
-			if (mc_lstat(path, &info) != -1 &&
-				mode_to_base_type(info.st_mode) == TYPE_DIRECTORY)
-			{
-				free_subdir_info();
-				sdinfo.fw = filer_window;
-				sdinfo.thumb_path = pixmap_make_thumb_path(path);
-				sdinfo.path = g_strdup(path);
-				g_mutex_lock(&m_dirthumb);
-				GThread *scd = g_thread_new("scandir_t", scandir_thread, NULL);
-
-				g_thread_unref(scd);
-			}
-		}
 	case -2:
 		filer_next_thumb(window, NULL);
 		goto out;
@@ -3005,7 +2946,7 @@ static gboolean filer_next_thumb_real(GObject *window)
 		break;
 	}
 
-	pixmap_background_thumb(path, noorder, (GFunc) filer_next_thumb, window);
+	pixmap_background_thumb(path, FALSE, (GFunc) filer_next_thumb, window);
 
 	if (!fw->thumb_bar_time) {
 		fw->thumb_bar_time = g_get_monotonic_time();
@@ -3020,7 +2961,8 @@ static gboolean filer_next_thumb_real(GObject *window)
 
 	int done, total;
 	total = filer_window->max_thumbs;
-	done = total - g_queue_get_length(filer_window->thumb_queue);
+	done = total - g_queue_get_length(filer_window->thumb_queue) -
+		g_queue_get_length(filer_window->thumb_parked);
 
 	gtk_progress_bar_set_fraction(
 			GTK_PROGRESS_BAR(filer_window->thumb_bar),
@@ -3056,7 +2998,8 @@ static void start_thumb_scanning(FilerWindow *filer_window)
 /* Set this image to be loaded some time in the future */
 void filer_create_thumb(FilerWindow *filer_window, const gchar *path)
 {
-	if (g_queue_is_empty(filer_window->thumb_queue)) {
+	if (g_queue_is_empty(filer_window->thumb_queue) &&
+	    g_queue_is_empty(filer_window->thumb_parked)) {
 		filer_window->max_thumbs=0;
 	}
 
@@ -3064,9 +3007,138 @@ void filer_create_thumb(FilerWindow *filer_window, const gchar *path)
 
 	g_queue_push_head(filer_window->thumb_queue, g_strdup(path));
 
+	/* Put it in its place once this batch is queued */
+	prioritise_visible(filer_window);
+
 	start_thumb_scanning(filer_window);
 }
 
+static gint cmp_thumb_jobs(gconstpointer a, gconstpointer b)
+{
+	const ThumbJob *aa = (ThumbJob *) a;
+	const ThumbJob *bb = (ThumbJob *) b;
+
+	/* Jobs which aren't in the view at all (dist -1) go last */
+	if ((aa->dist < 0) != (bb->dist < 0))
+		return aa->dist < 0 ? 1 : -1;
+
+	if (aa->dist != bb->dist)
+		return aa->dist < bb->dist ? -1 : 1;
+
+	return aa->index < bb->index ? -1 : aa->index > bb->index;
+}
+
+/* Sort the thumbnail queue so that the items nearest to 'visible' (the
+ * items on screen) are made first, and park the ones which are so far away
+ * that the user may never scroll to them. Parked items come back when
+ * they are near the screen again.
+ */
+static void order_thumbs(FilerWindow *fw, GPtrArray *visible)
+{
+	GHashTable *index;
+	GArray *jobs;
+	ViewIter iter;
+	DirItem *item;
+	GList *next;
+	const gchar *prefix;
+	gsize prefix_len;
+	int first = -1, last = -1, keep, i;
+
+	if (g_queue_is_empty(fw->thumb_queue) &&
+	    g_queue_is_empty(fw->thumb_parked))
+		return;
+
+	/* Leafname -> position in the view (+1) */
+	index = g_hash_table_new(g_str_hash, g_str_equal);
+	view_get_iter(fw->view, &iter, 0);
+	for (i = 1; (item = iter.next(&iter)); i++)
+		g_hash_table_insert(index, item->leafname, GINT_TO_POINTER(i));
+
+	for (i = 0; i < visible->len; i++)
+	{
+		int pos = GPOINTER_TO_INT(g_hash_table_lookup(index,
+				((DirItem *) visible->pdata[i])->leafname)) - 1;
+
+		if (pos < 0)
+			continue;
+		if (first < 0 || pos < first)
+			first = pos;
+		if (pos > last)
+			last = pos;
+	}
+
+	if (first < 0)
+	{
+		g_hash_table_destroy(index);
+		return;
+	}
+
+	prefix = make_path(fw->real_path, "");
+	prefix_len = strlen(prefix);
+
+	jobs = g_array_sized_new(FALSE, FALSE, sizeof(ThumbJob),
+			fw->thumb_queue->length + fw->thumb_parked->length);
+
+	for (int q = 0; q < 2; q++)
+	{
+		GQueue *queue = q ? fw->thumb_parked : fw->thumb_queue;
+
+		for (next = queue->head; next; next = next->next)
+		{
+			ThumbJob job;
+			const gchar *leaf = NULL;
+			int pos;
+
+			job.path = next->data;
+
+			if (strncmp(job.path, prefix, prefix_len) == 0 &&
+			    !strchr(job.path + prefix_len, '/'))
+				leaf = job.path + prefix_len;
+
+			pos = leaf ? GPOINTER_TO_INT(
+				g_hash_table_lookup(index, leaf)) - 1 : -1;
+
+			/* Files inside a directory being thumbnailed, or
+			 * items filtered out of the view.
+			 */
+			job.index = pos;
+			if (pos < 0)
+				job.dist = -1;
+			else if (pos < first)
+				job.dist = first - pos;
+			else if (pos > last)
+				job.dist = pos - last;
+			else
+				job.dist = 0;
+
+			g_array_append_val(jobs, job);
+		}
+		g_queue_clear(queue);
+	}
+	g_hash_table_destroy(index);
+
+	g_array_sort(jobs, cmp_thumb_jobs);
+
+	keep = MAX(THUMB_KEEP_MIN, (last - first + 1) * THUMB_KEEP_SCREENS);
+
+	/* The nearest goes to the tail, where filer_next_thumb_real() takes
+	 * them from.
+	 */
+	for (i = 0; i < jobs->len; i++)
+	{
+		ThumbJob *job = &g_array_index(jobs, ThumbJob, i);
+
+		if (job->dist > keep)
+			g_queue_push_head(fw->thumb_parked, job->path);
+		else
+			g_queue_push_head(fw->thumb_queue, job->path);
+	}
+	g_array_free(jobs, TRUE);
+
+	if (!g_queue_is_empty(fw->thumb_queue))
+		start_thumb_scanning(fw);
+}
+
 /* If thumbnail display is on, look through all the items in this directory
  * and start creating or updating the thumbnails as needed.
  */
@@ -3645,7 +3717,7 @@ gint filer_motion_notify(FilerWindow *filer_window, GdkEventMotion *event)
 
 	if (view_count_selected(view) == 1)
 	{
-		if (item->base_type == TYPE_UNKNOWN)
+		if (ITEM_UNSCANNED(item))
 			item = dir_update_item(filer_window->directory,
 						item->leafname);
 
@@ -3882,21 +3954,12 @@ void filer_refresh_thumbs(FilerWindow *filer_window)
 	ViewIter iter;
 	DirItem *item;
 
-	g_mutex_lock(&m_dirthumb);
-	g_mutex_unlock(&m_dirthumb);
-
 	filer_cancel_thumbnails(filer_window);
 
-	if (!sdinfo.cancel && sdinfo.items->len)
-		while (make_dir_thumb_link()) {}
-	else
-		free_subdir_info();
-
 	set_scanning_display(filer_window, TRUE);
 
-	char *thumb_path = pixmap_make_thumb_path(filer_window->real_path);
-	unlink(thumb_path); ///////////////////////////
-	g_free(thumb_path);
+	pixmap_unlink_thumb(filer_window->real_path);
+	thumbpack_forget(filer_window->real_path);
 
 	view_get_iter(filer_window->view, &iter, 0);
 	while ((item = iter.next(&iter)))
@@ -3912,29 +3975,13 @@ void filer_refresh_thumbs(FilerWindow *filer_window)
 		g_fscache_remove(pixmap_cache, path);
 		g_fscache_remove(thumb_cache, path);
 
-		thumb_path = pixmap_make_thumb_path(path);
-		unlink(thumb_path); ///////////////////////////
+		pixmap_unlink_thumb(path);
 
 		dir_force_update_path(path, TRUE);
 
-		if (!filer_window->show_thumbs)
-			; //do nothing
-		else if (item->base_type == TYPE_DIRECTORY)
-		{
-			free_subdir_info();
-			sdinfo.fw = filer_window;
-			sdinfo.thumb_path = g_strdup(thumb_path);
-			sdinfo.path = g_strdup(path);
-
-			g_mutex_lock(&m_dirthumb);
-			GThread *scd = g_thread_new("scandir_t", scandir_thread, NULL);
-			g_thread_join(scd);
-			while (make_dir_thumb_link()) {}
-		}
-		else
+		if (filer_window->show_thumbs)
 			filer_create_thumb(filer_window, path);
 
-		g_free(thumb_path);
 		g_free(path);
 	}
 
@@ -106,9 +106,11 @@ struct _FilerWindow
 	guint accept_timeout;
 
 	guint pointer_idle;
+	guint visible_idle;	/* Restat the visible items first */
 
 	gboolean	show_thumbs;
-	GQueue		*thumb_queue;		/* paths to thumbnail */
+	GQueue		*thumb_queue;		/* paths to thumbnail, next at tail */
+	GQueue		*thumb_parked;		/* Scrolled far away; not yet */
 	GtkWidget	*thumb_bar;
 	gint64		thumb_bar_time;
 	int		max_thumbs;		/* total for this batch */
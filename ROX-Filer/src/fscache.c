@@ -11,6 +11,17 @@
  * The actual data need not be the raw file contents - a user specified
  * function loads the file and associates data with the file in the cache.
  *
+ * Entries are spread over FSCACHE_SHARDS tables by inode, each with its own
+ * lock, so that threads looking up different files rarely wait for each
+ * other. Each shard keeps its entries in least-recently-used order; if the
+ * cache has a budget, the least recently used entries which nobody else is
+ * using are dropped to keep within it.
+ *
+ * Every lookup normally stat()s the file first. Callers which already have
+ * the stat details can pass them in, and files which are not expected to
+ * change (eg, theme icons) can be trusted for a while, in which case the
+ * shards also map the pathname to the inode it had when last checked.
+ *
  * This program is free software; you can redistribute it and/or modify it
  * under the terms of the GNU General Public License as published by the Free
  * Software Foundation; either version 2 of the License, or (at your option)
@@ -38,25 +49,46 @@
 		 && data->length == info.st_size	\
 		 && data->mode == info.st_mode)		\
 
+/* Nobody but the cache holds a ref */
+#define UNUSED(data) (!(data)->data || (data)->data->ref_count == 1)
+
+/* Longest a pathname will be trusted for, in seconds */
+#define MAX_TRUST (60 * 60)
+
+typedef struct _PathMemo PathMemo;
+
+/* Where a pathname led last time it was stat()ed */
+struct _PathMemo
+{
+	GFSCacheKey key;
+	time_t	    checked;
+};
+
 
 /* Static prototypes */
 
 static guint hash_key(gconstpointer key);
 static gint cmp_stats(gconstpointer a, gconstpointer b);
-static void destroy_hash_entry(gpointer key, gpointer data, gpointer user_data);
-static gboolean purge_hash_entry(gpointer key, gpointer data,
-				 gpointer user_data);
-static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
-					FSCacheLookup lookup_type);
+static GFSCacheShard *get_shard(GFSCache *cache, GFSCacheKey *key);
+static gboolean purge_path(gpointer key, gpointer value, gpointer now);
+static GFSCacheShard *get_path_shard(GFSCache *cache, const char *pathname);
+static void remember_path(GFSCache *cache, const char *pathname,
+			  GFSCacheKey *key);
+static void lru_unlink(GFSCacheShard *shard, GFSCacheData *data);
+static void lru_touch(GFSCacheShard *shard, GFSCacheData *data);
+static GFSCacheData *new_entry(GFSCacheShard *shard, GFSCacheKey *key);
+static void drop_entry(GFSCacheShard *shard, GFSCacheData *data,
+		       GSList **unref);
+static void set_details(GFSCacheData *data, struct stat *info);
+static void set_size(GFSCache *cache, GFSCacheShard *shard,
+		     GFSCacheData *data);
+static void evict(GFSCache *cache, GFSCacheShard *shard, GSList **unref);
+static gpointer load_entry(GFSCache *cache, const char *pathname,
+			   GFSCacheKey *key, struct stat *info);
+static void update_entry(GFSCache *cache, const char *pathname,
+			 gboolean always);
 
 
-struct PurgeInfo
-{
-	GFSCache *cache;
-	gint	 age;
-	time_t	 now;
-};
-
 /****************************************************************
  *			EXTERNAL INTERFACE			*
  ****************************************************************/
@@ -74,16 +106,26 @@ struct PurgeInfo
  * to make a new one.
  *
  * 'user_data' will be passed to all of the above functions.
+ *
+ * The cache has no size limit until g_fscache_set_budget() is called.
  */
 GFSCache *g_fscache_new(GFSLoadFunc load,
 			GFSUpdateFunc update,
 			gpointer user_data)
 {
 	GFSCache *cache;
+	int i;
+
+	cache = g_new0(GFSCache, 1);
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
 
-	cache = g_new(GFSCache, 1);
-	cache->inode_to_stats = g_hash_table_new(hash_key, cmp_stats);
-	g_mutex_init(&cache->mutex);
+		shard->inode_to_stats = g_hash_table_new(hash_key, cmp_stats);
+		shard->paths = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     g_free, g_free);
+		g_mutex_init(&shard->mutex);
+	}
 	cache->load = load;
 	cache->update = update;
 	cache->user_data = user_data;
@@ -93,15 +135,99 @@ GFSCache *g_fscache_new(GFSLoadFunc load,
 
 void g_fscache_destroy(GFSCache *cache)
 {
+	int i;
+
 	g_return_if_fail(cache != NULL);
 
-	g_hash_table_foreach(cache->inode_to_stats, destroy_hash_entry, NULL);
-	g_hash_table_destroy(cache->inode_to_stats);
-	g_mutex_clear(&cache->mutex);
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+		GSList *unref = NULL;
+
+		while (shard->lru_head)
+			drop_entry(shard, shard->lru_head, &unref);
+		g_slist_free_full(unref, g_object_unref);
+
+		g_hash_table_destroy(shard->inode_to_stats);
+		g_hash_table_destroy(shard->paths);
+		g_mutex_clear(&shard->mutex);
+	}
 
 	g_free(cache);
 }
 
+/* Limit the cache to about 'budget' bytes, as measured by size(), which
+ * is called whenever an entry's object is loaded, updated or inserted.
+ * Objects which are in use elsewhere are never evicted, so the cache may
+ * go over budget while they are.
+ * A budget of 0 removes the limit.
+ */
+void g_fscache_set_budget(GFSCache *cache, GFSSizeFunc size, gsize budget)
+{
+	g_return_if_fail(cache != NULL);
+	g_return_if_fail(size != NULL || budget == 0);
+
+	cache->size = size;
+	cache->budget = budget;
+
+	g_fscache_remeasure(cache);
+}
+
+/* Measure every entry again with the size() function, and drop entries to
+ * keep within the budget. For objects which may have grown or shrunk since
+ * they were loaded.
+ */
+void g_fscache_remeasure(GFSCache *cache)
+{
+	int i;
+
+	g_return_if_fail(cache != NULL);
+
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+		GSList *unref = NULL;
+		GFSCacheData *data;
+
+		g_mutex_lock(&shard->mutex);
+		for (data = shard->lru_head; data; data = data->next)
+			set_size(cache, shard, data);
+		evict(cache, shard, &unref);
+		g_mutex_unlock(&shard->mutex);
+
+		g_slist_free_full(unref, g_object_unref);
+	}
+}
+
+/* Any of the results may be NULL. 'hits' counts lookups answered from the
+ * cache, 'misses' those which needed a load or update, and 'evictions'
+ * entries dropped to stay within the budget.
+ */
+void g_fscache_get_stats(GFSCache *cache, guint *hits, guint *misses,
+			 guint *evictions, gsize *bytes)
+{
+	g_return_if_fail(cache != NULL);
+
+	if (hits)
+		*hits = g_atomic_int_get(&cache->hits);
+	if (misses)
+		*misses = g_atomic_int_get(&cache->misses);
+	if (evictions)
+		*evictions = g_atomic_int_get(&cache->evictions);
+	if (bytes)
+	{
+		int i;
+
+		*bytes = 0;
+		for (i = 0; i < FSCACHE_SHARDS; i++)
+		{
+			g_mutex_lock(&cache->shards[i].mutex);
+			*bytes += cache->shards[i].bytes;
+			g_mutex_unlock(&cache->shards[i].mutex);
+		}
+	}
+}
+
 /* Find the data for this file in the cache, loading it into
  * the cache if it isn't there already.
  *
@@ -126,20 +252,46 @@ gpointer g_fscache_lookup(GFSCache *cache, const char *pathname)
 void g_fscache_insert(GFSCache *cache, const char *pathname, gpointer obj,
 		      gboolean update_details)
 {
+	struct stat	info;
+	GFSCacheKey	key;
+	GFSCacheShard	*shard;
 	GFSCacheData	*data;
+	GSList		*unref = NULL;
 
-	data = lookup_internal(cache, pathname,
-			update_details ? FSCACHE_LOOKUP_INIT
-				       : FSCACHE_LOOKUP_INSERT);
+	g_return_if_fail(cache != NULL);
+	g_return_if_fail(pathname != NULL);
 
-	if (!data)
+	if (mc_stat(pathname, &info))
 		return;
 
-	if (obj)
-		g_object_ref(obj);
-	if (data->data)
-		g_object_unref(data->data);
-	data->data = obj;
+	key.device = info.st_dev;
+	key.inode = info.st_ino;
+	shard = get_shard(cache, &key);
+
+	g_mutex_lock(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
+	if (!data && update_details)
+		data = new_entry(shard, &key);
+
+	if (data)
+	{
+		if (update_details)
+			set_details(data, &info);
+
+		if (obj)
+			g_object_ref(obj);
+		if (data->data)
+			unref = g_slist_prepend(unref, data->data);
+		data->data = obj;
+
+		data->last_lookup = time(NULL);
+		lru_touch(shard, data);
+		set_size(cache, shard, data);
+		evict(cache, shard, &unref);
+	}
+	g_mutex_unlock(&shard->mutex);
+
+	g_slist_free_full(unref, g_object_unref);
 }
 
 /* As g_fscache_lookup, but 'lookup_type' controls what happens if the data
@@ -153,116 +305,188 @@ gpointer g_fscache_lookup_full(GFSCache *cache, const char *pathname,
 				FSCacheLookup lookup_type,
 				gboolean *found)
 {
-	GFSCacheData *data;
+	struct stat	info;
 
-	g_return_val_if_fail(lookup_type != FSCACHE_LOOKUP_INIT, NULL);
-
-	data = lookup_internal(cache, pathname, lookup_type);
+	g_return_val_if_fail(cache != NULL, NULL);
+	g_return_val_if_fail(pathname != NULL, NULL);
 
-	if (!data)
+	if (mc_stat(pathname, &info))
 	{
 		if (found)
 			*found = FALSE;
 		return NULL;
 	}
 
-	if (found)
-		*found = TRUE;
-
-	if (data->data)
-		g_object_ref(data->data);
-
-	return data->data;
+	return g_fscache_lookup_stat(cache, pathname, &info,
+				     lookup_type, found);
 }
 
-/* Call the update() function on this item if it's in the cache
- * AND it's out-of-date.
+/* As g_fscache_lookup_full(), but using the caller's stat() of pathname
+ * (following symlinks) instead of making another.
  */
-void g_fscache_may_update(GFSCache *cache, const char *pathname)
+gpointer g_fscache_lookup_stat(GFSCache *cache, const char *pathname,
+				struct stat *info,
+				FSCacheLookup lookup_type,
+				gboolean *found)
 {
 	GFSCacheKey	key;
+	GFSCacheShard	*shard;
 	GFSCacheData	*data;
-	struct stat 	info;
+	GObject		*obj;
 
-	g_return_if_fail(cache != NULL);
-	g_return_if_fail(pathname != NULL);
-	g_return_if_fail(cache->update != NULL);
+	g_return_val_if_fail(cache != NULL, NULL);
+	g_return_val_if_fail(pathname != NULL, NULL);
+	g_return_val_if_fail(info != NULL, NULL);
+	g_return_val_if_fail(lookup_type != FSCACHE_LOOKUP_INIT &&
+			     lookup_type != FSCACHE_LOOKUP_INSERT, NULL);
 
-	if (mc_stat(pathname, &info))
-		return;
+	if (found)
+		*found = FALSE;
 
-	key.device = info.st_dev;
-	key.inode = info.st_ino;
+	key.device = info->st_dev;
+	key.inode = info->st_ino;
+	shard = get_shard(cache, &key);
 
-	g_mutex_lock(&cache->mutex);
-	data = g_hash_table_lookup(cache->inode_to_stats, &key);
+	g_mutex_lock(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
 
-	if (data && !UPTODATE(data, info))
+	if (data && (lookup_type == FSCACHE_LOOKUP_PEEK ||
+		     UPTODATE(data, (*info))))
 	{
-		cache->update(data->data, pathname, cache->user_data);
-		data->m_time = info.st_mtime;
-		data->c_time = info.st_ctime;
-		data->length = info.st_size;
-		data->mode = info.st_mode;
+		/* Never update on peeks */
+		obj = data->data;
+		if (obj)
+			g_object_ref(obj);
+		data->last_lookup = time(NULL);
+		lru_touch(shard, data);
+		g_mutex_unlock(&shard->mutex);
+
+		g_atomic_int_inc(&cache->hits);
+		if (found)
+			*found = TRUE;
+		return obj;
 	}
-	g_mutex_unlock(&cache->mutex);
+	g_mutex_unlock(&shard->mutex);
+
+	/* Missing or out-of-date */
+	if (lookup_type != FSCACHE_LOOKUP_CREATE)
+		return NULL;
+
+	g_atomic_int_inc(&cache->misses);
+	if (found)
+		*found = TRUE;
+
+	return load_entry(cache, pathname, &key, info);
 }
 
-/* Call the update() function on this item iff it's in the cache. */
-void g_fscache_update(GFSCache *cache, const char *pathname)
+/* As g_fscache_lookup(), but if pathname was checked less than 'trust'
+ * seconds ago, assume that it still refers to the same, unchanged file and
+ * return the cached object without a stat(). For files which are very
+ * unlikely to change, such as icons from a theme. 'trust' is limited to
+ * MAX_TRUST.
+ */
+gpointer g_fscache_lookup_trusted(GFSCache *cache, const char *pathname,
+				  gint trust)
 {
-	GFSCacheKey	key;
+	GFSCacheShard	*shard;
 	GFSCacheData	*data;
-	struct stat 	info;
+	PathMemo	*memo;
+	GFSCacheKey	key;
+	GObject		*obj;
+	struct stat	info;
+	time_t		now = time(NULL);
 
-	g_return_if_fail(cache != NULL);
-	g_return_if_fail(pathname != NULL);
-	g_return_if_fail(cache->update != NULL);
+	g_return_val_if_fail(cache != NULL, NULL);
+	g_return_val_if_fail(pathname != NULL, NULL);
+
+	shard = get_path_shard(cache, pathname);
+	g_mutex_lock(&shard->mutex);
+	memo = g_hash_table_lookup(shard->paths, pathname);
+	if (memo && memo->checked <= now &&
+	    now - memo->checked < MIN(trust, MAX_TRUST))
+		key = memo->key;
+	else
+		memo = NULL;
+	g_mutex_unlock(&shard->mutex);
+
+	if (memo)
+	{
+		shard = get_shard(cache, &key);
+
+		g_mutex_lock(&shard->mutex);
+		data = g_hash_table_lookup(shard->inode_to_stats, &key);
+		if (data)
+		{
+			obj = data->data;
+			if (obj)
+				g_object_ref(obj);
+			data->last_lookup = now;
+			lru_touch(shard, data);
+		}
+		g_mutex_unlock(&shard->mutex);
+
+		if (data)
+		{
+			g_atomic_int_inc(&cache->hits);
+			return obj;
+		}
+	}
 
 	if (mc_stat(pathname, &info))
-		return;
+		return NULL;
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
+	remember_path(cache, pathname, &key);
 
-	g_mutex_lock(&cache->mutex);
-	data = g_hash_table_lookup(cache->inode_to_stats, &key);
+	return g_fscache_lookup_stat(cache, pathname, &info,
+				     FSCACHE_LOOKUP_CREATE, NULL);
+}
 
-	if (data)
-	{
-		cache->update(data->data, pathname, cache->user_data);
-		data->m_time = info.st_mtime;
-		data->c_time = info.st_ctime;
-		data->length = info.st_size;
-		data->mode = info.st_mode;
-	}
-	g_mutex_unlock(&cache->mutex);
+/* Call the update() function on this item if it's in the cache
+ * AND it's out-of-date.
+ */
+void g_fscache_may_update(GFSCache *cache, const char *pathname)
+{
+	update_entry(cache, pathname, FALSE);
+}
+
+/* Call the update() function on this item iff it's in the cache. */
+void g_fscache_update(GFSCache *cache, const char *pathname)
+{
+	update_entry(cache, pathname, TRUE);
 }
 
 void g_fscache_remove(GFSCache *cache, const char *pathname)
 {
 	GFSCacheKey key;
+	GFSCacheShard *shard;
 	GFSCacheData *data;
+	GSList *unref = NULL;
 	struct stat info;
 
 	g_return_if_fail(cache != NULL);
 	g_return_if_fail(pathname != NULL);
 
+	shard = get_path_shard(cache, pathname);
+	g_mutex_lock(&shard->mutex);
+	g_hash_table_remove(shard->paths, pathname);
+	g_mutex_unlock(&shard->mutex);
+
 	if (mc_stat(pathname, &info))
 		return;
 
 	key.device = info.st_dev;
 	key.inode = info.st_ino;
+	shard = get_shard(cache, &key);
 
-	g_mutex_lock(&cache->mutex);
-	data = (GFSCacheData *) g_hash_table_lookup(cache->inode_to_stats, &key);
-	g_hash_table_remove(cache->inode_to_stats, &key);
-	g_mutex_unlock(&cache->mutex);
-
-	if (data && data->data)
-		g_object_unref(data->data);
-	g_free(data);
+	g_mutex_lock(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
+	if (data)
+		drop_entry(shard, data, &unref);
+	g_mutex_unlock(&shard->mutex);
 
+	g_slist_free_full(unref, g_object_unref);
 }
 
 /* Remove all cache entries last accessed more than 'age' seconds
@@ -270,18 +494,68 @@ void g_fscache_remove(GFSCache *cache, const char *pathname)
  */
 void g_fscache_purge(GFSCache *cache, gint age)
 {
-	struct PurgeInfo info;
+	time_t now = time(NULL);
+	int i;
 
 	g_return_if_fail(cache != NULL);
 
-	info.age = age;
-	info.cache = cache;
-	info.now = time(NULL);
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+		GFSCacheData *data, *prev;
+		GSList *unref = NULL;
+
+		g_mutex_lock(&shard->mutex);
+		for (data = shard->lru_tail; data; data = prev)
+		{
+			prev = data->prev;
+
+			/* It's wasteful to remove an entry if someone
+			 * else is using it
+			 */
+			if (!UNUSED(data))
+				continue;
 
-	g_mutex_lock(&cache->mutex);
-	g_hash_table_foreach_remove(cache->inode_to_stats, purge_hash_entry,
-			(gpointer) &info);
-	g_mutex_unlock(&cache->mutex);
+			if (data->last_lookup <= now
+			    && data->last_lookup >= now - age)
+				continue;
+
+			drop_entry(shard, data, &unref);
+		}
+
+		g_hash_table_foreach_remove(shard->paths, purge_path, &now);
+		g_mutex_unlock(&shard->mutex);
+
+		g_slist_free_full(unref, g_object_unref);
+	}
+}
+
+/* Call func(object, user_data) for every object in the cache. The cache
+ * isn't locked during the calls.
+ */
+void g_fscache_foreach(GFSCache *cache, GFunc func, gpointer user_data)
+{
+	int i;
+
+	g_return_if_fail(cache != NULL);
+
+	for (i = 0; i < FSCACHE_SHARDS; i++)
+	{
+		GFSCacheShard *shard = &cache->shards[i];
+		GSList *objects = NULL, *next;
+		GFSCacheData *data;
+
+		g_mutex_lock(&shard->mutex);
+		for (data = shard->lru_head; data; data = data->next)
+			if (data->data)
+				objects = g_slist_prepend(objects,
+						g_object_ref(data->data));
+		g_mutex_unlock(&shard->mutex);
+
+		for (next = objects; next; next = next->next)
+			func(next->data, user_data);
+		g_slist_free_full(objects, g_object_unref);
+	}
 }
 
 
@@ -307,127 +581,260 @@ static gint cmp_stats(gconstpointer a, gconstpointer b)
 	return c->device == d->device && c->inode == d->inode;
 }
 
-static void destroy_hash_entry(gpointer key, gpointer data, gpointer user_data)
+static gboolean purge_path(gpointer key, gpointer value, gpointer now)
 {
-	GFSCacheData *cache_data = (GFSCacheData *) data;
+	PathMemo *memo = (PathMemo *) value;
 
-	if (cache_data->data)
-		g_object_unref(cache_data->data);
+	return memo->checked > *(time_t *) now ||
+		memo->checked < *(time_t *) now - MAX_TRUST;
+}
 
-	g_free(key);
-	g_free(data);
+static GFSCacheShard *get_path_shard(GFSCache *cache, const char *pathname)
+{
+	return &cache->shards[g_str_hash(pathname) % FSCACHE_SHARDS];
+}
+
+/* Note that pathname referred to key just now */
+static void remember_path(GFSCache *cache, const char *pathname,
+			  GFSCacheKey *key)
+{
+	GFSCacheShard *shard = get_path_shard(cache, pathname);
+	PathMemo *memo;
+
+	g_mutex_lock(&shard->mutex);
+	memo = g_hash_table_lookup(shard->paths, pathname);
+	if (!memo)
+	{
+		memo = g_new(PathMemo, 1);
+		g_hash_table_insert(shard->paths, g_strdup(pathname), memo);
+	}
+	memo->key = *key;
+	memo->checked = time(NULL);
+	g_mutex_unlock(&shard->mutex);
 }
 
-static gboolean purge_hash_entry(gpointer key, gpointer data,
-				 gpointer user_data)
+static GFSCacheShard *get_shard(GFSCache *cache, GFSCacheKey *key)
 {
-	struct PurgeInfo *info = (struct PurgeInfo *) user_data;
-	GFSCacheData *cache_data = (GFSCacheData *) data;
+	guint hash = (guint) key->inode ^ (guint) key->device;
 
-	/* It's wasteful to remove an entry if someone else is using it */
-	if (cache_data->data && cache_data->data->ref_count > 1)
-		return FALSE;
+	/* Mix in the high bits, as nearby files often have nearby inodes */
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
 
-	if (cache_data->last_lookup <= info->now
-		&& cache_data->last_lookup >= info->now - info->age)
-		return FALSE;
+	return &cache->shards[hash % FSCACHE_SHARDS];
+}
 
-	if (cache_data->data)
-		g_object_unref(cache_data->data);
+/* The functions below need the shard's mutex */
 
-	g_free(key);
-	g_free(data);
+static void lru_unlink(GFSCacheShard *shard, GFSCacheData *data)
+{
+	if (data->prev)
+		data->prev->next = data->next;
+	else
+		shard->lru_head = data->next;
+
+	if (data->next)
+		data->next->prev = data->prev;
+	else
+		shard->lru_tail = data->prev;
 
-	return TRUE;
+	data->prev = data->next = NULL;
 }
 
-/* As for g_fscache_lookup_full, but return the GFSCacheData rather than
- * the data it contains. Doesn't increment the refcount.
- */
-static GFSCacheData *lookup_internal(GFSCache *cache, const char *pathname,
-					FSCacheLookup lookup_type)
+/* Make this the most recently used entry */
+static void lru_touch(GFSCacheShard *shard, GFSCacheData *data)
 {
-	struct stat 	info;
-	GFSCacheKey	key;
-	GFSCacheData	*data;
+	if (shard->lru_head == data)
+		return;
 
-	g_return_val_if_fail(cache != NULL, NULL);
-	g_return_val_if_fail(pathname != NULL, NULL);
+	lru_unlink(shard, data);
 
-	if (mc_stat(pathname, &info))
-		return NULL;
+	data->next = shard->lru_head;
+	if (shard->lru_head)
+		shard->lru_head->prev = data;
+	else
+		shard->lru_tail = data;
+	shard->lru_head = data;
+}
 
-	key.device = info.st_dev;
-	key.inode = info.st_ino;
+/* Add an empty entry, as the most recently used */
+static GFSCacheData *new_entry(GFSCacheShard *shard, GFSCacheKey *key)
+{
+	GFSCacheData *data;
 
-	g_mutex_lock(&cache->mutex);
-	data = g_hash_table_lookup(cache->inode_to_stats, &key);
-	g_mutex_unlock(&cache->mutex);
+	data = g_new0(GFSCacheData, 1);
+	data->key = *key;
 
-	if (data)
-	{
-		/* We've cached this file already */
+	g_hash_table_insert(shard->inode_to_stats, &data->key, data);
+	lru_touch(shard, data);
 
-		if (lookup_type == FSCACHE_LOOKUP_PEEK ||
-		    lookup_type == FSCACHE_LOOKUP_INSERT)
-			goto out;	/* Never update on peeks */
+	return data;
+}
 
-		if (lookup_type == FSCACHE_LOOKUP_INIT)
-			goto init;
+/* Remove the entry. Its object is added to 'unref', to be unref'd once the
+ * lock is released.
+ */
+static void drop_entry(GFSCacheShard *shard, GFSCacheData *data,
+		       GSList **unref)
+{
+	g_hash_table_remove(shard->inode_to_stats, &data->key);
+	lru_unlink(shard, data);
+	shard->bytes -= data->size;
 
-		/* Is it up-to-date? */
+	if (data->data)
+		*unref = g_slist_prepend(*unref, data->data);
+	g_free(data);
+}
 
-		if (UPTODATE(data, info))
-			goto out;
+static void set_details(GFSCacheData *data, struct stat *info)
+{
+	data->m_time = info->st_mtime;
+	data->c_time = info->st_ctime;
+	data->length = info->st_size;
+	data->mode = info->st_mode;
+}
 
-		if (lookup_type == FSCACHE_LOOKUP_ONLY_NEW)
-			return NULL;
+/* Recharge the shard for the entry's current object */
+static void set_size(GFSCache *cache, GFSCacheShard *shard,
+		     GFSCacheData *data)
+{
+	gsize size = 0;
 
-		/* Out-of-date */
-		if (cache->update)
-			cache->update(data->data, pathname, cache->user_data);
-		else
-		{
-			if (data->data)
-				g_object_unref(data->data);
-			data->data = NULL;
-		}
+	if (cache->size)
+	{
+		size = sizeof(GFSCacheData);
+		if (data->data)
+			size += cache->size(data->data, cache->user_data);
 	}
-	else
+
+	shard->bytes = shard->bytes - data->size + size;
+	data->size = size;
+}
+
+/* Drop least recently used entries until the shard is within its part of
+ * the budget, skipping any which are in use.
+ */
+static void evict(GFSCache *cache, GFSCacheShard *shard, GSList **unref)
+{
+	gsize limit = cache->budget / FSCACHE_SHARDS;
+	GFSCacheData *data, *prev;
+
+	if (!cache->budget)
+		return;
+
+	for (data = shard->lru_tail; data && shard->bytes > limit; data = prev)
 	{
-		GFSCacheKey *new_key;
+		prev = data->prev;
 
-		if (lookup_type != FSCACHE_LOOKUP_CREATE &&
-		    lookup_type != FSCACHE_LOOKUP_INIT)
-			return NULL;
+		if (data == shard->lru_head || !UNUSED(data))
+			continue;
 
-		new_key = g_memdup(&key, sizeof(key));
+		drop_entry(shard, data, unref);
+		g_atomic_int_inc(&cache->evictions);
+	}
+}
 
-		data = g_new(GFSCacheData, 1);
-		data->data = NULL;
+/* Load or update the object for this file, without holding the lock while
+ * the callbacks run. Returns the object, ref'd.
+ */
+static gpointer load_entry(GFSCache *cache, const char *pathname,
+			   GFSCacheKey *key, struct stat *info)
+{
+	GFSCacheShard	*shard = get_shard(cache, key);
+	GFSCacheData	*data;
+	GObject		*obj = NULL;
+	GSList		*unref = NULL;
 
-		g_mutex_lock(&cache->mutex);
-		g_hash_table_insert(cache->inode_to_stats, new_key, data);
-		g_mutex_unlock(&cache->mutex);
+	if (cache->update)
+	{
+		g_mutex_lock(&shard->mutex);
+		data = g_hash_table_lookup(shard->inode_to_stats, key);
+		if (data && data->data)
+			obj = g_object_ref(data->data);
+		g_mutex_unlock(&shard->mutex);
 	}
 
-init:
-	data->m_time = info.st_mtime;
-	data->c_time = info.st_ctime;
-	data->length = info.st_size;
-	data->mode = info.st_mode;
+	if (obj)
+		cache->update(obj, pathname, cache->user_data);
+	else if (cache->load)
+		obj = cache->load(pathname, cache->user_data);
+
+	g_mutex_lock(&shard->mutex);
 
-	if (data->data == NULL &&
-		lookup_type != FSCACHE_LOOKUP_INIT &&
-		lookup_type != FSCACHE_LOOKUP_INSERT)
+	/* May have been removed, or replaced, while we were loading */
+	data = g_hash_table_lookup(shard->inode_to_stats, key);
+	if (!data)
+		data = new_entry(shard, key);
+
+	set_details(data, info);
+	if (data->data != obj)
 	{
-		/* Create the object for the file (ie, not an update) */
-		if (cache->load)
-			data->data = cache->load(pathname, cache->user_data);
+		if (data->data)
+			unref = g_slist_prepend(unref, data->data);
+		data->data = obj ? g_object_ref(obj) : NULL;
 	}
-out:
+
 	data->last_lookup = time(NULL);
+	lru_touch(shard, data);
+	set_size(cache, shard, data);
+	evict(cache, shard, &unref);
 
-	return data;
+	g_mutex_unlock(&shard->mutex);
+
+	g_slist_free_full(unref, g_object_unref);
+
+	return obj;
 }
 
+/* Call the update() function on this item if it's in the cache and either
+ * 'always' is set or it's out-of-date.
+ */
+static void update_entry(GFSCache *cache, const char *pathname,
+			 gboolean always)
+{
+	GFSCacheKey	key;
+	GFSCacheShard	*shard;
+	GFSCacheData	*data;
+	GObject		*obj = NULL;
+	GSList		*unref = NULL;
+	struct stat 	info;
+
+	g_return_if_fail(cache != NULL);
+	g_return_if_fail(pathname != NULL);
+	g_return_if_fail(cache->update != NULL);
+
+	if (mc_stat(pathname, &info))
+		return;
+
+	key.device = info.st_dev;
+	key.inode = info.st_ino;
+	shard = get_shard(cache, &key);
+
+	g_mutex_lock(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
+	if (data && (always || !UPTODATE(data, info)))
+	{
+		set_details(data, &info);
+		if (data->data)
+			obj = g_object_ref(data->data);
+	}
+	g_mutex_unlock(&shard->mutex);
+
+	if (!obj)
+		return;
+
+	cache->update(obj, pathname, cache->user_data);
+
+	g_mutex_lock(&shard->mutex);
+	data = g_hash_table_lookup(shard->inode_to_stats, &key);
+	if (data && data->data == obj)
+	{
+		set_size(cache, shard, data);
+		evict(cache, shard, &unref);
+	}
+	g_mutex_unlock(&shard->mutex);
+
+	g_slist_free_full(unref, g_object_unref);
+	g_object_unref(obj);
+}
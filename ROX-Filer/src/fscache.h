@@ -26,16 +26,14 @@ typedef enum {
 	FSCACHE_LOOKUP_INSERT,	/* Internal use */
 } FSCacheLookup;
 
-struct _GFSCache
-{
-	GHashTable    *inode_to_stats;
-	GMutex        mutex;
-	GFSLoadFunc   load;
-	GFSUpdateFunc update;
-	gpointer      user_data;
-};
+typedef gsize (*GFSSizeFunc)(gpointer object, gpointer user_data);
+
+/* Entries are spread over this many independently locked tables */
+#define FSCACHE_SHARDS 16
+
 typedef struct _GFSCacheKey GFSCacheKey;
 typedef struct _GFSCacheData GFSCacheData;
+typedef struct _GFSCacheShard GFSCacheShard;
 
 struct _GFSCacheKey
 {
@@ -45,6 +43,7 @@ struct _GFSCacheKey
 
 struct _GFSCacheData
 {
+	GFSCacheKey key;	/* Also the key in the shard's table */
 	GObject *data;		/* The object from the file */
 	time_t  last_lookup;
 
@@ -52,20 +51,57 @@ struct _GFSCacheData
 	time_t  m_time, c_time;
 	off_t   length;
 	mode_t  mode;
+
+	gsize   size;		/* Bytes charged to the shard */
+	GFSCacheData *prev, *next;	/* In the shard's LRU list */
+};
+
+struct _GFSCacheShard
+{
+	GMutex        mutex;
+	GHashTable    *inode_to_stats;
+	GHashTable    *paths;		/* For g_fscache_lookup_trusted() */
+	GFSCacheData  *lru_head;	/* Most recently used */
+	GFSCacheData  *lru_tail;	/* Next to evict */
+	gsize         bytes;
+};
+
+struct _GFSCache
+{
+	GFSCacheShard shards[FSCACHE_SHARDS];
+	GFSLoadFunc   load;
+	GFSUpdateFunc update;
+	GFSSizeFunc   size;		/* NULL => no budget */
+	gsize         budget;		/* Bytes; 0 => unlimited */
+	gpointer      user_data;
+
+	/* Statistics, updated atomically */
+	gint          hits, misses, evictions;
 };
 
 GFSCache *g_fscache_new(GFSLoadFunc load,
 			GFSUpdateFunc update,
 			gpointer user_data);
 void g_fscache_destroy(GFSCache *cache);
+void g_fscache_set_budget(GFSCache *cache, GFSSizeFunc size, gsize budget);
+void g_fscache_remeasure(GFSCache *cache);
+void g_fscache_get_stats(GFSCache *cache, guint *hits, guint *misses,
+			 guint *evictions, gsize *bytes);
 gpointer g_fscache_lookup(GFSCache *cache, const char *pathname);
 gpointer g_fscache_lookup_full(GFSCache *cache, const char *pathname,
 				FSCacheLookup lookup_type,
 				gboolean *found);
+gpointer g_fscache_lookup_stat(GFSCache *cache, const char *pathname,
+				struct stat *info,
+				FSCacheLookup lookup_type,
+				gboolean *found);
+gpointer g_fscache_lookup_trusted(GFSCache *cache, const char *pathname,
+				  gint trust);
 void g_fscache_may_update(GFSCache *cache, const char *pathname);
 void g_fscache_update(GFSCache *cache, const char *pathname);
 void g_fscache_remove(GFSCache *cache, const char *pathname);
 void g_fscache_purge(GFSCache *cache, gint age);
+void g_fscache_foreach(GFSCache *cache, GFunc func, gpointer user_data);
 
 void g_fscache_insert(GFSCache *cache, const char *pathname, gpointer obj,
 		      gboolean update_details);
@@ -33,6 +33,11 @@ typedef struct _Directory Directory;
  */
 typedef struct _DirItem DirItem;
 
+/* A Directory's DirItems are allocated from its arena, so that they are
+ * packed together and can be released in bulk.
+ */
+typedef struct _DirArena DirArena;
+
 /* Widgets which can display directories implement the View interface.
  * This should be used in preference to the old collection interface because
  * it isn't specific to a particular type of display.
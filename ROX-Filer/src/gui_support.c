@@ -1527,6 +1527,61 @@ rox_pixbuf_new_from_file_at_scale (const char *filename,
 	return pixbuf;
 }
 
+/* As rox_pixbuf_new_from_file_at_scale(), but for an image already in
+ * memory (eg, a preview embedded in another file). Loaders which can
+ * decode at a smaller size (eg, JPEG) do so.
+ */
+GdkPixbuf *rox_pixbuf_new_from_data_at_scale(const guchar *data, gsize len,
+					     int width, int height,
+					     gboolean preserve_aspect_ratio,
+					     GError **error)
+{
+	GdkPixbufLoader *loader;
+	GdkPixbuf *pixbuf;
+	struct {
+		gint width;
+		gint height;
+		gboolean preserve_aspect_ratio;
+	} info;
+
+	g_return_val_if_fail(data != NULL, NULL);
+	g_return_val_if_fail(width > 0 && height > 0, NULL);
+
+	loader = gdk_pixbuf_loader_new();
+
+	info.width = width;
+	info.height = height;
+	info.preserve_aspect_ratio = preserve_aspect_ratio;
+
+	g_signal_connect(loader, "size-prepared",
+			 G_CALLBACK(size_prepared_cb), &info);
+
+	if (!gdk_pixbuf_loader_write(loader, data, len, error))
+	{
+		gdk_pixbuf_loader_close(loader, NULL);
+		g_object_unref(loader);
+		return NULL;
+	}
+
+	if (!gdk_pixbuf_loader_close(loader, error))
+	{
+		g_object_unref(loader);
+		return NULL;
+	}
+
+	pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+	if (pixbuf)
+		g_object_ref(pixbuf);
+	else
+		g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+			    _("Failed to load image: reason not known, "
+			      "probably a corrupt image file"));
+
+	g_object_unref(loader);
+
+	return pixbuf;
+}
+
 /* Make the name bolder and larger.
  * scale_factor can be PANGO_SCALE_X_LARGE, etc.
  */
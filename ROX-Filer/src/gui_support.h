@@ -94,6 +94,10 @@ GdkPixbuf * rox_pixbuf_new_from_file_at_scale (const char *filename,
 					       int       height,
 					       gboolean  preserve_aspect_ratio,
 					       GError    **error);
+GdkPixbuf *rox_pixbuf_new_from_data_at_scale(const guchar *data, gsize len,
+					     int width, int height,
+					     gboolean preserve_aspect_ratio,
+					     GError **error);
 void make_heading(GtkWidget *label, double scale_factor);
 void launch_uri(GObject *button, const char *uri);
 void allow_right_click(GtkWidget *button);
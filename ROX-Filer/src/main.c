@@ -61,6 +61,8 @@
 #include "type.h"
 #include "pixmaps.h"
 #include "dir.h"
+#include "dirtree.h"
+#include "thumbpack.h"
 #include "diritem.h"
 #include "action.h"
 #include "i18n.h"
@@ -598,6 +600,8 @@ int main(int argc, char **argv)
 	dnd_init();
 	bind_init();
 	dir_init();
+	dirtree_init();
+	thumbpack_init();
 	diritem_init();
 	menu_init();
 	minibuffer_init();
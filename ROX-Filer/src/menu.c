@@ -978,7 +978,7 @@ void show_filer_menu(FilerWindow *filer_window, GdkEvent *event, ViewIter *iter)
 				break;
 			case 1:
 				item = filer_selected_item(filer_window);
-				if (item->base_type == TYPE_UNKNOWN)
+				if (ITEM_UNSCANNED(item))
 					dir_update_item(filer_window->directory,
 							item->leafname);
 				shade_file_menu_items(FALSE);
@@ -2590,7 +2590,7 @@ static void file_op(gpointer data, FileOp action, GtkWidget *unused)
 	g_return_if_fail(item != NULL);
 	/* iter may be passed to filer_openitem... */
 
-	if (item->base_type == TYPE_UNKNOWN)
+	if (ITEM_UNSCANNED(item))
 		item = dir_update_item(window_with_focus->directory,
 					item->leafname);
 
@@ -197,6 +197,35 @@ gboolean mount_is_user_mounted(const gchar *path)
 	return retval;
 }
 
+/* TRUE if 'path' is on a network (or FUSE) filesystem, where each stat()
+ * may be a round trip to a server. Unknown => FALSE.
+ */
+gboolean mount_is_remote(const gchar *path)
+{
+#if defined(HAVE_SYS_VFS_H) && defined(__linux__)
+	struct statfs buf;
+
+	if (statfs(path, &buf))
+		return FALSE;
+
+	switch ((guint32) buf.f_type)
+	{
+	case 0x6969:		/* NFS */
+	case 0x517b:		/* SMB */
+	case 0xff534d42:	/* CIFS */
+	case 0xfe534d42:	/* SMB2 */
+	case 0x65735546:	/* FUSE (sshfs, etc) */
+	case 0x73757245:	/* Coda */
+	case 0x5346414f:	/* AFS */
+	case 0x564c:		/* NCP */
+	case 0x01021997:	/* 9P */
+	case 0x00c36400:	/* Ceph */
+		return TRUE;
+	}
+#endif
+	return FALSE;
+}
+
 /****************************************************************
  *			INTERNAL FUNCTIONS			*
  ****************************************************************/
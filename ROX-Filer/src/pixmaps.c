@@ -36,9 +36,13 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <string.h>
 
 #include <gtk/gtk.h>
+#ifdef CAIRO_HAS_XLIB_SURFACE
+# include <cairo-xlib.h>
+#endif
 
 #include "global.h"
 
@@ -49,11 +53,14 @@
 #include "main.h"
 #include "filer.h"
 #include "dir.h"
+#include "dirtree.h"
 #include "diritem.h"
 #include "choices.h"
 #include "options.h"
 #include "action.h"
 #include "type.h"
+#include "display.h"
+#include "thumbpack.h"
 
 GFSCache *pixmap_cache = NULL;
 GFSCache *thumb_cache = NULL;
@@ -95,22 +102,124 @@ Option o_pixmap_thumb_file_size;
 Option o_jpeg_thumbs;
 static Option o_purge_time;
 Option o_purge_days;
+static Option o_image_cache_size;	/* MB, for each of the two caches */
 
 
 typedef struct _ChildThumbnail ChildThumbnail;
 
-/* There is one of these for each active child process */
+/* There is one of these for each thumbnail being made, either by a
+ * MIME-thumb child process or by thumb_pool.
+ */
 struct _ChildThumbnail {
 	gchar	 *path;
 	GFunc	 callback;
 	gpointer data;
-	pid_t	 child;
+	pid_t	 child;		/* 0 => in thumb_pool */
 	guint	 timeout;
 	guint	 order;
+	MIME_type *type;
+	gboolean dir;		/* A directory; see compose_dir_thumb() */
 };
 static guint ordered_num = 0;
 static guint next_order = 0;
 
+/* Loads, scales and saves images for pixmap_background_thumb() */
+static GThreadPool *thumb_pool = NULL;
+static gint thumb_serial = 0;		/* Keeps temporary names unique */
+
+/* A directory's thumbnail is a 2x2 mosaic of its first files' thumbnails.
+ * Only the first DIR_THUMB_SCAN names are looked at, and only
+ * DIR_THUMB_PROBES of them are tried, so a big directory costs no more
+ * than a small one.
+ */
+#define DIR_THUMB_TILES 4
+#define DIR_THUMB_SCAN 64
+#define DIR_THUMB_PROBES 16
+#define DIR_THUMB_GAP 2		/* Pixels between tiles */
+
+typedef struct _ThumbHelper ThumbHelper;
+
+/* A MIME-thumb program which takes a stream of requests, instead of being
+ * run once per file. See start_helper() for the protocol.
+ */
+struct _ThumbHelper {
+	gchar		*prog;
+	pid_t		child;
+	GIOChannel	*to, *from;	/* Both non-blocking */
+	guint		watch;		/* Reading 'from' */
+	GString		*outq;		/* Requests not yet written to 'to' */
+	guint		out_watch;	/* Waiting for room in 'to' */
+	guint		timeout;	/* Kills it if it stops answering */
+	GHashTable	*pending;	/* Request ID -> ChildThumbnail */
+};
+
+/* Kill a helper which hasn't answered for this long (seconds) */
+#define HELPER_TIMEOUT 14
+
+static GHashTable *thumb_helpers = NULL;	/* Program -> ThumbHelper */
+static guint helper_serial = 0;
+
+typedef struct _ScaledSet ScaledSet;
+typedef struct _ScaleJob ScaleJob;
+typedef struct _SurfaceCopy SurfaceCopy;
+
+/* Scaled copies of a pixbuf, kept with it (see pixmap_scaled()) */
+#define MAX_SCALED 2
+struct _ScaledSet {
+	GdkPixbuf	*scaled[MAX_SCALED];	/* Most recently used first */
+	int		pending_w, pending_h;	/* In scale_pool; 0 => none */
+};
+
+struct _ScaleJob {
+	GdkPixbuf	*src, *scaled;
+	int		width, height;
+	GdkWindow	*window;		/* Redraw when done */
+};
+
+/* A pixbuf ready for cairo to draw, on one kind of target */
+struct _SurfaceCopy {
+	cairo_surface_t		*surface;
+	cairo_surface_type_t	type;		/* Of the target */
+	gpointer		screen;		/* The device, if not X */
+	gpointer		visual;
+};
+
+/* Smaller than this (in pixels), scale at once rather than in scale_pool */
+#define SCALE_NOW_PIXELS (64 * 64)
+
+typedef enum {
+	HEAD_BAD,	/* Missing, or not a PNG or JPEG file */
+	HEAD_OK,	/* Texts read (if any) */
+	HEAD_DECODE,	/* Can't tell without gdk-pixbuf */
+} ThumbHead;
+
+typedef struct _ThumbNames ThumbNames;
+
+/* The thumbnail names of the files in a directory; see thumb_md5() */
+struct _ThumbNames {
+	gchar		*real_dir;	/* pathdup() of the directory */
+	GHashTable	*md5s;		/* Leaf -> MD5 of its URI */
+	time_t		last_used;
+};
+
+/* Forget directories' names after this long unused (seconds) */
+#define THUMB_NAMES_TIME 120
+
+static GHashTable *thumb_names = NULL;	/* Directory, as given -> ThumbNames */
+static GMutex m_thumb_names;
+
+static GQuark scaled_quark = 0;
+static GQuark surface_quark = 0;	/* See pixmap_set_source() */
+static GQuark rough_quark = 0;		/* Only to be drawn once */
+
+/* Bytes kept with a cached pixbuf (its scaled copies and surfaces), which
+ * the cache budgets count too. An integer, so the size functions can read it from
+ * any thread. Only changed in the main thread.
+ */
+static GQuark extra_quark = 0;
+static guint remeasure_idle = 0;
+static GThreadPool *scale_pool = NULL;
+
 static const char *stocks[] = {
 	ROX_STOCK_SHOW_DETAILS,
 	ROX_STOCK_SHOW_HIDDEN,
@@ -128,14 +237,58 @@ static gint purge_thumbs(gpointer data);
 static MaskedPixmap *image_from_file(const char *path);
 static MaskedPixmap *get_bad_image(void);
 static GdkPixbuf *get_thumbnail_for(const char *path, gboolean forcheck);
+static gboolean thumb_is_fresh(const char *pathname, gboolean forcheck);
+static gboolean have_thumb(const gchar *path, gboolean *forcheck);
+static ThumbHead read_thumb_head(const char *thumb_path,
+				 gchar **uri, gchar **smtime, gchar **ssize);
 static void ordered_update(ChildThumbnail *info);
 static void thumbnail_done(ChildThumbnail *info);
 static void create_thumbnail(const gchar *path, MIME_type *type);
+static void thumb_worker(gpointer data, gpointer user_data);
+static ThumbHelper *start_helper(const gchar *prog);
+static gboolean helper_request(ThumbHelper *helper, ChildThumbnail *info);
+static gboolean helper_write(ThumbHelper *helper);
+static gboolean helper_input(GIOChannel *source, GIOCondition cond,
+			     ThumbHelper *helper);
+static gboolean helper_output(GIOChannel *source, GIOCondition cond,
+			      ThumbHelper *helper);
+static gboolean helper_timeout(ThumbHelper *helper);
+static void helper_stop(ThumbHelper *helper);
+static void helper_died(ThumbHelper *helper);
+static gboolean thumb_worker_done(gpointer data);
+static gboolean write_thumb(const gchar *buf, gsize count,
+			    GError **error, gpointer data);
 static GList *thumbs_purge_cache(Option *option, xmlNode *node, guchar *label);
+static GList *image_cache_stats(Option *option, xmlNode *node, guchar *label);
 static gchar *thumbnail_path(const gchar *path);
+static gchar *thumb_md5(const char *pathname, gchar **real);
+static gchar *thumb_path_for(const char *pathname, gchar **real);
+static gchar *uri_md5(const char *path);
+static gchar *thumb_file(const char *md5);
+static void free_thumb_names(gpointer data);
 static gchar *thumbnail_program(MIME_type *type);
-static GdkPixbuf *extract_tiff_thumbnail(const gchar *path);
-static void make_dir_thumb(const gchar *path);
+static GdkPixbuf *embedded_preview(const gchar *path);
+static void compose_dir_thumb(const gchar *path);
+static gboolean want_dir_tile(const char *leaf, unsigned char d_type);
+static GdkPixbuf *dir_thumb_tile(const gchar *path);
+static gchar *dir_fail_path(const gchar *path, gchar **real);
+static gboolean dir_thumb_failed(const gchar *path, struct stat *info);
+static void save_dir_failed(const gchar *path, struct stat *info);
+static gsize pixbuf_bytes(GdkPixbuf *pixbuf);
+static gsize surface_bytes(GdkPixbuf *pixbuf);
+static void target_of(cairo_surface_t *target, SurfaceCopy *copy);
+static void free_surface_copy(gpointer data);
+static gsize extra_bytes(GdkPixbuf *pixbuf);
+static void add_extra(GdkPixbuf *pixbuf, gssize bytes);
+static gboolean remeasure_caches(gpointer data);
+static ScaledSet *get_scaled_set(GdkPixbuf *src);
+static void add_scaled(GdkPixbuf *src, GdkPixbuf *scaled);
+static void free_scaled_set(gpointer data);
+static void scale_worker(gpointer data, gpointer user_data);
+static gboolean scale_done(gpointer data);
+static gsize pixmap_bytes(gpointer object, gpointer data);
+static gsize thumb_bytes(gpointer object, gpointer data);
+static void set_cache_budgets(void);
 
 /****************************************************************
  *			EXTERNAL INTERFACE			*
@@ -172,6 +325,9 @@ static void options_changed()
 
 	if (o_purge_time.has_changed)
 		g_fscache_purge(thumb_cache, o_purge_time.int_value);
+
+	if (o_image_cache_size.has_changed)
+		set_cache_budgets();
 }
 
 void pixmaps_init(void)
@@ -184,12 +340,27 @@ void pixmaps_init(void)
 	option_add_int(&o_purge_time, "purge_time", 0);
 	option_add_int(&o_jpeg_thumbs, "jpeg_thumbs", TRUE);
 	option_add_int(&o_purge_days, "purge_days", 90);
+	option_add_int(&o_image_cache_size, "image_cache_size", 64);
 	option_add_notify(options_changed);
 
 	gtk_widget_push_colormap(gdk_rgb_get_colormap());
 
 	pixmap_cache = g_fscache_new((GFSLoadFunc) image_from_file, NULL, NULL);
 	thumb_cache = g_fscache_new((GFSLoadFunc) image_from_file, NULL, NULL);
+	set_cache_budgets();
+
+	thumb_pool = g_thread_pool_new(thumb_worker, NULL,
+			g_get_num_processors(), FALSE, NULL);
+
+	thumb_names = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, free_thumb_names);
+
+	scaled_quark = g_quark_from_static_string("rox-scaled");
+	surface_quark = g_quark_from_static_string("rox-surface");
+	rough_quark = g_quark_from_static_string("rox-rough");
+	extra_quark = g_quark_from_static_string("rox-extra-bytes");
+	scale_pool = g_thread_pool_new(scale_worker, NULL,
+			g_get_num_processors(), FALSE, NULL);
 
 	g_timeout_add(6000, purge_thumbs, NULL);
 	g_timeout_add(PIXMAP_PURGE_TIME / 2 * 1000, purge_pixmaps, NULL);
@@ -225,6 +396,7 @@ void pixmaps_init(void)
 	load_default_pixmaps();
 	set_thumb_size();
 	option_register_widget("thumbs-purge-cache", thumbs_purge_cache);
+	option_register_widget("image-cache-stats", image_cache_stats);
 }
 
 /* Load image <appdir>/images/name.png.
@@ -305,13 +477,28 @@ gint pixmap_check_thumb(const gchar *path)
 		if (found) return -2;
 
 	gboolean forcheck = TRUE;
-	GdkPixbuf *image = pixmap_try_thumb(path, &forcheck);
+	struct stat info;
 
-	if (image)
+	if (o_display_show_dir_thumbs.int_value == 1 &&
+	    mc_stat(path, &info) == 0 && S_ISDIR(info.st_mode))
 	{
-		g_object_unref(image);
-		return 1;
+		struct stat thumbinfo;
+		gchar *thumb_path = pixmap_make_thumb_path(path);
+
+		/* Older versions linked to one of its files' thumbnails */
+		if (mc_lstat(thumb_path, &thumbinfo) == 0 &&
+		    S_ISLNK(thumbinfo.st_mode))
+			unlink(thumb_path);
+		g_free(thumb_path);
+
+		if (have_thumb(path, &forcheck))
+			return 1;
+
+		return dir_thumb_failed(path, &info) ? -1 : 0;
 	}
+
+	if (have_thumb(path, &forcheck))
+		return 1;
 	if (forcheck)
 		return -1;
 
@@ -381,15 +568,15 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 	pid_t		child;
 	ChildThumbnail	*info;
 	MIME_type       *type;
-	gchar		*thumb_prog, *base;
+	gchar		*thumb_prog, *thumb_path, *base;
+	ThumbHelper	*helper;
+	struct stat	dirinfo;
 
 	gboolean forcheck = TRUE;
-	image = pixmap_try_thumb(path, &forcheck);
 
-	if (image)
+	if (have_thumb(path, &forcheck))
 	{
-		g_object_unref(image);
-		/* Thumbnail loaded */
+		/* Thumbnail is there */
 		callback(data, (gpointer)path);
 		return;
 	}
@@ -421,6 +608,28 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 	/* Not in memory, nor in the thumbnails directory.  We need to
 	 * generate it */
 
+	if (o_display_show_dir_thumbs.int_value == 1 &&
+	    mc_stat(path, &dirinfo) == 0 && S_ISDIR(dirinfo.st_mode))
+	{
+		if (dir_thumb_failed(path, &dirinfo))
+		{
+			callback(data, NULL);
+			return;
+		}
+
+		g_fscache_insert(thumb_cache, path, NULL, TRUE);
+
+		info = g_new0(ChildThumbnail, 1);
+		info->path = g_strdup(path);
+		info->callback = callback;
+		info->data = data;
+		info->order = ordered_num++;
+		info->dir = TRUE;
+		if (noorder) info->order = 0;
+		g_thread_pool_push(thumb_pool, info, NULL);
+		return;
+	}
+
 	type = type_from_path(path);
 	if (!type)
 		type = text_plain;
@@ -443,14 +652,35 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 	info->path = g_strdup(path);
 	info->callback = callback;
 	info->data = data;
+	info->child = 0;
 	info->timeout = 0;
 	info->order = ordered_num++;
+	info->type = type;
+	info->dir = FALSE;
 	if (noorder) info->order = 0;
 
+	if (!thumb_prog)
+	{
+		/* An image. No need for a whole new process */
+		g_thread_pool_push(thumb_pool, info, NULL);
+		return;
+	}
+
+	helper = start_helper(thumb_prog);
+	if (helper && helper_request(helper, info))
+	{
+		g_free(thumb_prog);
+		return;
+	}
+
+	/* Not after the fork; another thread may hold the memo's lock */
+	thumb_path = thumbnail_path(path);
+
 	child = fork();
 	if (child == -1)
 	{
 		g_free(thumb_prog);
+		g_free(thumb_path);
 		delayed_error("fork(): %s", g_strerror(errno));
 		callback(data, NULL);
 		return;
@@ -460,31 +690,25 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder,
 	{
 		/* We are the child process.  (We are sloppy with freeing
 		   memory, but since we go away very quickly, that's ok.) */
-		if (thumb_prog)
-		{
-			DirItem *item;
-
-			base = g_path_get_basename(thumb_prog);
-			item = diritem_new(base);
-			g_free(base);
-			diritem_restat(thumb_prog, item, NULL, TRUE);
-			if (item->flags & ITEM_FLAG_APPDIR)
-				thumb_prog = g_strconcat(thumb_prog, "/AppRun",
-						NULL);
-
-			execl(thumb_prog, thumb_prog, path,
-					thumbnail_path(path),
-					g_strdup_printf("%d", thumb_size),
-					NULL);
-
-			_exit(1);
-		}
+		DirItem *item;
+
+		base = g_path_get_basename(thumb_prog);
+		item = diritem_new(base);
+		g_free(base);
+		diritem_restat(thumb_prog, item, NULL, TRUE);
+		if (item->flags & ITEM_FLAG_APPDIR)
+			thumb_prog = g_strconcat(thumb_prog, "/AppRun", NULL);
+
+		execl(thumb_prog, thumb_prog, path,
+				thumb_path,
+				g_strdup_printf("%d", thumb_size),
+				NULL);
 
-		create_thumbnail(path, type);
-		_exit(0);
+		_exit(1);
 	}
 
 	g_free(thumb_prog);
+	g_free(thumb_path);
 	info->child = child;
 	info->timeout = g_timeout_add_seconds(14,
 			(GSourceFunc) thumb_prog_timeout, info);
@@ -576,8 +800,9 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 	int original_width, original_height;
 	GString *to;
 	char *md5, *swidth, *sheight, *ssize, *smtime, *uri;
-	mode_t old_mask;
-	int name_len;
+	char *thumb_path;
+	int name_len, fd;
+	gboolean saved;
 	GdkPixbuf *thumb;
 
 	if (mc_stat(pathname, &info) != 0)
@@ -593,41 +818,39 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 	ssize = g_strdup_printf("%" SIZE_FMT, info.st_size);
 	smtime = g_strdup_printf("%ld", (long) info.st_mtime);
 
-	path = pathdup(pathname);
+	md5 = thumb_md5(pathname, &path);
 	uri = g_filename_to_uri(path, NULL, NULL);
 	if (!uri)
 	        uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
 	g_free(path);
 
-	to = g_string_new(home_dir);
-	g_string_append(to, "/.cache");
-	mkdir(to->str, 0700);
-	g_string_append(to, "/thumbnails/");
-	mkdir(to->str, 0700);
-
-	g_string_append(to, thumb_dir);
-	g_string_append(to, "/");
-
-	mkdir(to->str, 0700);
-	g_string_append(to, md5);
-	name_len = to->len + 4; /* Truncate to this length when renaming */
-	g_string_append_printf(to, ".%s.ROX-Filer-%ld",
-			o_jpeg_thumbs.int_value ? "jpg" : "png", (long) getpid());
-
+	thumb_path = thumb_file(md5);
 	g_free(md5);
 
-	old_mask = umask(0077);
-	if (o_jpeg_thumbs.int_value == 1)
+	to = g_string_new(thumb_path);
+	name_len = to->len; /* Truncate to this length when renaming */
+	g_string_append_printf(to, ".ROX-Filer-%ld-%d",
+			(long) getpid(), g_atomic_int_add(&thumb_serial, 1));
+	g_free(thumb_path);
+
+	/* This may be in thumb_pool, so we can't use umask() to keep the
+	 * file private; other threads would get it too.
+	 */
+	fd = open(to->str, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd == -1)
+		saved = FALSE;
+	else if (o_jpeg_thumbs.int_value == 1)
 	{
 		//At least we don't need extensions being '.jpg'
-		gdk_pixbuf_save(thumb, to->str, "jpeg", NULL,
+		saved = gdk_pixbuf_save_to_callback(thumb, write_thumb,
+				GINT_TO_POINTER(fd), "jpeg", NULL,
 				"quality", "77",
 				NULL);
 	}
 	else
 	{
-		gdk_pixbuf_save(thumb, to->str, "png", NULL,
+		saved = gdk_pixbuf_save_to_callback(thumb, write_thumb,
+				GINT_TO_POINTER(fd), "png", NULL,
 				"tEXt::Thumb::Image::Width", swidth,
 				"tEXt::Thumb::Image::Height", sheight,
 				"tEXt::Thumb::Size", ssize,
@@ -636,12 +859,19 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 				"tEXt::Software", PROJECT,
 				NULL);
 	}
-	umask(old_mask);
+	if (fd != -1 && close(fd))
+		saved = FALSE;
 
-	/* We create the file ###.png.ROX-Filer-PID and rename it to avoid
+	/* We create the file ###.png.ROX-Filer-PID-N and rename it to avoid
 	 * a race condition if two programs create the same thumb at
 	 * once.
 	 */
+	if (!saved)
+	{
+		if (fd != -1)
+			unlink(to->str);
+	}
+	else
 	{
 		gchar *final;
 
@@ -662,15 +892,113 @@ static void save_thumbnail(const char *pathname, GdkPixbuf *full)
 }
 
 static gchar *thumbnail_path(const char *path)
+{
+	gchar *md5, *ans;
+
+	md5 = thumb_md5(path, NULL);
+	ans = thumb_file(md5);
+	g_free(md5);
+
+	return ans;
+}
+
+/* The MD5 of the URI which the thumbnail of pathname is named after, and
+ * (if 'real' isn't NULL) pathdup(pathname).
+ *
+ * Resolving the path and hashing it for every check was slow, so for each
+ * directory we resolve the directory once and remember the MD5 of each
+ * leaf. A leaf which is a symlink isn't remembered, since it's resolved
+ * to its target. pixmap_forget_thumb_name() is called when a name goes.
+ * Can be used from any thread. g_free() the results.
+ */
+static gchar *thumb_md5(const char *pathname, gchar **real)
+{
+	ThumbNames *names;
+	const char *slash, *leaf, *md5;
+	gchar *dir, *path, *ans;
+	struct stat info;
+
+	slash = strrchr(pathname, '/');
+	leaf = slash ? slash + 1 : NULL;
+
+	if (pathname[0] != '/' || slash == pathname || !*leaf ||
+	    strcmp(leaf, ".") == 0 || strcmp(leaf, "..") == 0)
+	{
+		path = pathdup(pathname);
+		ans = uri_md5(path);
+		if (real)
+			*real = path;
+		else
+			g_free(path);
+		return ans;
+	}
+
+	dir = g_strndup(pathname, slash - pathname);
+
+	g_mutex_lock(&m_thumb_names);
+
+	names = g_hash_table_lookup(thumb_names, dir);
+	if (names)
+		g_free(dir);
+	else
+	{
+		names = g_new(ThumbNames, 1);
+		names->real_dir = pathdup(dir);
+		names->md5s = g_hash_table_new_full(g_str_hash, g_str_equal,
+						    g_free, g_free);
+		g_hash_table_insert(thumb_names, dir, names);
+	}
+	names->last_used = time(NULL);
+
+	if (strcmp(names->real_dir, "/") == 0)
+		path = g_strconcat("/", leaf, NULL);
+	else
+		path = g_strconcat(names->real_dir, "/", leaf, NULL);
+
+	md5 = g_hash_table_lookup(names->md5s, leaf);
+	if (md5)
+		ans = g_strdup(md5);
+	else if (mc_lstat(pathname, &info) == 0 && S_ISLNK(info.st_mode))
+	{
+		g_free(path);
+		path = pathdup(pathname);
+		ans = uri_md5(path);
+	}
+	else
+	{
+		ans = uri_md5(path);
+		g_hash_table_insert(names->md5s, g_strdup(leaf), g_strdup(ans));
+	}
+
+	g_mutex_unlock(&m_thumb_names);
+
+	if (real)
+		*real = path;
+	else
+		g_free(path);
+
+	return ans;
+}
+
+static gchar *uri_md5(const char *path)
 {
 	gchar *uri, *md5;
-	GString *to;
-	gchar *ans;
 
 	uri = g_filename_to_uri(path, NULL, NULL);
-	if(!uri)
-	       uri = g_strconcat("file://", path, NULL);
+	if (!uri)
+	        uri = g_strconcat("file://", path, NULL);
 	md5 = md5_hash(uri);
+	g_free(uri);
+
+	return md5;
+}
+
+/* The path of the thumbnail called md5, making the directories for it.
+ * g_free() the result.
+ */
+static gchar *thumb_file(const char *md5)
+{
+	GString *to;
 
 	to = g_string_new(home_dir);
 	g_string_append(to, "/.cache");
@@ -685,13 +1013,16 @@ static gchar *thumbnail_path(const char *path)
 	g_string_append(to, md5);
 	g_string_append(to, o_jpeg_thumbs.int_value ? ".jpg" : ".png");
 
-	g_free(md5);
-	g_free(uri);
+	return g_string_free(to, FALSE);
+}
 
-	ans=to->str;
-	g_string_free(to, FALSE);
+static void free_thumb_names(gpointer data)
+{
+	ThumbNames *names = (ThumbNames *) data;
 
-	return ans;
+	g_hash_table_destroy(names->md5s);
+	g_free(names->real_dir);
+	g_free(names);
 }
 
 /* Return a program to create thumbnails for files of this type.
@@ -724,15 +1055,40 @@ static gchar *thumbnail_program(MIME_type *type)
 	return NULL;
 }
 
-/* Load path and create the thumbnail
- * file. Parent will notice when we die.
+static gboolean write_thumb(const gchar *buf, gsize count,
+			    GError **error, gpointer data)
+{
+	int fd = GPOINTER_TO_INT(data);
+
+	while (count > 0)
+	{
+		ssize_t got = write(fd, buf, count);
+
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0)
+		{
+			g_set_error(error, G_FILE_ERROR,
+				    g_file_error_from_errno(errno),
+				    "%s", g_strerror(errno));
+			return FALSE;
+		}
+		count -= got;
+		buf += got;
+	}
+
+	return TRUE;
+}
+
+/* Load path and create the thumbnail file. Runs in thumb_pool.
+ * rox_pixbuf_new_from_file_at_scale() lets the JPEG loader decode at
+ * 1/2, 1/4 or 1/8 size, so even a full decode is not too slow.
  */
 static void create_thumbnail(const gchar *path, MIME_type *type)
 {
-	GdkPixbuf *image=NULL;
+	GdkPixbuf *image;
 
-        if(strcmp(type->subtype, "jpeg")==0)
-            image=extract_tiff_thumbnail(path);
+	image = embedded_preview(path);
 
 	if(!image)
             image = rox_pixbuf_new_from_file_at_scale(path,
@@ -745,155 +1101,646 @@ static void create_thumbnail(const gchar *path, MIME_type *type)
 	}
 }
 
+/* 'leaf' in 'dir' has gone, or may now be something else (eg, a symlink).
+ * Forget the name of its thumbnail.
+ */
+void pixmap_forget_thumb_name(const char *dir, const char *leaf)
+{
+	ThumbNames *names;
+
+	g_mutex_lock(&m_thumb_names);
+	names = g_hash_table_lookup(thumb_names, dir);
+	if (names)
+		g_hash_table_remove(names->md5s, leaf);
+	g_mutex_unlock(&m_thumb_names);
+}
+
+/* Delete the thumbnail of 'path', and any note that it can't have one */
+void pixmap_unlink_thumb(const char *path)
+{
+	gchar *thumb_path;
+
+	thumb_path = pixmap_make_thumb_path(path);
+	unlink(thumb_path);
+	g_free(thumb_path);
+
+	thumb_path = dir_fail_path(path, NULL);
+	unlink(thumb_path);
+	g_free(thumb_path);
+}
+
 char *pixmap_make_thumb_path(const char *path)
 {
-	char *thumb_path, *md5, *uri;
+	return thumb_path_for(path, NULL); /* This return is used unlink! Be carefull */
+}
 
-	uri = g_filename_to_uri(path, NULL, NULL);
-	if (!uri)
-	        uri = g_strconcat("file://", path, NULL);
-	md5 = md5_hash(uri);
-	g_free(uri);
+/* As pixmap_make_thumb_path(), also setting 'real' as thumb_md5() does */
+static gchar *thumb_path_for(const char *path, gchar **real)
+{
+	char *thumb_path, *md5;
+
+	md5 = thumb_md5(path, real);
 
 	thumb_path = g_strdup_printf(
 			"%s/.cache/thumbnails/%s/%s.%s",
 			home_dir, thumb_dir, md5, o_jpeg_thumbs.int_value ? "jpg" : "png");
 	g_free(md5);
 
-	return thumb_path; /* This return is used unlink! Be carefull */
+	return thumb_path;
 }
 
-static void make_dir_thumb(const gchar *path)
+/* Make the thumbnail of directory 'path', a mosaic of the thumbnails of
+ * its first few files, making those too if they're images. The files are
+ * taken from dirtree's listing if it has an up-to-date one, or else from
+ * the first few names readdir() gives. If there are none, we note that
+ * instead, so it isn't tried again until the directory changes. Runs in
+ * thumb_pool.
+ */
+static void compose_dir_thumb(const gchar *path)
 {
-	gchar *dir = g_path_get_dirname(path);
-	gchar *dir_thumb_path = pixmap_make_thumb_path(dir);
-	GdkPixbuf *image = gdk_pixbuf_new_from_file(dir_thumb_path, NULL);
-	if (image)
+	GdkPixbuf *tiles[DIR_THUMB_TILES], *mosaic;
+	struct stat info;
+	TreeNode *node;
+	int n_tiles = 0, probes = 0, cell, i;
+
+	if (mc_stat(path, &info) != 0)
+		return;
+
+	node = dirtree_peek(path, &info);
+	if (node)
 	{
-		g_object_unref(image);
+		for (i = 0; i < node->n_entries && i < DIR_THUMB_SCAN &&
+		     n_tiles < DIR_THUMB_TILES && probes < DIR_THUMB_PROBES;
+		     i++)
+		{
+			TreeEntry *ent = &node->entries[i];
+			gchar *child;
+
+			if (!want_dir_tile(ent->leaf, ent->d_type))
+				continue;
+			probes++;
+			child = g_build_filename(path, ent->leaf, NULL);
+			tiles[n_tiles] = dir_thumb_tile(child);
+			if (tiles[n_tiles])
+				n_tiles++;
+			g_free(child);
+		}
+		g_object_unref(node);
 	}
 	else
 	{
-		unlink(dir_thumb_path); //////////////////////////
-
-		char *thumb_path = pixmap_make_thumb_path(path);
-		char *rel_path = get_relative_path(dir_thumb_path, thumb_path);
+		struct dirent *ent;
+		int scanned = 0;
+		DIR *d;
 
-		if (symlink(rel_path, dir_thumb_path) == 0)
-			dir_force_update_path(dir, TRUE);
+		d = mc_opendir((char *) path);
+		if (!d)
+			return;
 
-		g_free(rel_path);
-		g_free(thumb_path);
+		while (n_tiles < DIR_THUMB_TILES &&
+		       probes < DIR_THUMB_PROBES &&
+		       scanned++ < DIR_THUMB_SCAN && (ent = mc_readdir(d)))
+		{
+			gchar *child;
+
+			if (!want_dir_tile(ent->d_name, ent->d_type))
+				continue;
+			probes++;
+			child = g_build_filename(path, ent->d_name, NULL);
+			tiles[n_tiles] = dir_thumb_tile(child);
+			if (tiles[n_tiles])
+				n_tiles++;
+			g_free(child);
+		}
+		mc_closedir(d);
 	}
-	g_free(dir_thumb_path);
-	g_free(dir);
-}
 
-static void ordered_update(ChildThumbnail *info)
-{
-	static GSList *done_stack = NULL;
-	done_stack = g_slist_prepend(done_stack, info);
+	if (n_tiles == 0)
+	{
+		save_dir_failed(path, &info);
+		return;
+	}
 
-	if (next_order < info->order) return;
+	mosaic = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8,
+				thumb_size, thumb_size);
+	gdk_pixbuf_fill(mosaic, 0);
 
-	GSList *n = done_stack;
-	while (n)
+	/* A single file fills it; otherwise two rows of two */
+	cell = n_tiles == 1 ? thumb_size : (thumb_size - DIR_THUMB_GAP) / 2;
+	for (i = 0; i < n_tiles; i++)
 	{
-		ChildThumbnail *li = n->data;
-		if (li->order > next_order)
-		{
-			n = n->next;
-			continue;
-		}
-
-		if (!li->callback)
-			dir_force_update_path(li->path, TRUE);
-		make_dir_thumb(li->path);
+		int w = gdk_pixbuf_get_width(tiles[i]);
+		int h = gdk_pixbuf_get_height(tiles[i]);
+		double scale = MIN(1.0, MIN((double) cell / w,
+					    (double) cell / h));
+		int dest_w = MAX(1, (int) (w * scale));
+		int dest_h = MAX(1, (int) (h * scale));
+		int x = (i % 2) * (cell + DIR_THUMB_GAP) + (cell - dest_w) / 2;
+		int y = (i / 2) * (cell + DIR_THUMB_GAP) + (cell - dest_h) / 2;
+
+		gdk_pixbuf_scale(tiles[i], mosaic, x, y, dest_w, dest_h,
+				 x, y, scale, scale, GDK_INTERP_BILINEAR);
+		g_object_unref(tiles[i]);
+	}
 
-		g_free(li->path);
-		g_free(li);
+	/* Its Thumb::MTime is the directory's, so it's kept until that
+	 * changes, like any other thumbnail.
+	 */
+	save_thumbnail(path, mosaic);
+	g_object_unref(mosaic);
+}
 
-		next_order++;
-		n = done_stack =
-			g_slist_delete_link(done_stack, n);
-	}
+/* Might 'leaf' be a file to show in its directory's thumbnail? */
+static gboolean want_dir_tile(const char *leaf, unsigned char d_type)
+{
+	if (leaf[0] == '.')
+		return FALSE;	/* Hidden, or '.' and '..' */
+#ifdef DT_DIR
+	if (d_type != DT_REG && d_type != DT_LNK && d_type != DT_UNKNOWN)
+		return FALSE;
+#endif
+	return TRUE;
 }
-static void thumbnail_done(ChildThumbnail *info)
+
+/* The thumbnail of 'path' for compose_dir_thumb(), making (and saving) it
+ * if 'path' is an image. NULL if we have nothing to show for it.
+ */
+static GdkPixbuf *dir_thumb_tile(const gchar *path)
 {
-	if (info->timeout)
-		g_source_remove(info->timeout);
+	struct stat info;
+	GdkPixbuf *image;
 
-	GdkPixbuf *thumb = get_thumbnail_for(info->path, FALSE);
-	if (thumb)
-	{
-		g_object_unref(thumb);
-		g_fscache_remove(thumb_cache, info->path);
-	}
-	else
-		g_fscache_insert(pixmap_cache, info->path, NULL, TRUE);
+	if (mc_stat(path, &info) != 0 || !S_ISREG(info.st_mode) ||
+	    info.st_size == 0)
+		return NULL;
+
+	image = get_thumbnail_for(path, FALSE);
+	if (image)
+		return image;
 
-	info->callback(info->data, thumb ? info->path : NULL);
+	/* This only reads the header, so other files are skipped quickly */
+	if (!gdk_pixbuf_get_file_info(path, NULL, NULL))
+		return NULL;
 
-	ordered_update(info);
-}
+	image = embedded_preview(path);
+	if (!image)
+		image = rox_pixbuf_new_from_file_at_scale(path,
+				thumb_size, thumb_size, TRUE, NULL);
+	if (image)
+		save_thumbnail(path, image);
 
+	return image;
+}
 
-/* Check if we have an up-to-date thumbnail for this image.
- * If so, return it. Otherwise, returns NULL.
+/* Where we note that directory 'path' has nothing to make a thumbnail
+ * from. This is the thumbnail spec's 'fail' directory. Sets 'real' as
+ * thumb_md5() does. g_free() the result.
  */
-static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
+static gchar *dir_fail_path(const gchar *path, gchar **real)
 {
-	GdkPixbuf *thumb = NULL;
-	char *thumb_path, *path, *pic_path = NULL;
-	const char *pic_uri, *ssize, *smtime;
-	struct stat info, thumbinfo;
-	time_t ttime, now;
+	gchar *md5, *ans;
 
-	path = pathdup(pathname);
+	md5 = thumb_md5(path, real);
+	ans = g_strdup_printf("%s/.cache/thumbnails/fail/" PROJECT "/%s.png",
+			home_dir, md5);
+	g_free(md5);
 
-	thumb_path = pixmap_make_thumb_path(path);
+	return ans;
+}
 
-	thumb = gdk_pixbuf_new_from_file(thumb_path, NULL);
-	if (!thumb)
+/* Did compose_dir_thumb() find nothing in 'path' (which has been stat'd
+ * into 'info') since it last changed?
+ */
+static gboolean dir_thumb_failed(const gchar *path, struct stat *info)
+{
+	gchar *fail_path, *uri, *smtime, *ssize;
+	gboolean failed = FALSE;
+
+	fail_path = dir_fail_path(path, NULL);
+
+	if (read_thumb_head(fail_path, &uri, &smtime, &ssize) == HEAD_OK)
 	{
-		if (forcheck
-				&& !mc_lstat(thumb_path, &thumbinfo)
-				&& S_ISLNK(thumbinfo.st_mode)
-				&& mc_stat(thumb_path, &thumbinfo)
-		)
-			unlink(thumb_path);
+		failed = smtime && atol(smtime) == (long) info->st_mtime;
+		if (!failed)
+			unlink(fail_path);
+	}
 
-		goto out;
+	g_free(uri);
+	g_free(smtime);
+	g_free(ssize);
+	g_free(fail_path);
+	return failed;
+}
+
+/* Note that directory 'path' has nothing to show, for dir_thumb_failed() */
+static void save_dir_failed(const gchar *path, struct stat *info)
+{
+	GdkPixbuf *pixbuf;
+	gchar *fail_path, *real, *dir, *uri, *smtime, *tmp;
+	gboolean saved = FALSE;
+	int fd;
+
+	fail_path = dir_fail_path(path, &real);
+	uri = g_filename_to_uri(real, NULL, NULL);
+	if (!uri)
+	        uri = g_strconcat("file://", real, NULL);
+	g_free(real);
+	smtime = g_strdup_printf("%ld", (long) info->st_mtime);
+
+	dir = g_path_get_dirname(fail_path);
+	g_mkdir_with_parents(dir, 0700);
+	g_free(dir);
+
+	pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, TRUE, 8, 1, 1);
+	gdk_pixbuf_fill(pixbuf, 0);
+
+	/* Renamed into place, as in save_thumbnail() */
+	tmp = g_strdup_printf("%s.ROX-Filer-%ld-%d", fail_path,
+			(long) getpid(), g_atomic_int_add(&thumb_serial, 1));
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd != -1)
+	{
+		saved = gdk_pixbuf_save_to_callback(pixbuf, write_thumb,
+				GINT_TO_POINTER(fd), "png", NULL,
+				"tEXt::Thumb::URI", uri,
+				"tEXt::Thumb::MTime", smtime,
+				"tEXt::Software", PROJECT,
+				NULL);
+		if (close(fd))
+			saved = FALSE;
+		if (!saved || rename(tmp, fail_path))
+			unlink(tmp);
+	}
+
+	g_object_unref(pixbuf);
+	g_free(tmp);
+	g_free(smtime);
+	g_free(uri);
+	g_free(fail_path);
+}
+
+static void ordered_update(ChildThumbnail *info)
+{
+	static GSList *done_stack = NULL;
+	done_stack = g_slist_prepend(done_stack, info);
+
+	if (next_order < info->order) return;
+
+	GSList *n = done_stack;
+	while (n)
+	{
+		ChildThumbnail *li = n->data;
+		if (li->order > next_order)
+		{
+			n = n->next;
+			continue;
+		}
+
+		if (!li->callback)
+			dir_force_update_path(li->path, TRUE);
+
+		g_free(li->path);
+		g_free(li);
+
+		next_order++;
+		n = done_stack =
+			g_slist_delete_link(done_stack, n);
+	}
+}
+/* If 'prog' has a 'prog.batch' file next to it, it can make many
+ * thumbnails in one run. Returns the running helper for it, starting it if
+ * needed, or NULL if it isn't that kind of program.
+ *
+ * The helper is run as 'prog --batch'. Each request is one line on its
+ * stdin:
+ *	id TAB /path/to/source/file TAB /path/to/thumbnail TAB pixel_size
+ * Requests are sent without waiting for earlier ones to finish. When it
+ * has finished with a request (whether or not it made the thumbnail), it
+ * writes a line starting with the id, in any order. Closing stdin means
+ * there will be no more requests.
+ */
+static ThumbHelper *start_helper(const gchar *prog)
+{
+	ThumbHelper *helper;
+	gchar *argv[3];
+	gchar *marker;
+	gboolean batch;
+	int in, out;
+	GPid child;
+
+	if (!thumb_helpers)
+		thumb_helpers = g_hash_table_new(g_str_hash, g_str_equal);
+
+	helper = g_hash_table_lookup(thumb_helpers, prog);
+	if (helper)
+		return helper;
+
+	marker = g_strconcat(prog, ".batch", NULL);
+	batch = g_file_test(marker, G_FILE_TEST_EXISTS);
+	g_free(marker);
+	if (!batch)
+		return NULL;
+
+	if (g_file_test(prog, G_FILE_TEST_IS_DIR))
+		argv[0] = g_strconcat(prog, "/AppRun", NULL);
+	else
+		argv[0] = g_strdup(prog);
+	argv[1] = "--batch";
+	argv[2] = NULL;
+
+	if (!g_spawn_async_with_pipes(NULL, argv, NULL,
+				      G_SPAWN_DO_NOT_REAP_CHILD,
+				      NULL, NULL, &child,
+				      &in, &out, NULL, NULL))
+	{
+		g_free(argv[0]);
+		return NULL;
+	}
+	g_free(argv[0]);
+
+	helper = g_new(ThumbHelper, 1);
+	helper->prog = g_strdup(prog);
+	helper->child = child;
+	helper->timeout = 0;
+	helper->pending = g_hash_table_new(NULL, NULL);
+	helper->outq = g_string_new(NULL);
+	helper->out_watch = 0;
+
+	/* Binary, so non-UTF-8 filenames are OK. Neither end may block the
+	 * main loop; the helper can be busy writing answers while we write
+	 * requests. Requests go straight to the pipe, as room allows.
+	 */
+	helper->to = g_io_channel_unix_new(in);
+	g_io_channel_set_encoding(helper->to, NULL, NULL);
+	g_io_channel_set_buffered(helper->to, FALSE);
+	g_io_channel_set_flags(helper->to, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_close_on_unref(helper->to, TRUE);
+	helper->from = g_io_channel_unix_new(out);
+	g_io_channel_set_encoding(helper->from, NULL, NULL);
+	g_io_channel_set_flags(helper->from, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_close_on_unref(helper->from, TRUE);
+	helper->watch = g_io_add_watch(helper->from,
+			G_IO_IN | G_IO_ERR | G_IO_HUP,
+			(GIOFunc) helper_output, helper);
+
+	g_hash_table_insert(thumb_helpers, helper->prog, helper);
+	on_child_death(child, (CallbackFn) helper_died, helper);
+
+	return helper;
+}
+
+/* Queue a request. FALSE if it can't take it; make it the old way. */
+static gboolean helper_request(ThumbHelper *helper, ChildThumbnail *info)
+{
+	gchar *thumb_path;
+	guint id;
+
+	/* Can't be sent as one line */
+	if (strpbrk(info->path, "\t\n"))
+		return FALSE;
+
+	id = ++helper_serial;
+	thumb_path = thumbnail_path(info->path);
+	g_string_append_printf(helper->outq, "%u\t%s\t%s\t%d\n",
+			id, info->path, thumb_path, thumb_size);
+	g_free(thumb_path);
+
+	if (!helper->out_watch && !helper_write(helper))
+		return FALSE;	/* (The others fail when it's reaped) */
+
+	g_hash_table_insert(helper->pending, GUINT_TO_POINTER(id), info);
+	if (!helper->timeout)
+		helper->timeout = g_timeout_add_seconds(HELPER_TIMEOUT,
+				(GSourceFunc) helper_timeout, helper);
+
+	return TRUE;
+}
+
+/* Write as much of helper->outq as the pipe will take now, and watch for
+ * room for the rest. On an error, stops the helper and returns FALSE.
+ */
+static gboolean helper_write(ThumbHelper *helper)
+{
+	while (helper->outq->len)
+	{
+		GIOStatus status;
+		gsize done = 0;
+
+		status = g_io_channel_write_chars(helper->to, helper->outq->str,
+				helper->outq->len, &done, NULL);
+		g_string_erase(helper->outq, 0, done);
+
+		if (status == G_IO_STATUS_AGAIN)
+			break;
+		if (status != G_IO_STATUS_NORMAL)
+		{
+			helper_stop(helper);
+			return FALSE;
+		}
+	}
+
+	if (helper->outq->len && !helper->out_watch)
+		helper->out_watch = g_io_add_watch(helper->to,
+				G_IO_OUT | G_IO_ERR | G_IO_HUP,
+				(GIOFunc) helper_input, helper);
+
+	return TRUE;
+}
+
+/* There's room in the helper's stdin */
+static gboolean helper_input(GIOChannel *source, GIOCondition cond,
+			     ThumbHelper *helper)
+{
+	helper->out_watch = 0;
+
+	if (cond & (G_IO_ERR | G_IO_HUP))
+		helper_stop(helper);
+	else
+		helper_write(helper);
+
+	return FALSE;
+}
+
+static gboolean helper_output(GIOChannel *source, GIOCondition cond,
+			      ThumbHelper *helper)
+{
+	GIOStatus status;
+	gchar *line;
+	gsize len;
+
+	/* Until it has nothing more for now. Part of a line stays in the
+	 * channel's buffer until the rest comes.
+	 */
+	while ((status = g_io_channel_read_line(source, &line, &len,
+					NULL, NULL)) == G_IO_STATUS_NORMAL)
+	{
+		guint id = strtoul(line, NULL, 10);
+		ChildThumbnail *info;
+
+		g_free(line);
+
+		info = g_hash_table_lookup(helper->pending,
+					   GUINT_TO_POINTER(id));
+		if (!info)
+			continue;
+		g_hash_table_remove(helper->pending, GUINT_TO_POINTER(id));
+
+		/* Still answering; give the rest more time */
+		if (helper->timeout)
+			g_source_remove(helper->timeout);
+		helper->timeout = g_hash_table_size(helper->pending) ?
+			g_timeout_add_seconds(HELPER_TIMEOUT,
+				(GSourceFunc) helper_timeout, helper) : 0;
+
+		thumbnail_done(info);
+
+		if (!helper->from)
+			return FALSE;	/* Stopped meanwhile */
+	}
+
+	if (status != G_IO_STATUS_AGAIN || cond & (G_IO_ERR | G_IO_HUP))
+	{
+		/* The rest fail when we reap it */
+		helper->watch = 0;
+		helper_stop(helper);
+		return FALSE;
 	}
 
-	/* Note that these don't need freeing... */
-	pic_uri = gdk_pixbuf_get_option(thumb, "tEXt::Thumb::URI");
+	return TRUE;
+}
+
+static gboolean helper_timeout(ThumbHelper *helper)
+{
+	helper->timeout = 0;
+	kill(helper->child, 9);
+	return FALSE;
+}
+
+/* Send no more requests to this helper, and ask it to quit. Any requests
+ * it has are finished off by helper_died().
+ */
+static void helper_stop(ThumbHelper *helper)
+{
+	if (!helper->to)
+		return;
+
+	g_hash_table_remove(thumb_helpers, helper->prog);
+
+	if (helper->watch)
+	{
+		g_source_remove(helper->watch);
+		helper->watch = 0;
+	}
+	if (helper->out_watch)
+	{
+		g_source_remove(helper->out_watch);
+		helper->out_watch = 0;
+	}
+	g_string_truncate(helper->outq, 0);
+	g_io_channel_unref(helper->to);
+	g_io_channel_unref(helper->from);
+	helper->to = helper->from = NULL;
+
+	kill(helper->child, SIGTERM);
+}
+
+static void helper_died(ThumbHelper *helper)
+{
+	GHashTableIter iter;
+	gpointer value;
+	GList *failed = NULL;
+
+	helper_stop(helper);
+	if (helper->timeout)
+		g_source_remove(helper->timeout);
+
+	/* They might have been made anyway; thumbnail_done() checks */
+	g_hash_table_iter_init(&iter, helper->pending);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		failed = g_list_prepend(failed, value);
+	for (GList *next = failed; next; next = next->next)
+		thumbnail_done((ChildThumbnail *) next->data);
+	g_list_free(failed);
+
+	g_hash_table_destroy(helper->pending);
+	g_string_free(helper->outq, TRUE);
+	g_free(helper->prog);
+	g_free(helper);
+}
+
+static void thumb_worker(gpointer data, gpointer user_data)
+{
+	ChildThumbnail *info = (ChildThumbnail *) data;
+
+	if (info->dir)
+		compose_dir_thumb(info->path);
+	else
+		create_thumbnail(info->path, info->type);
+
+	g_idle_add(thumb_worker_done, info);
+}
+
+static gboolean thumb_worker_done(gpointer data)
+{
+	thumbnail_done((ChildThumbnail *) data);
+
+	return FALSE;
+}
+
+static void thumbnail_done(ChildThumbnail *info)
+{
+	if (info->timeout)
+		g_source_remove(info->timeout);
+
+	gboolean made = thumb_is_fresh(info->path, FALSE);
+	if (made)
+		g_fscache_remove(thumb_cache, info->path);
+	else
+		g_fscache_insert(pixmap_cache, info->path, NULL, TRUE);
+
+	info->callback(info->data, made ? info->path : NULL);
+
+	ordered_update(info);
+}
+
+
+/* Is the thumbnail at thumb_path still right for the image at path?
+ * uri, smtime and ssize are the thumbnail's Thumb::URI, Thumb::MTime and
+ * Thumb::Size texts, if it has them.
+ */
+static gboolean check_fresh(const char *path, const char *thumb_path,
+			    const char *pic_uri, const char *smtime,
+			    const char *ssize, gboolean forcheck)
+{
+	struct stat info, thumbinfo;
+	time_t ttime, now;
+
 	if (pic_uri)
 	{
-		pic_path = g_filename_from_uri(pic_uri, NULL, NULL);
+		gchar *pic_path = g_filename_from_uri(pic_uri, NULL, NULL);
+		int ret = pic_path ? mc_stat(pic_path, &info) : -1;
 
-		if (mc_stat(pic_path, &info) != 0)
-			goto err;
+		g_free(pic_path);
+		if (ret != 0)
+			return FALSE;
 
-		smtime = gdk_pixbuf_get_option(thumb, "tEXt::Thumb::MTime");
 		if (!smtime)
-			goto err;
+			return FALSE;
 		ttime=(time_t) atol(smtime);
 		time(&now);
 		if (info.st_mtime != ttime && now>ttime+PIXMAP_THUMB_TOO_OLD_TIME)
-			goto err;
+			return FALSE;
 
 		/* This is optional, so don't flag an error if it is missing */
-		ssize = gdk_pixbuf_get_option(thumb, "tEXt::Thumb::Size");
 		if (ssize && info.st_size < atol(ssize))
-			goto err;
+			return FALSE;
 	}
 	else
 	{ //for jpeg
 		if (mc_lstat(thumb_path, &thumbinfo) != 0 ||
 			mc_lstat(path, &info) != 0
 			)
-			goto err;
+			return FALSE;
 
 		if (forcheck && (
 					   info.st_ctime == thumbinfo.st_ctime
@@ -902,25 +1749,211 @@ static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
 		{ //maybe thumb is old in a sec.
 			time(&now);
 			if (now > thumbinfo.st_ctime)
-				goto err;
+				return FALSE;
 		}
 		else if (info.st_ctime > thumbinfo.st_ctime)
-			goto err;
+			return FALSE;
 	}
 
-	goto out;
-err:
-	g_object_unref(thumb);
-	unlink(thumb_path);
-	thumb = NULL;
+	return TRUE;
+}
+
+/* A missing thumbnail may be a directory's link to one of its files'
+ * thumbnails (older versions made these), which has gone. Remove it.
+ */
+static void remove_dangling(const char *thumb_path, gboolean forcheck)
+{
+	struct stat thumbinfo;
+
+	if (forcheck
+			&& !mc_lstat(thumb_path, &thumbinfo)
+			&& S_ISLNK(thumbinfo.st_mode)
+			&& mc_stat(thumb_path, &thumbinfo)
+	)
+		unlink(thumb_path);
+}
+
+/* Check if we have an up-to-date thumbnail for this image.
+ * If so, return it. Otherwise, returns NULL.
+ */
+static GdkPixbuf *get_thumbnail_for(const char *pathname, gboolean forcheck)
+{
+	GdkPixbuf *thumb = NULL;
+	char *thumb_path, *path;
+
+	thumb_path = thumb_path_for(pathname, &path);
+
+	thumb = gdk_pixbuf_new_from_file(thumb_path, NULL);
+	if (!thumb)
+		remove_dangling(thumb_path, forcheck);
+	else if (!check_fresh(path, thumb_path,
+			/* Note that these don't need freeing... */
+			gdk_pixbuf_get_option(thumb, "tEXt::Thumb::URI"),
+			gdk_pixbuf_get_option(thumb, "tEXt::Thumb::MTime"),
+			gdk_pixbuf_get_option(thumb, "tEXt::Thumb::Size"),
+			forcheck))
+	{
+		g_object_unref(thumb);
+		unlink(thumb_path);
+		thumb = NULL;
+	}
 
-out:
-	g_free(pic_path);
 	g_free(path);
 	g_free(thumb_path);
 	return thumb;
 }
 
+/* Read the URI, MTime and Size texts from a PNG thumbnail's chunks, up to
+ * the first IDAT, without decoding any pixels. JPEG thumbnails don't have
+ * them. g_free() the results.
+ */
+static ThumbHead read_thumb_head(const char *thumb_path,
+				 gchar **uri, gchar **smtime, gchar **ssize)
+{
+	static const guchar png_sig[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+	guchar head[8];
+	ThumbHead ret = HEAD_DECODE;
+	FILE *in;
+
+	*uri = *smtime = *ssize = NULL;
+
+	in = fopen(thumb_path, "rb");
+	if (!in)
+		return HEAD_BAD;
+
+	if (fread(head, 1, 8, in) != 8)
+		ret = HEAD_BAD;
+	else if (head[0] == 0xff && head[1] == 0xd8 && head[2] == 0xff)
+		ret = HEAD_OK;
+	else if (memcmp(head, png_sig, 8) != 0)
+		ret = HEAD_BAD;
+	else while (fread(head, 1, 8, in) == 8)
+	{
+		guint32 len = (head[0] << 24) | (head[1] << 16) |
+			      (head[2] << 8) | head[3];
+		const char *type = (char *) head + 4;
+		gchar *data, **value = NULL;
+
+		if (len > 0x7fffffff)
+			break;
+		if (memcmp(type, "IDAT", 4) == 0 || memcmp(type, "IEND", 4) == 0)
+		{
+			ret = HEAD_OK;
+			break;
+		}
+		if (memcmp(type, "zTXt", 4) == 0 || memcmp(type, "iTXt", 4) == 0)
+			break;		/* Compressed or UTF-8; let gdk-pixbuf do it */
+		if (memcmp(type, "tEXt", 4) != 0 || len > 4096)
+		{
+			if (fseek(in, (long) len + 4, SEEK_CUR))
+				break;
+			continue;
+		}
+
+		/* keyword NUL text, then the CRC */
+		data = g_malloc(len + 1);
+		if (fread(data, 1, len, in) != len || fseek(in, 4, SEEK_CUR))
+		{
+			g_free(data);
+			break;
+		}
+		data[len] = '\0';
+
+		if (strcmp(data, "Thumb::URI") == 0)
+			value = uri;
+		else if (strcmp(data, "Thumb::MTime") == 0)
+			value = smtime;
+		else if (strcmp(data, "Thumb::Size") == 0)
+			value = ssize;
+		if (value && !*value && strlen(data) < len)
+			*value = g_strdup(data + strlen(data) + 1);
+		g_free(data);
+	}
+
+	fclose(in);
+
+	if (ret != HEAD_OK)
+	{
+		g_free(*uri);
+		g_free(*smtime);
+		g_free(*ssize);
+		*uri = *smtime = *ssize = NULL;
+	}
+
+	return ret;
+}
+
+/* As get_thumbnail_for(), but just says whether there is one. Only the
+ * headers are read, so this is much quicker.
+ */
+static gboolean thumb_is_fresh(const char *pathname, gboolean forcheck)
+{
+	gchar *thumb_path, *path, *uri, *smtime, *ssize;
+	gboolean fresh = FALSE;
+	GdkPixbuf *thumb;
+
+	thumb_path = thumb_path_for(pathname, &path);
+
+	switch (read_thumb_head(thumb_path, &uri, &smtime, &ssize))
+	{
+		case HEAD_BAD:
+			remove_dangling(thumb_path, forcheck);
+			break;
+		case HEAD_OK:
+			fresh = check_fresh(path, thumb_path,
+					uri, smtime, ssize, forcheck);
+			if (!fresh)
+				unlink(thumb_path);
+			break;
+		case HEAD_DECODE:
+			thumb = get_thumbnail_for(path, forcheck);
+			fresh = thumb != NULL;
+			if (thumb)
+				g_object_unref(thumb);
+			break;
+	}
+
+	g_free(uri);
+	g_free(smtime);
+	g_free(ssize);
+	g_free(path);
+	g_free(thumb_path);
+	return fresh;
+}
+
+/* As pixmap_try_thumb(), but only says whether there is a thumbnail. It
+ * is only decoded if it's already cached, or if it has to be.
+ */
+static gboolean have_thumb(const gchar *path, gboolean *forcheck)
+{
+	GdkPixbuf *image;
+	gboolean found;
+
+	if (o_purge_time.int_value > 0)
+	{
+		image = g_fscache_lookup_full(thumb_cache, path,
+				FSCACHE_LOOKUP_ONLY_NEW, &found);
+		if (image)
+		{
+			g_object_unref(image);
+			return TRUE;
+		}
+	}
+
+	if (thumb_is_fresh(path, *forcheck))
+		return TRUE;
+
+	/* No thumbnail now. This deals with the other cases */
+	image = pixmap_try_thumb(path, forcheck);
+	if (image)
+	{
+		g_object_unref(image);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 /* Load the image 'path' and return a pointer to the resulting
  * MaskedPixmap. NULL on failure.
  * Doesn't check for thumbnails (this is for small icons).
@@ -1042,6 +2075,118 @@ GdkPixbuf *scale_pixbuf(GdkPixbuf *src, int max_w, int max_h)
 	}
 }
 
+/* Return src at exactly width x height, for drawing. The copies are kept
+ * with src, so drawing it at the same size again is only a blit.
+ * If a good copy would take a while to make, a rough one is returned and
+ * the good one is made in scale_pool; 'window' (if not NULL) is redrawn
+ * when it's ready.
+ * g_object_unref() the result.
+ */
+GdkPixbuf *pixmap_scaled(GdkPixbuf *src, int width, int height,
+			 GdkWindow *window)
+{
+	ScaledSet *set;
+	ScaleJob *job;
+	GdkPixbuf *scaled;
+
+	set = get_scaled_set(src);
+
+	for (int i = 0; i < MAX_SCALED && set->scaled[i]; i++)
+	{
+		scaled = set->scaled[i];
+		if (gdk_pixbuf_get_width(scaled) == width &&
+		    gdk_pixbuf_get_height(scaled) == height)
+		{
+			g_object_ref(scaled);
+			add_scaled(src, scaled);	/* Move to front */
+			return scaled;
+		}
+	}
+
+	if (width * height <= SCALE_NOW_PIXELS &&
+	    gdk_pixbuf_get_width(src) * gdk_pixbuf_get_height(src)
+	    			<= SCALE_NOW_PIXELS * 4)
+	{
+		scaled = gdk_pixbuf_scale_simple(src, width, height,
+						 GDK_INTERP_BILINEAR);
+		if (scaled)
+			add_scaled(src, scaled);
+		return scaled;
+	}
+
+	/* One at a time for each pixbuf. If the size changes meanwhile
+	 * (resizing), the next redraw asks again.
+	 */
+	if (!set->pending_w)
+	{
+		set->pending_w = width;
+		set->pending_h = height;
+
+		job = g_new0(ScaleJob, 1);
+		job->src = g_object_ref(src);
+		job->width = width;
+		job->height = height;
+		job->window = window ? g_object_ref(window) : NULL;
+		g_thread_pool_push(scale_pool, job, NULL);
+	}
+
+	scaled = gdk_pixbuf_scale_simple(src, width, height,
+					 GDK_INTERP_NEAREST);
+	if (scaled)
+		g_object_set_qdata(G_OBJECT(scaled), rough_quark,
+				   GINT_TO_POINTER(TRUE));
+	return scaled;
+}
+
+/* Make pixbuf cr's source, at (x, y). The first time, a copy which cairo
+ * can draw directly (premultiplied, and on the X server if cr is drawing
+ * to a window) is made and kept with the pixbuf, for the kind of target cr
+ * has. Rough copies from pixmap_scaled() are drawn as they are.
+ */
+void pixmap_set_source(cairo_t *cr, GdkPixbuf *pixbuf, double x, double y)
+{
+	SurfaceCopy *copy, want;
+	cairo_t *scr;
+
+	if (g_object_get_qdata(G_OBJECT(pixbuf), rough_quark))
+	{
+		gdk_cairo_set_source_pixbuf(cr, pixbuf, x, y);
+		return;
+	}
+
+	target_of(cairo_get_target(cr), &want);
+
+	copy = g_object_get_qdata(G_OBJECT(pixbuf), surface_quark);
+	if (!copy || copy->type != want.type ||
+	    copy->screen != want.screen || copy->visual != want.visual)
+	{
+		if (!copy)
+			add_extra(pixbuf, surface_bytes(pixbuf));
+
+		copy = g_new(SurfaceCopy, 1);
+		*copy = want;
+		copy->surface = cairo_surface_create_similar(
+				cairo_get_target(cr),
+				gdk_pixbuf_get_has_alpha(pixbuf) ?
+				    CAIRO_CONTENT_COLOR_ALPHA :
+				    CAIRO_CONTENT_COLOR,
+				gdk_pixbuf_get_width(pixbuf),
+				gdk_pixbuf_get_height(pixbuf));
+
+		scr = cairo_create(copy->surface);
+		cairo_set_operator(scr, CAIRO_OPERATOR_SOURCE);
+		gdk_cairo_set_source_pixbuf(scr, pixbuf, 0, 0);
+		cairo_paint(scr);
+		cairo_destroy(scr);
+
+		/* Frees any copy for another target */
+		g_object_set_qdata_full(G_OBJECT(pixbuf), surface_quark,
+					copy, free_surface_copy);
+	}
+
+	cairo_set_source_surface(cr, copy->surface, x, y);
+}
+
 /* Return a pointer to the (static) bad image. The ref counter will ensure
  * that the image is never freed.
  */
@@ -1057,12 +2202,217 @@ static MaskedPixmap *get_bad_image(void)
 	return mp;
 }
 
+static ScaledSet *get_scaled_set(GdkPixbuf *src)
+{
+	ScaledSet *set;
+
+	set = g_object_get_qdata(G_OBJECT(src), scaled_quark);
+	if (!set)
+	{
+		set = g_new0(ScaledSet, 1);
+		g_object_set_qdata_full(G_OBJECT(src), scaled_quark,
+					set, free_scaled_set);
+	}
+
+	return set;
+}
+
+/* Put 'scaled' first in src's set, dropping the oldest copy if there's no
+ * room. Takes a ref. The copies are made to be drawn, so the surfaces
+ * they'll get are counted with them.
+ */
+static void add_scaled(GdkPixbuf *src, GdkPixbuf *scaled)
+{
+	ScaledSet *set = get_scaled_set(src);
+	int i;
+
+	g_object_ref(scaled);
+
+	for (i = 0; i < MAX_SCALED - 1; i++)
+		if (set->scaled[i] == scaled)
+			break;
+
+	if (set->scaled[i] != scaled)
+	{
+		add_extra(src, pixbuf_bytes(scaled) + surface_bytes(scaled));
+		if (set->scaled[i])
+			add_extra(src, -(gssize) (pixbuf_bytes(set->scaled[i]) +
+					surface_bytes(set->scaled[i])));
+	}
+
+	if (set->scaled[i])
+		g_object_unref(set->scaled[i]);
+
+	for (; i > 0; i--)
+		set->scaled[i] = set->scaled[i - 1];
+	set->scaled[0] = scaled;
+}
+
+static void free_scaled_set(gpointer data)
+{
+	ScaledSet *set = (ScaledSet *) data;
+
+	for (int i = 0; i < MAX_SCALED; i++)
+		if (set->scaled[i])
+			g_object_unref(set->scaled[i]);
+	g_free(set);
+}
+
+/* In scale_pool. Only reads the source pixels. */
+static void scale_worker(gpointer data, gpointer user_data)
+{
+	ScaleJob *job = (ScaleJob *) data;
+
+	job->scaled = gdk_pixbuf_scale_simple(job->src,
+			job->width, job->height, GDK_INTERP_BILINEAR);
+
+	g_idle_add(scale_done, job);
+}
+
+static gboolean scale_done(gpointer data)
+{
+	ScaleJob *job = (ScaleJob *) data;
+	ScaledSet *set;
+
+	set = get_scaled_set(job->src);
+	set->pending_w = set->pending_h = 0;
+
+	if (job->scaled)
+	{
+		add_scaled(job->src, job->scaled);
+		g_object_unref(job->scaled);
+	}
+
+	if (job->window)
+	{
+		/* Wherever it is now; we may have scrolled */
+		if (job->scaled && !gdk_window_is_destroyed(job->window))
+			gdk_window_invalidate_rect(job->window, NULL, FALSE);
+		g_object_unref(job->window);
+	}
+
+	g_object_unref(job->src);
+	g_free(job);
+
+	return FALSE;
+}
+
 /* Called now and then to clear out old pixmaps */
 static gint purge_pixmaps(gpointer data)
 {
+	GHashTableIter iter;
+	gpointer value;
+	time_t now;
+
 	g_fscache_purge(pixmap_cache, PIXMAP_PURGE_TIME);
+
+	now = time(NULL);
+	g_mutex_lock(&m_thumb_names);
+	g_hash_table_iter_init(&iter, thumb_names);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		if (now - ((ThumbNames *) value)->last_used > THUMB_NAMES_TIME)
+			g_hash_table_iter_remove(&iter);
+	g_mutex_unlock(&m_thumb_names);
+
 	return TRUE;
 }
+static gsize pixbuf_bytes(GdkPixbuf *pixbuf)
+{
+	return pixbuf ? gdk_pixbuf_get_rowstride(pixbuf) *
+			gdk_pixbuf_get_height(pixbuf) : 0;
+}
+
+/* About what pixmap_set_source() keeps for it */
+static gsize surface_bytes(GdkPixbuf *pixbuf)
+{
+	return (gsize) gdk_pixbuf_get_width(pixbuf) *
+		gdk_pixbuf_get_height(pixbuf) * 4;
+}
+
+/* What kind of target this is, for SurfaceCopy */
+static void target_of(cairo_surface_t *target, SurfaceCopy *copy)
+{
+	copy->type = cairo_surface_get_type(target);
+	copy->screen = cairo_surface_get_device(target);
+	copy->visual = NULL;
+
+#ifdef CAIRO_HAS_XLIB_SURFACE
+	if (copy->type == CAIRO_SURFACE_TYPE_XLIB)
+	{
+		copy->screen = cairo_xlib_surface_get_screen(target);
+		copy->visual = cairo_xlib_surface_get_visual(target);
+	}
+#endif
+}
+
+static void free_surface_copy(gpointer data)
+{
+	SurfaceCopy *copy = (SurfaceCopy *) data;
+
+	cairo_surface_destroy(copy->surface);
+	g_free(copy);
+}
+
+static gsize extra_bytes(GdkPixbuf *pixbuf)
+{
+	return pixbuf ? GPOINTER_TO_SIZE(g_object_get_qdata(G_OBJECT(pixbuf),
+						extra_quark)) : 0;
+}
+
+/* Change the bytes kept with pixbuf, and have the caches measure their
+ * objects again soon. Main thread only.
+ */
+static void add_extra(GdkPixbuf *pixbuf, gssize bytes)
+{
+	g_object_set_qdata(G_OBJECT(pixbuf), extra_quark,
+			GSIZE_TO_POINTER(extra_bytes(pixbuf) + bytes));
+
+	if (!remeasure_idle)
+		remeasure_idle = g_idle_add_full(G_PRIORITY_LOW,
+				remeasure_caches, NULL, NULL);
+}
+
+static gboolean remeasure_caches(gpointer data)
+{
+	remeasure_idle = 0;
+
+	g_fscache_remeasure(pixmap_cache);
+	g_fscache_remeasure(thumb_cache);
+
+	return FALSE;
+}
+
+/* pixmap_cache holds MaskedPixmaps */
+static gsize pixmap_bytes(gpointer object, gpointer data)
+{
+	MaskedPixmap *mp = (MaskedPixmap *) object;
+	gsize size = sizeof(MaskedPixmap) + pixbuf_bytes(mp->src_pixbuf) +
+			extra_bytes(mp->src_pixbuf);
+
+	if (mp->pixbuf != mp->src_pixbuf)
+		size += pixbuf_bytes(mp->pixbuf) + extra_bytes(mp->pixbuf);
+	if (mp->sm_pixbuf != mp->src_pixbuf && mp->sm_pixbuf != mp->pixbuf)
+		size += pixbuf_bytes(mp->sm_pixbuf) +
+			extra_bytes(mp->sm_pixbuf);
+
+	return size;
+}
+
+/* thumb_cache holds GdkPixbufs, with their scaled copies */
+static gsize thumb_bytes(gpointer object, gpointer data)
+{
+	return pixbuf_bytes((GdkPixbuf *) object) +
+		extra_bytes((GdkPixbuf *) object);
+}
+
+static void set_cache_budgets(void)
+{
+	gsize budget = (gsize) o_image_cache_size.int_value << 20;
+
+	g_fscache_set_budget(pixmap_cache, pixmap_bytes, budget);
+	g_fscache_set_budget(thumb_cache, thumb_bytes, budget);
+}
+
 static gint purge_thumbs(gpointer data)
 {
 	g_fscache_purge(thumb_cache, o_purge_time.int_value);
@@ -1222,6 +2572,7 @@ static void purge_disk_cache(GtkWidget *button, gpointer data)
 	struct dirent *ent;
 
 	g_fscache_purge(thumb_cache, 0);
+	thumbpack_forget(NULL);
 
 	path = g_strconcat(home_dir, "/.cache/thumbnails/", thumb_dir, "/", NULL);
 
@@ -1279,6 +2630,48 @@ static GList *thumbs_purge_cache(Option *option, xmlNode *node, guchar *label)
 	return g_list_append(NULL, align);
 }
 
+static void cache_stats_line(GString *text, const char *name,
+			     GFSCache *cache)
+{
+	guint hits, misses, evictions;
+	gsize bytes;
+
+	g_fscache_get_stats(cache, &hits, &misses, &evictions, &bytes);
+	g_string_append_printf(text,
+		_("%s: %u found, %u loaded, %u dropped, %" G_GSIZE_FORMAT " KB"),
+		name, hits, misses, evictions, bytes >> 10);
+}
+
+/* Show how well the caches are doing each time the page is shown, so the
+ * size can be tuned.
+ */
+static void update_cache_stats(GtkWidget *widget, gpointer data)
+{
+	GString *text;
+
+	text = g_string_new(NULL);
+	cache_stats_line(text, _("Icons"), pixmap_cache);
+	g_string_append_c(text, '\n');
+	cache_stats_line(text, _("Thumbnails"), thumb_cache);
+
+	gtk_label_set_text(GTK_LABEL(widget), text->str);
+	g_string_free(text, TRUE);
+}
+
+static GList *image_cache_stats(Option *option, xmlNode *node, guchar *label)
+{
+	GtkWidget *widget;
+
+	g_return_val_if_fail(option == NULL, NULL);
+
+	widget = gtk_label_new(NULL);
+	gtk_misc_set_alignment(GTK_MISC(widget), 0, 0.5);
+	gtk_label_set_justify(GTK_LABEL(widget), GTK_JUSTIFY_LEFT);
+	g_signal_connect(widget, "map", G_CALLBACK(update_cache_stats), NULL);
+
+	return g_list_append(NULL, widget);
+}
+
 /* Exif reading.
  * Based on Thierry Bousch's public domain exifdump.py.
  */
@@ -1295,7 +2688,7 @@ static inline long long s2n_motorola(const unsigned char *p, int len)
     int i;
 
     for(i=0; i<len; i++)
-        a=(a<<8) | (int)(p[i]);
+        a=(a<<8) | (long long)(p[i]);
 
     return a;
 }
@@ -1309,15 +2702,15 @@ static inline long long s2n_intel(const unsigned char *p, int len)
     int i;
 
     for(i=0; i<len; i++)
-        a=a | (((int) p[i]) << (i*8));
+        a=a | (((long long) p[i]) << (i*8));
 
     return a;
 }
 
 /*
- * Extract n-byte integer from data
+ * Extract n-byte (up to 4) unsigned integer from data
  */
-static int s2n(const unsigned char *dat, int off, int len, char format)
+static guint32 s2n(const unsigned char *dat, int off, int len, char format)
 {
     const unsigned char *p=dat+off;
 
@@ -1332,106 +2725,282 @@ static int s2n(const unsigned char *dat, int off, int len, char format)
     return 0;
 }
 
-/*
- * Load header of JPEG/Exif file and attempt to extract the embedded
- * thumbnail.  Return NULL on failure.
+/* Embedded previews.
+ *
+ * Camera JPEGs usually have a small JPEG thumbnail in their Exif data, and
+ * camera RAW files (which are TIFF-like: CR2, NEF, ARW, DNG, PEF, ORF,
+ * RW2...) have one or more JPEG previews. Decoding one of those is much
+ * quicker than decoding the image itself, and for RAW files it's the only
+ * way we can make a thumbnail at all.
  */
-static GdkPixbuf *extract_tiff_thumbnail(const gchar *path)
-{
-    FILE *in;
-    unsigned char header[256];
-    int i, n;
-    int length;
-    unsigned char *data;
-    char format;
-    int ifd, entries;
-    int thumb=0, tlength=0;
-    GdkPixbuf *buf=NULL;
-
-    in=fopen(path, "rb");
-    if(!in) {
-        return NULL;
-    }
 
-    /* Check for Exif format */
-    n=fread(header, 1, 12, in);
-    if(n!=12 || strncmp((char *) header, "\377\330\377\341", 4)!=0 ||
-       strncmp((char *)header+6, "Exif", 4)!=0) {
-        fclose(in);
-        return NULL;
-    }
+typedef struct _Preview Preview;
 
-    /* Read header */
-    length=header[4]*256+header[5];
-    data=g_new(unsigned char, length);
-    n=fread(data, 1, length, in);
-    fclose(in);   /* File no longer needed */
-    if(n!=length) {
-        g_free(data);
-        return NULL;
-    }
+struct _Preview {
+	long	offset, length;		/* Of the JPEG data in the file */
+	int	width, height;
+};
 
-    /* Big or little endian (as 'M' or 'I') */
-    format=data[0];
-
-    /* Skip over main section */
-    ifd=s2n(data, 4, 4, format);
-    entries=s2n(data, ifd, 2, format);
-
-    /* Second section contains data on thumbnail */
-    ifd=s2n(data, ifd+2+12*entries, 4, format);
-    entries=s2n(data, ifd, 2, format);
-
-    /* Loop over the entries */
-    for(i=0; i<entries; i++) {
-        int entry=ifd+2+12*i;
-        int tag=s2n(data, entry, 2, format);
-        int type=s2n(data, entry+2, 2, format);
-        int offset=entry+8;
-
-        if(type==4) {
-            int val=(int) s2n(data, offset, 4, format);
-
-            /* Only interested in two entries, the location of the thumbnail
-               and its size */
-            switch(tag) {
-            case JPEG_FORMAT: thumb=val; break;
-            case JPEG_FORMAT_LENGTH: tlength=val; break;
-            }
-        }
-    }
+/* Stop after looking at this many IFDs (the chain may have loops) */
+#define MAX_PREVIEW_IFDS 16
 
-    if(thumb && tlength) {
-        GError *err=NULL;
-        GdkPixbufLoader *loader;
-
-        /* Don't read outside the header (some files have incorrect data) */
-        if(thumb+tlength>length)
-            tlength=length-thumb;
-
-        loader=gdk_pixbuf_loader_new();
-        gdk_pixbuf_loader_write(loader, data+thumb, tlength, &err);
-        if(err) {
-            g_error_free(err);
-            return NULL;
-        }
-
-        gdk_pixbuf_loader_close(loader, &err);
-        if(err) {
-            g_error_free(err);
-            return NULL;
-        }
-
-        buf=gdk_pixbuf_loader_get_pixbuf(loader);
-        g_object_ref(buf);      /* Ref the image before we unref the loader */
-        g_object_unref(loader);
-    }
+/* Don't load previews bigger than this (bytes) */
+#define MAX_PREVIEW_SIZE (32 * 1024 * 1024)
+
+static gboolean read_at(FILE *in, long offset, void *buf, size_t len)
+{
+	return offset >= 0 && fseek(in, offset, SEEK_SET) == 0 &&
+		fread(buf, 1, len, in) == len;
+}
+
+/* Find the size of the (baseline or progressive) JPEG image at 'offset'
+ * from its SOF marker. FALSE if it isn't one we can decode.
+ */
+static gboolean jpeg_dimensions(FILE *in, long offset, long length,
+				int *width, int *height)
+{
+	unsigned char seg[9];
+	long pos = offset + 2;
+	int i;
+
+	if (!read_at(in, offset, seg, 2) || seg[0] != 0xff || seg[1] != 0xd8)
+		return FALSE;
+
+	for (i = 0; i < 64 && pos + 4 <= offset + length; i++)
+	{
+		if (!read_at(in, pos, seg, 4) || seg[0] != 0xff)
+			return FALSE;
 
-    g_free(data);
+		if (seg[1] == 0xc0 || seg[1] == 0xc1 || seg[1] == 0xc2)
+		{
+			if (!read_at(in, pos + 4, seg, 5))
+				return FALSE;
+			*height = (seg[1] << 8) | seg[2];
+			*width = (seg[3] << 8) | seg[4];
+			return *width > 0 && *height > 0;
+		}
+		if (seg[1] == 0xda || seg[1] == 0xd9)
+			return FALSE;	/* No SOF */
+		if ((seg[1] & 0xf0) == 0xc0 && seg[1] != 0xc4 &&
+		    seg[1] != 0xc8 && seg[1] != 0xcc)
+			return FALSE;	/* Lossless, arithmetic, etc */
+
+		pos += 2 + ((seg[2] << 8) | seg[3]);
+	}
 
-    return buf;
+	return FALSE;
 }
 
+/* Add the JPEG previews in the TIFF structure at 'base' to 'found' */
+static void tiff_previews(FILE *in, long base, GArray *found)
+{
+	unsigned char e[12];
+	long queue[MAX_PREVIEW_IFDS];
+	int n_queued = 0, i;
+	char format;
+	int magic;
+
+	if (!read_at(in, base, e, 8) || e[0] != e[1] ||
+	    (e[0] != 'I' && e[0] != 'M'))
+		return;
+	format = e[0];
+
+	/* 42 for TIFF; Olympus and Panasonic have their own */
+	magic = s2n(e, 2, 2, format);
+	if (magic != 42 && magic != 0x4f52 && magic != 0x5352 && magic != 0x55)
+		return;
+
+	queue[n_queued++] = s2n(e, 4, 4, format);
+
+	for (i = 0; i < n_queued; i++)
+	{
+		long ifd = queue[i];
+		long jif_off = 0, jif_len = 0, strip_off = 0, strip_len = 0;
+		int compression = 0, n_entries, j;
+
+		if (ifd <= 0 || !read_at(in, base + ifd, e, 2))
+			continue;
+		n_entries = s2n(e, 0, 2, format);
+		if (n_entries > 512)
+			continue;
+
+		for (j = 0; j < n_entries; j++)
+		{
+			int tag, type;
+			guint32 count, value;	/* Any 32 bits the file likes */
+
+			if (!read_at(in, base + ifd + 2 + 12 * j, e, 12))
+				break;
+			tag = s2n(e, 0, 2, format);
+			type = s2n(e, 2, 2, format);
+			count = s2n(e, 4, 4, format);
+			value = type == 3 ? s2n(e, 8, 2, format)
+					  : s2n(e, 8, 4, format);
+
+			switch (tag)
+			{
+				case 0x103:	/* Compression */
+					compression = value;
+					break;
+				case 0x111:	/* StripOffsets */
+					if (count == 1)
+						strip_off = value;
+					break;
+				case 0x117:	/* StripByteCounts */
+					if (count == 1)
+						strip_len = value;
+					break;
+				case JPEG_FORMAT:
+					jif_off = value;
+					break;
+				case JPEG_FORMAT_LENGTH:
+					jif_len = value;
+					break;
+				case 0x14a:	/* SubIFDs */
+				{
+					unsigned char sub[4 * 8];
+					guint32 k;
+
+					if (count == 1)
+					{
+						if (n_queued < MAX_PREVIEW_IFDS)
+							queue[n_queued++] = value;
+						break;
+					}
+					if (count > 8 || !read_at(in,
+						base + value, sub, 4 * count))
+						break;
+					for (k = 0; k < count &&
+					     n_queued < MAX_PREVIEW_IFDS; k++)
+						queue[n_queued++] =
+							s2n(sub, 4 * k, 4, format);
+					break;
+				}
+			}
+		}
+
+		/* The next IFD in the chain */
+		if (j == n_entries && n_queued < MAX_PREVIEW_IFDS &&
+		    read_at(in, base + ifd + 2 + 12 * n_entries, e, 4))
+			queue[n_queued++] = s2n(e, 0, 4, format);
+
+		if (compression != 6 && compression != 7)
+			strip_off = strip_len = 0;
+
+		for (j = 0; j < 2; j++)
+		{
+			Preview p;
+
+			p.offset = base + (j ? strip_off : jif_off);
+			p.length = j ? strip_len : jif_len;
+
+			if (p.offset > base && p.length > 0 &&
+			    p.length <= MAX_PREVIEW_SIZE &&
+			    jpeg_dimensions(in, p.offset, p.length,
+					    &p.width, &p.height))
+				g_array_append_val(found, p);
+		}
+	}
+}
+
+/* Where the Exif data's TIFF header starts in a JPEG file, or -1 */
+static long exif_base(FILE *in)
+{
+	unsigned char seg[10];
+	long pos = 2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+	{
+		int len;
+
+		if (!read_at(in, pos, seg, 10) || seg[0] != 0xff)
+			return -1;
+		len = (seg[2] << 8) | seg[3];
+
+		if (seg[1] == 0xe1 && memcmp(seg + 4, "Exif\0\0", 6) == 0)
+			return pos + 10;
+		if (seg[1] == 0xda || seg[1] == 0xd9)
+			return -1;	/* Image data; no more headers */
+
+		pos += 2 + len;
+	}
+
+	return -1;
+}
+
+/* Decode the best embedded preview in this JPEG or TIFF-based RAW file,
+ * scaled to thumb_size: the smallest that is still big enough. If none is
+ * big enough, a JPEG is better decoded itself; for other files, use the
+ * largest. NULL if there's nothing suitable.
+ */
+static GdkPixbuf *embedded_preview(const gchar *path)
+{
+	unsigned char head[4];
+	GArray *found;
+	Preview *best = NULL, *largest = NULL;
+	GdkPixbuf *image = NULL;
+	gboolean is_jpeg;
+	FILE *in;
+	int i;
+
+	in = fopen(path, "rb");
+	if (!in)
+		return NULL;
+
+	if (!read_at(in, 0, head, 4))
+	{
+		fclose(in);
+		return NULL;
+	}
+
+	found = g_array_new(FALSE, FALSE, sizeof(Preview));
+
+	is_jpeg = head[0] == 0xff && head[1] == 0xd8;
+	if (is_jpeg)
+	{
+		long base = exif_base(in);
+		if (base != -1)
+			tiff_previews(in, base, found);
+	}
+	else
+		tiff_previews(in, 0, found);
+
+	for (i = 0; i < found->len; i++)
+	{
+		Preview *p = &g_array_index(found, Preview, i);
+		int size = MAX(p->width, p->height);
+
+		if (size >= thumb_size &&
+		    (!best || size < MAX(best->width, best->height)))
+			best = p;
+		if (!largest || size > MAX(largest->width, largest->height))
+			largest = p;
+	}
+	if (!best && !is_jpeg)
+		best = largest;
+
+	if (best)
+	{
+		guchar *data = g_malloc(best->length);
+
+		if (read_at(in, best->offset, data, best->length))
+		{
+			/* Don't scale small ones up */
+			int size = MAX(best->width, best->height);
+			int scale = MIN(size, thumb_size);
+
+			image = rox_pixbuf_new_from_data_at_scale(data,
+					best->length, scale, scale, TRUE, NULL);
+		}
+		g_free(data);
+	}
+
+	g_array_free(found, TRUE);
+	fclose(in);
+
+	return image;
+}
 
 static cairo_status_t suf_to_bufcb(void *p,
 		const unsigned char *data, unsigned int len)
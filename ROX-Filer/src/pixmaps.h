@@ -76,9 +76,14 @@ void pixmap_background_thumb(const gchar *path, gboolean noorder, GFunc callback
 GdkPixbuf *pixmap_try_thumb(const gchar *path, gboolean *forcheck);
 MaskedPixmap *masked_pixmap_new(GdkPixbuf *full_size);
 GdkPixbuf *scale_pixbuf(GdkPixbuf *src, int max_w, int max_h);
+GdkPixbuf *pixmap_scaled(GdkPixbuf *src, int width, int height,
+			 GdkWindow *window);
+void pixmap_set_source(cairo_t *cr, GdkPixbuf *pixbuf, double x, double y);
 gint pixmap_check_thumb(const gchar *path);
 GdkPixbuf *pixmap_load_thumb(const gchar *path);
 char *pixmap_make_thumb_path(const char *path);
+void pixmap_unlink_thumb(const char *path);
+void pixmap_forget_thumb_name(const char *dir, const char *leaf);
 GdkPixbuf *pixmap_make_lined(GdkPixbuf *src, GdkColor *colour);
 MaskedPixmap *pixmap_from_desktop_file(const char *path);
 
@@ -337,6 +337,42 @@ const char *format_size_aligned(off_t size)
 	return buffer;
 }
 
+/* As format_size() (or format_size_aligned(), if 'aligned'), but for a
+ * count of entries. If 'approx', counting stopped early and the '+' goes
+ * in the gap before the units (or in place of them), so that the string is
+ * the same width as an exact count's.
+ */
+const char *format_count(off_t count, gboolean approx, gboolean aligned)
+{
+	static	char *buffer = NULL;
+	int	len;
+
+	g_free(buffer);
+	buffer = g_strdup(aligned ? format_size_aligned(count)
+				  : format_size(count));
+	if (!approx)
+		return buffer;
+
+	len = strlen(buffer);
+	if (!aligned)
+		buffer[len - 2] = '+';		/* '1000+ ', '98+K' */
+	else if (buffer[len - 1] == ' ')
+		buffer[len - 1] = '+';		/* '1000+' */
+	else if (buffer[0] == ' ')
+	{
+		memmove(buffer, buffer + 1, len - 2);
+		buffer[len - 2] = '+';		/* ' 98+K' */
+	}
+	else
+	{
+		gchar *tmp = buffer;		/* No room; '1023K+' */
+		buffer = g_strconcat(tmp, "+", NULL);
+		g_free(tmp);
+	}
+
+	return buffer;
+}
+
 /*
  * Similar to format_size(), but this one uses a double argument since
  * unsigned long isn't wide enough on all platforms and we must be able to
@@ -949,6 +985,7 @@ static void MD5Update(MD5Context *ctx, md5byte const *buf, unsigned len)
  */
 static char *MD5Final(MD5Context *ctx)
 {
+	static const char hex[] = "0123456789abcdef";
 	char *retval;
 	int i;
 	int count = ctx->bytes[0] & 0x3f;	/* Number of bytes in ctx->in */
@@ -981,7 +1018,10 @@ static char *MD5Final(MD5Context *ctx)
 	retval = g_malloc(33);
 	bytes = (guint8 *) ctx->buf;
 	for (i = 0; i < 16; i++)
-		sprintf(retval + (i * 2), "%02x", bytes[i]);
+	{
+		retval[i * 2] = hex[bytes[i] >> 4];
+		retval[i * 2 + 1] = hex[bytes[i] & 0xf];
+	}
 	retval[32] = '\0';
 
 	return retval;
@@ -24,6 +24,7 @@ const char *user_name(uid_t uid);
 const char *group_name(gid_t gid);
 const char *format_size(off_t size);
 const char *format_size_aligned(off_t size);
+const char *format_count(off_t count, gboolean approx, gboolean aligned);
 const gchar *format_double_size(double size);
 char *fork_exec_wait(const char **argv);
 const char *pretty_permissions(mode_t m);
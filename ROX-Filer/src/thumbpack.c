@@ -0,0 +1,665 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * Copyright (C) 2006, Thomas Leonard and others (see changelog for details).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* thumbpack.c - small thumbnails of a whole directory in one file
+ *
+ * The small-icon and details views only need each thumbnail at the size of
+ * a small icon, but loading it from the freedesktop cache means opening,
+ * checking and decoding a PNG for every visible file. So, once a thumbnail
+ * has been loaded at that size, the scaled copy is also kept in a pack for
+ * its directory, in ~/.cache/rox.sourceforge.net/ROX-Filer/thumbs, named
+ * after the directory's device and inode. The freedesktop cache is still
+ * where thumbnails are made and kept; the pack is only a copy.
+ *
+ * The file is a PackHeader followed by records, each a PackEntry and then its
+ * RGBA pixels. A record is for the file with that inode, and is only used
+ * while the file's mtime and size still match. New records are appended, so a
+ * later record replaces an earlier one for the same inode; when most are out
+ * of date the file is written again with just the current ones, leaving out
+ * any for files which have gone or changed. It's in native byte order and the
+ * pixels are drawn straight from the g_mapped_file.
+ */
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "global.h"
+
+#include "dir.h"
+#include "diritem.h"
+#include "fscache.h"
+#include "options.h"
+#include "pixmaps.h"
+#include "support.h"
+#include "thumbpack.h"
+
+#define PACK_MAGIC "ROXTPK1"
+
+/* New tiles are written this long after the first one is made (seconds) */
+#define PACK_FLUSH_TIME 2
+
+/* Packs not used for this long are closed (seconds) */
+#define PACK_PURGE_TIME 60
+
+/* Don't add to packs bigger than this */
+#define PACK_MAX_BYTES (64 * 1024 * 1024)
+
+typedef struct _PackHeader PackHeader;
+typedef struct _PackEntry PackEntry;
+typedef struct _NewTile NewTile;
+typedef struct _ThumbPack ThumbPack;
+
+struct _PackHeader {
+	char	magic[8];
+	gint64	dev, ino;		/* Of the directory */
+	guint32	tile_w, tile_h;		/* Every tile fits in this */
+};
+
+/* Followed by width * height RGBA pixels, padded to 8 bytes */
+struct _PackEntry {
+	gint64	ino, mtime, size;	/* Of the file */
+	guint16	width, height;
+	guint32	pad;
+};
+
+struct _NewTile {
+	PackEntry	entry;
+	GdkPixbuf	*tile;
+};
+
+struct _ThumbPack {
+	gchar		*path;		/* Of the pack file */
+	gchar		*dir;		/* The directory it's for */
+	gint64		dev, ino;	/* Of the directory */
+	int		tile_w, tile_h;	/* When loaded */
+	gboolean	loaded;
+	GMappedFile	*map;		/* NULL => no (usable) file yet */
+	GHashTable	*tiles;		/* Inode -> PackEntry in map */
+	guint		n_records;	/* In map, including replaced ones */
+	gboolean	rewrite;	/* Don't append to the file */
+	GHashTable	*added;		/* Inode -> NewTile, not yet written */
+	guint		flush;		/* Timeout to write 'added' */
+	time_t		last_used;
+};
+
+/* Keep small thumbnails in packs */
+static Option o_thumb_packs;
+
+static GHashTable *packs = NULL;	/* Directory path -> ThumbPack */
+
+/* Static prototypes */
+static ThumbPack *get_pack(const gchar *dir);
+static void load_pack(ThumbPack *pack);
+static void close_pack(ThumbPack *pack);
+static void discard_pack(ThumbPack *pack);
+/* Drop the tiles, written or not, and delete the file */
+static void discard_pack(ThumbPack *pack)
+{
+	if (pack->flush)
+	{
+		g_source_remove(pack->flush);
+		pack->flush = 0;
+	}
+
+	g_hash_table_remove_all(pack->added);
+	close_pack(pack);
+	unlink(pack->path);
+}
+
+static void free_pack(gpointer data);
+static GdkPixbuf *find_tile(ThumbPack *pack, DirItem *item);
+static GdkPixbuf *make_tile(GdkPixbuf *thumb);
+static void add_tile(ThumbPack *pack, DirItem *item, GdkPixbuf *tile);
+static gboolean flush_timeout(gpointer data);
+static void flush_pack(ThumbPack *pack);
+static void drop_stale(ThumbPack *pack);
+static void add_record(GByteArray *file, const PackEntry *entry,
+		       const guchar *pixels, int rowstride);
+static void free_new_tile(gpointer data);
+static void unref_map(guchar *pixels, gpointer data);
+static gboolean purge_packs(gpointer data);
+static gchar *pack_path(struct stat *info);
+
+/****************************************************************
+ *			EXTERNAL INTERFACE			*
+ ****************************************************************/
+
+void thumbpack_init(void)
+{
+	option_add_int(&o_thumb_packs, "thumb_packs", FALSE);
+
+	packs = g_hash_table_new_full(g_str_hash, g_str_equal,
+				      g_free, free_pack);
+
+	g_timeout_add_seconds(PACK_PURGE_TIME / 2, purge_packs, NULL);
+}
+
+/* As pixmap_load_thumb(), but scaled to fit a small icon and, if the
+ * option is on, from (or added to) the pack for 'dir'.
+ * g_object_unref() the result.
+ */
+GdkPixbuf *thumbpack_load(const gchar *dir, DirItem *item)
+{
+	ThumbPack *pack = NULL;
+	GdkPixbuf *thumb, *tile;
+	gchar *path;
+
+	/* A symlink's details are for the link, not the file shown */
+	if (o_thumb_packs.int_value && item->ino && small_width &&
+	    !(item->flags & ITEM_FLAG_SYMLINK))
+		pack = get_pack(dir);
+
+	if (pack)
+	{
+		tile = find_tile(pack, item);
+		if (tile)
+			return tile;
+	}
+
+	path = pathdup(make_path(dir, item->leafname));
+	thumb = pixmap_load_thumb(path);
+	g_free(path);
+	if (!thumb || !pack)
+		return thumb;
+
+	tile = make_tile(thumb);
+	g_object_unref(thumb);
+	add_tile(pack, item, tile);
+
+	return tile;
+}
+
+/* Forget the pack for 'dir', and delete its file, so that the thumbnails
+ * are loaded from the freedesktop cache again. NULL for every pack,
+ * including ones from earlier sessions.
+ */
+void thumbpack_forget(const gchar *dir)
+{
+	ThumbPack *pack;
+
+	if (!dir)
+	{
+		GHashTableIter iter;
+		gpointer value;
+		gchar *packdir;
+		GDir *d;
+
+		g_hash_table_iter_init(&iter, packs);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+		{
+			discard_pack((ThumbPack *) value);
+			g_hash_table_iter_remove(&iter);
+		}
+
+		packdir = g_build_filename(g_get_user_cache_dir(), SITE,
+					   PROJECT, "thumbs", NULL);
+		d = g_dir_open(packdir, 0, NULL);
+		if (d)
+		{
+			const gchar *leaf;
+
+			while ((leaf = g_dir_read_name(d)))
+				unlink(make_path(packdir, leaf));
+			g_dir_close(d);
+		}
+		g_free(packdir);
+		return;
+	}
+
+	pack = g_hash_table_lookup(packs, dir);
+	if (pack)
+	{
+		discard_pack(pack);
+		g_hash_table_remove(packs, dir);
+	}
+	else
+	{
+		struct stat info;
+		gchar *path;
+
+		if (mc_stat(dir, &info))
+			return;
+		path = pack_path(&info);
+		unlink(path);
+		g_free(path);
+	}
+}
+
+/****************************************************************
+ *			INTERNAL FUNCTIONS			*
+ ****************************************************************/
+
+static gsize tile_bytes(int width, int height)
+{
+	return ((gsize) width * height * 4 + 7) & ~(gsize) 7;
+}
+
+/* NULL if the directory can't be found */
+static ThumbPack *get_pack(const gchar *dir)
+{
+	ThumbPack *pack;
+
+	pack = g_hash_table_lookup(packs, dir);
+	if (!pack)
+	{
+		struct stat info;
+
+		if (mc_stat(dir, &info))
+			return NULL;
+
+		pack = g_new0(ThumbPack, 1);
+		pack->path = pack_path(&info);
+		pack->dir = g_strdup(dir);
+		pack->dev = info.st_dev;
+		pack->ino = info.st_ino;
+		pack->tiles = g_hash_table_new(g_int64_hash, g_int64_equal);
+		pack->added = g_hash_table_new_full(g_int64_hash,
+				g_int64_equal, NULL, free_new_tile);
+		g_hash_table_insert(packs, g_strdup(dir), pack);
+	}
+
+	/* The font (and so the size of small icons) changed? */
+	if (pack->loaded &&
+	    (pack->tile_w != small_width || pack->tile_h != small_height))
+	{
+		g_hash_table_remove_all(pack->added);
+		close_pack(pack);
+		pack->rewrite = TRUE;
+	}
+
+	if (!pack->loaded)
+		load_pack(pack);
+
+	pack->last_used = time(NULL);
+
+	return pack;
+}
+
+/* Map the pack file and index its records */
+static void load_pack(ThumbPack *pack)
+{
+	const PackHeader *head;
+	const char *data;
+	gsize len, offset;
+
+	pack->loaded = TRUE;
+	pack->tile_w = small_width;
+	pack->tile_h = small_height;
+
+	pack->map = g_mapped_file_new(pack->path, FALSE, NULL);
+	if (!pack->map)
+		return;
+
+	data = g_mapped_file_get_contents(pack->map);
+	len = g_mapped_file_get_length(pack->map);
+	head = (const PackHeader *) data;
+
+	if (len < sizeof(PackHeader) ||
+	    memcmp(head->magic, PACK_MAGIC, sizeof(head->magic)) != 0 ||
+	    head->dev != pack->dev || head->ino != pack->ino ||
+	    head->tile_w != pack->tile_w || head->tile_h != pack->tile_h)
+	{
+		g_mapped_file_unref(pack->map);
+		pack->map = NULL;
+		pack->rewrite = TRUE;
+		return;
+	}
+
+	offset = sizeof(PackHeader);
+	while (offset + sizeof(PackEntry) <= len)
+	{
+		const PackEntry *entry = (const PackEntry *) (data + offset);
+		gsize bytes = tile_bytes(entry->width, entry->height);
+
+		if (entry->width == 0 || entry->height == 0 ||
+		    entry->width > pack->tile_w ||
+		    entry->height > pack->tile_h ||
+		    bytes > len - offset - sizeof(PackEntry))
+			break;
+
+		g_hash_table_replace(pack->tiles, (gpointer) &entry->ino,
+				     (gpointer) entry);
+		pack->n_records++;
+		offset += sizeof(PackEntry) + bytes;
+	}
+
+	/* Cut short (a crash while appending?). Anything added after the
+	 * bad record would be lost.
+	 */
+	if (offset != len)
+		pack->rewrite = TRUE;
+}
+
+/* Forget the file's contents (tiles in use keep the mapping) */
+static void close_pack(ThumbPack *pack)
+{
+	g_hash_table_remove_all(pack->tiles);
+	pack->n_records = 0;
+
+	if (pack->map)
+	{
+		g_mapped_file_unref(pack->map);
+		pack->map = NULL;
+	}
+
+	pack->loaded = FALSE;
+}
+
+static void free_pack(gpointer data)
+{
+	ThumbPack *pack = (ThumbPack *) data;
+
+	flush_pack(pack);
+	close_pack(pack);
+
+	g_hash_table_destroy(pack->tiles);
+	g_hash_table_destroy(pack->added);
+	g_free(pack->path);
+	g_free(pack->dir);
+	g_free(pack);
+}
+
+static gboolean entry_matches(const PackEntry *entry, DirItem *item)
+{
+	return entry->mtime == (gint64) item->mtime &&
+		entry->size == (gint64) item->size;
+}
+
+/* The pack's tile for this item, if it's up-to-date */
+static GdkPixbuf *find_tile(ThumbPack *pack, DirItem *item)
+{
+	const PackEntry *entry;
+	NewTile *new;
+	gint64 ino = item->ino;
+
+	new = g_hash_table_lookup(pack->added, &ino);
+	if (new && entry_matches(&new->entry, item))
+		return g_object_ref(new->tile);
+
+	entry = g_hash_table_lookup(pack->tiles, &ino);
+	if (!entry || !entry_matches(entry, item))
+		return NULL;
+
+	return gdk_pixbuf_new_from_data((const guchar *) (entry + 1),
+			GDK_COLORSPACE_RGB, TRUE, 8,
+			entry->width, entry->height, entry->width * 4,
+			unref_map, g_mapped_file_ref(pack->map));
+}
+
+/* Scale the thumbnail to fit a small icon, with an alpha channel */
+static GdkPixbuf *make_tile(GdkPixbuf *thumb)
+{
+	GdkPixbuf *tile;
+
+	tile = scale_pixbuf(thumb, small_width, small_height);
+
+	if (!gdk_pixbuf_get_has_alpha(tile))
+	{
+		GdkPixbuf *rgba;
+
+		rgba = gdk_pixbuf_add_alpha(tile, FALSE, 0, 0, 0);
+		g_object_unref(tile);
+		tile = rgba;
+	}
+
+	return tile;
+}
+
+/* Remember the tile, to be written to the pack soon */
+static void add_tile(ThumbPack *pack, DirItem *item, GdkPixbuf *tile)
+{
+	NewTile *new;
+
+	if (pack->map && !pack->rewrite &&
+	    g_mapped_file_get_length(pack->map) >= PACK_MAX_BYTES)
+		return;
+
+	new = g_new0(NewTile, 1);
+	new->entry.ino = item->ino;
+	new->entry.mtime = item->mtime;
+	new->entry.size = item->size;
+	new->entry.width = gdk_pixbuf_get_width(tile);
+	new->entry.height = gdk_pixbuf_get_height(tile);
+	new->tile = g_object_ref(tile);
+
+	g_hash_table_replace(pack->added, &new->entry.ino, new);
+
+	if (!pack->flush)
+		pack->flush = g_timeout_add_seconds(PACK_FLUSH_TIME,
+						    flush_timeout, pack);
+}
+
+static gboolean flush_timeout(gpointer data)
+{
+	ThumbPack *pack = (ThumbPack *) data;
+
+	pack->flush = 0;
+	flush_pack(pack);
+
+	return FALSE;
+}
+
+/* Write the new tiles to the pack file. Appends them, unless the file is
+ * missing, bad, or mostly out-of-date records. It's loaded again when
+ * next needed.
+ */
+static void flush_pack(ThumbPack *pack)
+{
+	GHashTableIter iter;
+	GByteArray *file;
+	gpointer value;
+	gboolean rewrite;
+	int live;
+
+	if (pack->flush)
+	{
+		g_source_remove(pack->flush);
+		pack->flush = 0;
+	}
+
+	if (g_hash_table_size(pack->added) == 0)
+		return;
+
+	live = g_hash_table_size(pack->tiles);
+	rewrite = pack->rewrite || !pack->map ||
+		  pack->n_records > 2 * live + 100;
+
+	file = g_byte_array_new();
+
+	if (rewrite)
+	{
+		PackHeader head = {PACK_MAGIC};
+
+		head.dev = pack->dev;
+		head.ino = pack->ino;
+		head.tile_w = pack->tile_w;
+		head.tile_h = pack->tile_h;
+		g_byte_array_append(file, (guint8 *) &head, sizeof(head));
+
+		/* Keep the current records which aren't being replaced */
+		drop_stale(pack);
+		g_hash_table_iter_init(&iter, pack->tiles);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+		{
+			const PackEntry *entry = (const PackEntry *) value;
+
+			if (!g_hash_table_lookup(pack->added, &entry->ino))
+				add_record(file, entry,
+					   (const guchar *) (entry + 1),
+					   entry->width * 4);
+		}
+	}
+
+	g_hash_table_iter_init(&iter, pack->added);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		NewTile *new = (NewTile *) value;
+
+		add_record(file, &new->entry,
+			   gdk_pixbuf_get_pixels(new->tile),
+			   gdk_pixbuf_get_rowstride(new->tile));
+	}
+
+	if (rewrite)
+	{
+		gchar *packdir;
+
+		packdir = g_path_get_dirname(pack->path);
+		if (g_mkdir_with_parents(packdir, 0700) == 0 &&
+		    g_file_set_contents(pack->path, (gchar *) file->data,
+					file->len, NULL))
+			pack->rewrite = FALSE;
+		g_free(packdir);
+	}
+	else
+	{
+		int fd;
+
+		fd = open(pack->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+		if (fd == -1 || write(fd, file->data, file->len) != (gssize) file->len)
+			pack->rewrite = TRUE;	/* Start again next time */
+		if (fd != -1)
+			close(fd);
+	}
+
+	g_byte_array_free(file, TRUE);
+
+	g_hash_table_remove_all(pack->added);
+	close_pack(pack);
+}
+
+/* Forget the records for files which are no longer in the directory, or
+ * which have changed since, so that a rewrite doesn't keep them. This
+ * goes by what the directory's listing says, so it doesn't touch the
+ * disk; if the directory isn't loaded, or hasn't been scanned yet, all
+ * the records are kept.
+ */
+static void drop_stale(ThumbPack *pack)
+{
+	GHashTable *current;	/* Inode -> PackEntry, still up-to-date */
+	GHashTableIter iter;
+	gpointer value;
+	Directory *dir;
+
+	if (g_hash_table_size(pack->tiles) == 0)
+		return;
+
+	dir = g_fscache_lookup_full(dir_cache, pack->dir,
+				    FSCACHE_LOOKUP_PEEK, NULL);
+	if (!dir)
+		return;
+
+	if (!dir->have_scanned)
+	{
+		g_object_unref(dir);
+		return;
+	}
+
+	current = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+	g_mutex_lock(&dir->mutex);
+	g_hash_table_iter_init(&iter, dir->known_items);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		DirItem *item = (DirItem *) value;
+		const PackEntry *entry;
+		gint64 ino = item->ino;
+
+		entry = g_hash_table_lookup(pack->tiles, &ino);
+		if (entry && entry_matches(entry, item))
+			g_hash_table_insert(current, (gpointer) &entry->ino,
+					    (gpointer) entry);
+	}
+	g_mutex_unlock(&dir->mutex);
+
+	g_object_unref(dir);
+
+	g_hash_table_destroy(pack->tiles);
+	pack->tiles = current;
+}
+
+static void add_record(GByteArray *file, const PackEntry *entry,
+		       const guchar *pixels, int rowstride)
+{
+	static const guint8 zeros[8] = {0};
+	gsize row = entry->width * 4;
+	PackEntry copy = *entry;
+
+	copy.pad = 0;
+	g_byte_array_append(file, (guint8 *) &copy, sizeof(copy));
+
+	for (int y = 0; y < entry->height; y++)
+		g_byte_array_append(file, pixels + y * rowstride, row);
+
+	g_byte_array_append(file, zeros,
+		tile_bytes(entry->width, entry->height) - row * entry->height);
+}
+
+static void free_new_tile(gpointer data)
+{
+	NewTile *new = (NewTile *) data;
+
+	g_object_unref(new->tile);
+	g_free(new);
+}
+
+/* Destroy function for the pixbufs made by find_tile() */
+static void unref_map(guchar *pixels, gpointer data)
+{
+	g_mapped_file_unref((GMappedFile *) data);
+}
+
+static gboolean purge_packs(gpointer data)
+{
+	GHashTableIter iter;
+	gpointer value;
+	time_t now;
+
+	now = time(NULL);
+
+	g_hash_table_iter_init(&iter, packs);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+	{
+		ThumbPack *pack = (ThumbPack *) value;
+
+		if (now - pack->last_used > PACK_PURGE_TIME)
+			g_hash_table_iter_remove(&iter);
+	}
+
+	return TRUE;
+}
+
+/* g_free() the result */
+static gchar *pack_path(struct stat *info)
+{
+	gchar *leaf, *path;
+
+	leaf = g_strdup_printf("%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x",
+			(gint64) info->st_dev, (gint64) info->st_ino);
+	path = g_build_filename(g_get_user_cache_dir(), SITE, PROJECT,
+				"thumbs", leaf, NULL);
+	g_free(leaf);
+
+	return path;
+}
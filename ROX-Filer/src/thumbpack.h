@@ -0,0 +1,13 @@
+/*
+ * ROX-Filer, filer for the ROX desktop project
+ * By Thomas Leonard, <tal197@users.sourceforge.net>.
+ */
+
+#ifndef _THUMBPACK_H
+#define _THUMBPACK_H
+
+void thumbpack_init(void);
+GdkPixbuf *thumbpack_load(const gchar *dir, DirItem *item);
+void thumbpack_forget(const gchar *dir);
+
+#endif /* _THUMBPACK_H */
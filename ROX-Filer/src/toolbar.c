@@ -291,7 +291,7 @@ void toolbar_update_info(FilerWindow *filer_window)
 		while ((item = iter.next(&iter)))
 		{
 			if (item->base_type != TYPE_DIRECTORY &&
-			    item->base_type != TYPE_UNKNOWN)
+			    !ITEM_UNSCANNED(item))
 				size += (double) item->size;
 		}
 
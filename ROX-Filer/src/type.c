@@ -63,6 +63,9 @@
 #include "view_iface.h"
 
 #define TYPE_NS "http://www.freedesktop.org/standards/shared-mime-info"
+
+/* Don't stat() theme icon files more often than this (in seconds) */
+#define ICON_TRUST_TIME (10 * 60)
 enum {SET_MEDIA, SET_TYPE};
 
 /* Colours for file types (same order as base types) */
@@ -332,6 +335,23 @@ MIME_type *type_from_path(const char *path)
 	return NULL;
 }
 
+/* Guess the type from the name alone, using only the glob rules (no
+ * xattr or contents checks, so no I/O). NULL if no rule matches.
+ */
+MIME_type *type_guess_from_name(const char *leaf)
+{
+	const char *type_name;
+
+	g_mutex_lock(&m_xdg);
+	type_name = xdg_mime_get_mime_type_from_file_name(leaf);
+	g_mutex_unlock(&m_xdg);
+
+	if (!type_name || type_name == XDG_MIME_TYPE_UNKNOWN)
+		return NULL;
+
+	return get_mime_type(type_name, TRUE);
+}
+
 /* Returns the file/dir in Choices for handling this type.
  * NULL if there isn't one. g_free() the result.
  */
@@ -510,7 +530,8 @@ again:
 	g_free(type_name);
 	if (path)
 	{
-		type->image = g_fscache_lookup(pixmap_cache, path);
+		type->image = g_fscache_lookup_trusted(pixmap_cache, path,
+						       ICON_TRUST_TIME);
 		g_free(path);
 	}
 
@@ -542,7 +563,8 @@ again:
 		 */
 		icon_path = gtk_icon_info_get_filename(full);
 		if (icon_path != NULL)
-			type->image = g_fscache_lookup(pixmap_cache, icon_path);
+			type->image = g_fscache_lookup_trusted(pixmap_cache,
+						icon_path, ICON_TRUST_TIME);
 		/* else shouldn't happen, because we didn't use
 		 * GTK_ICON_LOOKUP_USE_BUILTIN.
 		 */
@@ -40,6 +40,7 @@ const char *basetype_name(DirItem *item);
 MIME_type *type_get_type(const guchar *path);
 
 MIME_type *type_from_path(const char *path);
+MIME_type *type_guess_from_name(const char *leaf);
 MaskedPixmap *type_to_icon(MIME_type *type);
 GdkAtom type_to_atom(MIME_type *type);
 MIME_type *mime_type_from_base_type(int base_type);
@@ -47,9 +47,13 @@
 #include "display.h"
 #include "usericons.h"
 #include "fscache.h"
+#include "thumbpack.h"
 
 #define MIN_ITEM_WIDTH 64
 
+/* How long next_thumb() may spend loading thumbnails (us) */
+#define THUMB_SLICE (8 * 1000)
+
 static gpointer parent_class = NULL;
 
 struct _ViewCollectionClass {
@@ -539,11 +543,34 @@ static void draw_cursor(GtkWidget *widget,
 	cairo_destroy(cr);
 }
 
+/* Small icons only need a small copy of the thumbnail */
+static GdkPixbuf *load_thumb(FilerWindow *fw, DirItem *item)
+{
+	GdkPixbuf *thumb;
+	gchar *path;
+
+	if (fw->display_style == SMALL_ICONS)
+		return thumbpack_load(fw->real_path, item);
+
+	path = pathdup(make_path(fw->real_path, item->leafname));
+	thumb = pixmap_load_thumb(path);
+	g_free(path);
+
+	return thumb;
+}
+
+/* Load the thumbnails of the items drawn since the last call, in the order
+ * they were drawn, until THUMB_SLICE has passed. Items which have scrolled
+ * off the screen are dropped; they are queued again if they are redrawn.
+ */
 static gboolean next_thumb(ViewCollection *vc)
 {
-	int i;
+	gint64 start = g_get_monotonic_time();
+	int first, last;
+
+	collection_get_visible_limits(vc->collection, &first, &last);
 
-	for (i = 0; i < 3; i++)
+	while (g_get_monotonic_time() - start < THUMB_SLICE)
 	{
 		if (g_queue_is_empty(vc->thumbs_queue))
 		{
@@ -552,9 +579,15 @@ static gboolean next_thumb(ViewCollection *vc)
 			return FALSE;
 		} else {
 			int idx = GPOINTER_TO_INT(g_queue_pop_tail(vc->thumbs_queue));
+			int row, col;
+
 			if (idx >= vc->collection->number_of_items)
 				continue;
 
+			collection_item_to_rowcol(vc->collection, idx, &row, &col);
+			if (row < first || row > last)
+				continue;	/* Still iconstatus 4 */
+
 			FilerWindow    *fw = vc->filer_window;
 			CollectionItem *colitem = &vc->collection->items[idx];
 			DirItem        *item = (DirItem *) colitem->data;
@@ -564,12 +597,7 @@ static gboolean next_thumb(ViewCollection *vc)
 				continue;
 
 			if (!view->thumb)
-			{
-				gchar *path = pathdup(
-						make_path(fw->real_path, item->leafname));
-				view->thumb = pixmap_load_thumb(path);
-				g_free(path);
-			}
+				view->thumb = load_thumb(fw, item);
 
 			if (!view->image || view->thumb)
 			{
@@ -713,9 +741,7 @@ static void draw_item(GtkWidget *widget,
 		{
 			view->iconstatus = 2;
 			g_clear_object(&view->thumb);
-			gchar *path = pathdup(make_path(fw->real_path, item->leafname));
-			view->thumb = pixmap_load_thumb(path);
-			g_free(path);
+			view->thumb = load_thumb(fw, item);
 		}
 
 		if (!view->thumb && !view->image)
@@ -1143,6 +1169,23 @@ static void view_collection_scroll_to_top(ViewIface *view)
 	gtk_adjustment_set_value(col->vadj, 0);
 }
 
+static void view_collection_get_visible_items(ViewIface *view,
+					      GPtrArray *items)
+{
+	Collection *col = ((ViewCollection *) view)->collection;
+	int first, last, row, c, i;
+
+	collection_get_visible_limits(col, &first, &last);
+
+	for (row = first; row <= last; row++)
+		for (c = 0; c < col->columns; c++)
+		{
+			i = collection_rowcol_to_item(col, row, c);
+			if (i < col->number_of_items)
+				g_ptr_array_add(items, col->items[i].data);
+		}
+}
+
 /* Create the handers for the View interface */
 static void view_collection_iface_init(gpointer giface, gpointer iface_data)
 {
@@ -1177,6 +1220,7 @@ static void view_collection_iface_init(gpointer giface, gpointer iface_data)
 	iface->extend_tip = view_collection_extend_tip;
 	iface->auto_scroll_callback = view_collection_auto_scroll_callback;
 	iface->scroll_to_top = view_collection_scroll_to_top;
+	iface->get_visible_items = view_collection_get_visible_items;
 }
 
 static void view_collection_extend_tip(ViewIface *view, ViewIter *iter,
@@ -1603,6 +1647,24 @@ static void view_collection_sort(ViewIface *view)
 {
 	ViewCollection	*view_collection = VIEW_COLLECTION(view);
 	FilerWindow	*filer_window = view_collection->filer_window;
+	Collection	*collection = view_collection->collection;
+	GPtrArray	*items;
+	int		i;
+
+	/* The other sorts only need the names of items which are equal */
+	if (filer_window->sort_type == SORT_NAME)
+	{
+		items = g_ptr_array_new();
+		for (i = 0; i < collection->number_of_items; i++)
+		{
+			DirItem *item = (DirItem *) collection->items[i].data;
+
+			if (!item->collatekey)
+				g_ptr_array_add(items, item);
+		}
+		diritem_make_collatekeys(items);
+		g_ptr_array_free(items, TRUE);
+	}
 
 	collection_qsort(view_collection->collection, sort_fn(filer_window),
 			filer_window->sort_order);
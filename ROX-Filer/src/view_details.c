@@ -327,7 +327,7 @@ static void details_get_value(GtkTreeModel *tree_model,
 		return;
 	}
 
-	if (item->base_type == TYPE_UNKNOWN)
+	if (ITEM_UNSCANNED(item))
 	{
 		GType type;
 		type = details_get_column_type(tree_model, column);
@@ -406,7 +406,9 @@ static void details_get_value(GtkTreeModel *tree_model,
 			break;
 		case COL_SIZE:
 			g_value_init(value, G_TYPE_STRING);
-			g_value_set_string(value, format_size(item->size));
+			g_value_set_string(value, format_count(item->size,
+					item->flags & ITEM_FLAG_COUNT_APPROX,
+					FALSE));
 			break;
 		case COL_TYPE:
 			g_value_init(value, G_TYPE_STRING);
@@ -1170,6 +1172,26 @@ static void view_details_scroll_to_top(ViewIface *view)
 			0);
 }
 
+static void view_details_get_visible_items(ViewIface *view, GPtrArray *items)
+{
+	ViewDetails *view_details = (ViewDetails *) view;
+	GtkTreePath *start, *end;
+	int i, last;
+
+	if (!gtk_tree_view_get_visible_range((GtkTreeView *) view,
+					     &start, &end))
+		return;
+
+	last = MIN(gtk_tree_path_get_indices(end)[0],
+		   view_details->items->len - 1);
+	for (i = gtk_tree_path_get_indices(start)[0]; i <= last; i++)
+		g_ptr_array_add(items,
+			((ViewItem *) view_details->items->pdata[i])->item);
+
+	gtk_tree_path_free(start);
+	gtk_tree_path_free(end);
+}
+
 
 #define ADD_TEXT_COLUMN_NS(name, model_column) \
 	cell = gtk_cell_renderer_text_new();	\
@@ -1308,6 +1330,7 @@ static void view_details_iface_init(gpointer giface, gpointer iface_data)
 	iface->extend_tip = view_details_extend_tip;
 	iface->auto_scroll_callback = view_details_auto_scroll_callback;
 	iface->scroll_to_top = view_details_scroll_to_top;
+	iface->get_visible_items = view_details_get_visible_items;
 }
 
 
@@ -1374,6 +1397,7 @@ static void resort(ViewDetails *view_details)
 	gint i, len = view_details->items->len;
 	guint *new_order;
 	GtkTreePath *path;
+	GPtrArray *keys;
 	int wink_item = view_details->wink_item;
 
 	if (!len)
@@ -1382,6 +1406,17 @@ static void resort(ViewDetails *view_details)
 	for (i = len - 1; i >= 0; i--)
 		items[i]->old_pos = i;
 
+	/* The other sorts only need the names of items which are equal */
+	if (view_details->filer_window->sort_type == SORT_NAME)
+	{
+		keys = g_ptr_array_new();
+		for (i = 0; i < len; i++)
+			if (!items[i]->item->collatekey)
+				g_ptr_array_add(keys, items[i]->item);
+		diritem_make_collatekeys(keys);
+		g_ptr_array_free(keys, TRUE);
+	}
+
 	switch (view_details->filer_window->sort_type)
 	{
 		case SORT_NAME: view_details->sort_fn = sort_by_name; break;
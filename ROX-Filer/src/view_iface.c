@@ -419,3 +419,13 @@ void view_scroll_to_top(ViewIface *obj)
 	VIEW_IFACE_GET_CLASS(obj)->scroll_to_top(obj);
 }
 
+/* Add the DirItems which are [partly] on screen to 'items', in display
+ * order.
+ */
+void view_get_visible_items(ViewIface *obj, GPtrArray *items)
+{
+	g_return_if_fail(VIEW_IS_IFACE(obj));
+
+	VIEW_IFACE_GET_CLASS(obj)->get_visible_items(obj, items);
+}
+